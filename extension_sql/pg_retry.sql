@@ -3,16 +3,302 @@
 -- Create schema for the extension
 CREATE SCHEMA retry;
 
+-- Named retry policies, see retry.create_policy(); NULL settings fall back
+-- to the GUC defaults when the policy is used
+CREATE TABLE retry.policy (
+  name TEXT PRIMARY KEY CHECK (octet_length(name) BETWEEN 1 AND 63),
+  max_tries INT CHECK (max_tries >= 1),
+  base_delay_ms INT CHECK (base_delay_ms >= 0),
+  max_delay_ms INT CHECK (max_delay_ms >= 0),
+  retry_sqlstates TEXT[],
+  strategy TEXT,
+  deadline_ms INT CHECK (deadline_ms >= 0),
+  -- per-SQLSTATE overrides, e.g. {"40001": {"max_tries": 10, "base_delay_ms": 0}}
+  sqlstate_policy JSONB CHECK (jsonb_typeof(sqlstate_policy) = 'object')
+);
+
+SELECT pg_catalog.pg_extension_config_dump('retry.policy', '');
+
+GRANT SELECT ON retry.policy TO PUBLIC;
+
+-- Backends cache policies; every change makes them reload
+CREATE OR REPLACE FUNCTION retry.policy_invalidate()
+RETURNS TRIGGER
+AS '$libdir/pg_retry', 'pg_retry_policy_invalidate'
+LANGUAGE C;
+
+CREATE TRIGGER policy_invalidate
+  AFTER INSERT OR UPDATE OR DELETE OR TRUNCATE ON retry.policy
+  FOR EACH STATEMENT EXECUTE FUNCTION retry.policy_invalidate();
+
+-- Create or replace a named policy
+CREATE OR REPLACE FUNCTION retry.create_policy(
+  name TEXT,
+  max_tries INT DEFAULT NULL,
+  base_delay_ms INT DEFAULT NULL,
+  max_delay_ms INT DEFAULT NULL,
+  retry_sqlstates TEXT[] DEFAULT NULL,
+  strategy TEXT DEFAULT NULL,
+  deadline_ms INT DEFAULT NULL,
+  sqlstate_policy JSONB DEFAULT NULL
+) RETURNS VOID
+AS '$libdir/pg_retry', 'pg_retry_create_policy'
+LANGUAGE C VOLATILE PARALLEL UNSAFE;
+
+-- Drop a named policy; false if it did not exist
+CREATE OR REPLACE FUNCTION retry.drop_policy(name TEXT)
+RETURNS BOOLEAN
+LANGUAGE sql VOLATILE PARALLEL UNSAFE
+AS $$
+  WITH dropped AS (
+    DELETE FROM retry.policy p WHERE p.name = drop_policy.name RETURNING 1
+  )
+  SELECT count(*) > 0 FROM dropped
+$$;
+
+REVOKE ALL ON FUNCTION retry.create_policy(TEXT, INT, INT, INT, TEXT[], TEXT, INT, JSONB) FROM PUBLIC;
+REVOKE ALL ON FUNCTION retry.drop_policy(TEXT) FROM PUBLIC;
+
 -- Create the retry function
 CREATE OR REPLACE FUNCTION retry.retry(
   sql TEXT,                          -- the SQL statement to run (exactly one statement)
   max_tries INT DEFAULT NULL,        -- total attempts = 1 + retries; must be >= 1
   base_delay_ms INT DEFAULT NULL,    -- initial backoff delay in milliseconds
   max_delay_ms INT DEFAULT NULL,     -- cap for exponential backoff
-  retry_sqlstates TEXT[] DEFAULT NULL
+  retry_sqlstates TEXT[] DEFAULT NULL,
+  strategy TEXT DEFAULT NULL,        -- backoff strategy, see pg_retry.default_backoff_strategy
+  deadline_ms INT DEFAULT NULL,      -- total time budget across all attempts; 0 for none
+  policy TEXT DEFAULT NULL           -- named policy from retry.policy, see retry.create_policy
 ) RETURNS INT                       -- number of rows processed/returned by the statement
 AS '$libdir/pg_retry', 'pg_retry_retry'
 LANGUAGE C VOLATILE PARALLEL RESTRICTED;
 
+-- Retry a parameterized statement, binding params to $1..$n
+CREATE OR REPLACE FUNCTION retry.retry_params(
+  sql TEXT,                          -- the SQL statement to run (exactly one statement)
+  params ANYARRAY,                   -- values for $1..$n, all of the array's element type
+  max_tries INT DEFAULT NULL,        -- total attempts = 1 + retries; must be >= 1
+  base_delay_ms INT DEFAULT NULL,    -- initial backoff delay in milliseconds
+  max_delay_ms INT DEFAULT NULL,     -- cap for exponential backoff
+  retry_sqlstates TEXT[] DEFAULT NULL,
+  strategy TEXT DEFAULT NULL,        -- backoff strategy, see pg_retry.default_backoff_strategy
+  deadline_ms INT DEFAULT NULL,      -- total time budget across all attempts; 0 for none
+  policy TEXT DEFAULT NULL           -- named policy from retry.policy, see retry.create_policy
+) RETURNS INT                       -- number of rows processed/returned by the statement
+AS '$libdir/pg_retry', 'pg_retry_retry_params'
+LANGUAGE C VOLATILE PARALLEL RESTRICTED;
+
+-- Retry a query and return the rows of the successful attempt;
+-- call with a column definition list: retry.retry_query(...) AS t(a int, ...)
+CREATE OR REPLACE FUNCTION retry.retry_query(
+  sql TEXT,                          -- the query to run (exactly one statement returning rows)
+  max_tries INT DEFAULT NULL,
+  base_delay_ms INT DEFAULT NULL,
+  max_delay_ms INT DEFAULT NULL,
+  retry_sqlstates TEXT[] DEFAULT NULL,
+  strategy TEXT DEFAULT NULL,
+  deadline_ms INT DEFAULT NULL,
+  policy TEXT DEFAULT NULL
+) RETURNS SETOF RECORD
+AS '$libdir/pg_retry', 'pg_retry_retry_query'
+LANGUAGE C VOLATILE PARALLEL RESTRICTED;
+
+-- Run several statements in order, each in its own subtransaction with retry
+CREATE OR REPLACE FUNCTION retry.retry_batch(
+  statements TEXT[],                 -- one statement per element, validated before any runs
+  max_tries INT DEFAULT NULL,        -- per statement; total attempts = 1 + retries
+  base_delay_ms INT DEFAULT NULL,
+  max_delay_ms INT DEFAULT NULL,
+  retry_sqlstates TEXT[] DEFAULT NULL,
+  strategy TEXT DEFAULT NULL,
+  deadline_ms INT DEFAULT NULL,
+  policy TEXT DEFAULT NULL,
+  idempotent BOOLEAN DEFAULT false   -- one subtransaction per attempt for the whole batch,
+                                     -- which is rerun from the start after a failure
+) RETURNS TABLE (
+  statement_no INT,                  -- 1-based position in statements
+  processed INT,                     -- rows processed by the statement
+  attempts INT                       -- attempts it took
+)
+AS '$libdir/pg_retry', 'pg_retry_retry_batch'
+LANGUAGE C VOLATILE PARALLEL RESTRICTED;
+
+-- Run several statements as one unit: each attempt runs all of them in a
+-- single subtransaction, and any retryable failure reruns the whole group
+CREATE OR REPLACE FUNCTION retry.retry_xact(
+  statements TEXT[],                 -- one statement per element, validated before any runs
+  max_tries INT DEFAULT NULL,        -- for the whole group
+  base_delay_ms INT DEFAULT NULL,
+  max_delay_ms INT DEFAULT NULL,
+  retry_sqlstates TEXT[] DEFAULT NULL,
+  strategy TEXT DEFAULT NULL,
+  deadline_ms INT DEFAULT NULL,
+  policy TEXT DEFAULT NULL
+) RETURNS INT                        -- rows processed by all statements
+AS '$libdir/pg_retry', 'pg_retry_retry_xact'
+LANGUAGE C VOLATILE PARALLEL RESTRICTED;
+
+-- Subtransactions pg_retry started in the current transaction, and the
+-- backend's cache of subtransaction IDs that overflows past cache_size
+CREATE OR REPLACE FUNCTION retry.subxact_usage(
+  OUT subxacts BIGINT,               -- started by pg_retry in this transaction
+  OUT cached_subxids INT,            -- subtransaction IDs cached for this transaction
+  OUT cache_size INT,
+  OUT overflowed BOOLEAN
+) RETURNS SETOF RECORD
+AS '$libdir/pg_retry', 'pg_retry_subxact_usage'
+LANGUAGE C VOLATILE STRICT PARALLEL RESTRICTED;
+
+-- Statements queued by retry.retry_async(), with the policy resolved when
+-- they were queued; each role sees and runs only its own jobs. Only the
+-- owner of the table writes to it: retry_async() and the workers switch to
+-- it, so a role cannot queue a statement under another role's name
+CREATE TABLE retry.async_job (
+  id BIGSERIAL PRIMARY KEY,
+  userid OID NOT NULL,               -- role the statement runs as
+  sql TEXT NOT NULL,
+  max_tries INT NOT NULL CHECK (max_tries >= 1),
+  base_delay_ms INT NOT NULL CHECK (base_delay_ms >= 0),
+  max_delay_ms INT NOT NULL CHECK (max_delay_ms >= base_delay_ms),
+  retry_sqlstates TEXT[] NOT NULL,
+  strategy TEXT NOT NULL CHECK (strategy IN ('exponential', 'full_jitter', 'equal_jitter',
+                                             'decorrelated_jitter', 'linear', 'constant')),
+  deadline_ms INT NOT NULL CHECK (deadline_ms >= 0),
+  sqlstate_policy JSONB CHECK (jsonb_typeof(sqlstate_policy) = 'object'),
+  status TEXT NOT NULL DEFAULT 'queued' CHECK (status IN ('queued', 'succeeded', 'failed')),
+  attempts INT,                      -- attempts the successful run took
+  rows_processed INT,
+  last_sqlstate TEXT,                -- why the job failed
+  last_error TEXT,
+  enqueued_at TIMESTAMPTZ NOT NULL DEFAULT now(),
+  started_at TIMESTAMPTZ,
+  finished_at TIMESTAMPTZ
+);
+
+CREATE INDEX async_job_queued ON retry.async_job (userid, id) WHERE status = 'queued';
+
+ALTER TABLE retry.async_job ENABLE ROW LEVEL SECURITY;
+CREATE POLICY async_job_owner ON retry.async_job FOR SELECT
+  USING (pg_catalog.pg_has_role(userid, 'MEMBER'));
+
+GRANT SELECT ON retry.async_job TO PUBLIC;
+
+-- Queue a statement for a background worker and return its job ID; the
+-- worker runs it with retry once the calling transaction commits
+-- (requires shared_preload_libraries = 'pg_retry')
+CREATE OR REPLACE FUNCTION retry.retry_async(
+  sql TEXT,                          -- the SQL statement to run (exactly one statement)
+  max_tries INT DEFAULT NULL,
+  base_delay_ms INT DEFAULT NULL,
+  max_delay_ms INT DEFAULT NULL,
+  retry_sqlstates TEXT[] DEFAULT NULL,
+  strategy TEXT DEFAULT NULL,
+  deadline_ms INT DEFAULT NULL,      -- counted from when the worker starts the job
+  policy TEXT DEFAULT NULL
+) RETURNS BIGINT
+AS '$libdir/pg_retry', 'pg_retry_retry_async'
+LANGUAGE C VOLATILE PARALLEL UNSAFE;
+
+-- Outcome of a queued statement; no row for unknown jobs and those of
+-- other roles
+CREATE OR REPLACE FUNCTION retry.async_status(
+  job_id BIGINT,
+  OUT status TEXT,                   -- queued, succeeded or failed
+  OUT attempts INT,
+  OUT rows_processed INT,
+  OUT last_sqlstate TEXT,
+  OUT last_error TEXT,
+  OUT enqueued_at TIMESTAMPTZ,
+  OUT started_at TIMESTAMPTZ,
+  OUT finished_at TIMESTAMPTZ
+) RETURNS SETOF RECORD
+LANGUAGE sql STABLE STRICT PARALLEL SAFE
+AS $$
+  SELECT j.status, j.attempts, j.rows_processed, j.last_sqlstate, j.last_error,
+         j.enqueued_at, j.started_at, j.finished_at
+  FROM retry.async_job j
+  WHERE j.id = async_status.job_id
+$$;
+
+-- Cluster-wide retry counters (requires shared_preload_libraries = 'pg_retry')
+CREATE OR REPLACE FUNCTION retry.stats(
+  OUT calls BIGINT,                  -- retry.retry* calls
+  OUT attempts BIGINT,               -- statement executions, including retries
+  OUT successes BIGINT,              -- calls that eventually succeeded
+  OUT retries BIGINT,                -- failed attempts that were retried
+  OUT exhausted BIGINT,              -- calls that failed after their last attempt
+  OUT non_retryable BIGINT,          -- calls that failed on a non-retryable error
+  OUT budget_denied BIGINT,          -- calls cut short by the retry budget (also in exhausted)
+  OUT sleep_time_ms DOUBLE PRECISION, -- total time spent in backoff
+  OUT stats_reset TIMESTAMPTZ
+) RETURNS SETOF RECORD
+AS '$libdir/pg_retry', 'pg_retry_stats'
+LANGUAGE C VOLATILE STRICT PARALLEL RESTRICTED;
+
+-- Retryable failures per SQLSTATE
+CREATE OR REPLACE FUNCTION retry.sqlstate_stats(
+  OUT sqlstate TEXT,                 -- NULL collects codes beyond the tracked slots
+  OUT retries BIGINT,
+  OUT exhausted BIGINT
+) RETURNS SETOF RECORD
+AS '$libdir/pg_retry', 'pg_retry_sqlstate_stats'
+LANGUAGE C VOLATILE STRICT PARALLEL RESTRICTED;
+
+-- Time spent in each phase of retried calls (pg_retry.track_timing)
+CREATE OR REPLACE FUNCTION retry.phase_timings(
+  OUT phase TEXT,                    -- validate, prepare, spi_connect, subxact_begin, execute,
+                                     -- subxact_release, error_rollback or backoff
+  OUT bucket_lower_us BIGINT,        -- durations in [bucket_lower_us, bucket_upper_us)
+  OUT bucket_upper_us BIGINT,        -- NULL for the last, open-ended bucket
+  OUT count BIGINT
+) RETURNS SETOF RECORD
+AS '$libdir/pg_retry', 'pg_retry_phase_timings'
+LANGUAGE C VOLATILE STRICT PARALLEL RESTRICTED;
+
+CREATE OR REPLACE FUNCTION retry.stats_reset()
+RETURNS VOID
+AS '$libdir/pg_retry', 'pg_retry_stats_reset'
+LANGUAGE C VOLATILE PARALLEL RESTRICTED;
+
+REVOKE ALL ON FUNCTION retry.stats_reset() FROM PUBLIC;
+
+-- Per-statement retry statistics, keyed by query fingerprint
+CREATE OR REPLACE FUNCTION retry.statement_stats(
+  OUT userid OID,
+  OUT dbid OID,
+  OUT queryid BIGINT,                -- fingerprint; NULL for other users' statements
+  OUT query TEXT,                    -- statement text as first seen (truncated)
+  OUT calls BIGINT,
+  OUT attempts BIGINT,
+  OUT successes BIGINT,
+  OUT exhausted BIGINT,              -- calls that failed after their last attempt
+  OUT non_retryable BIGINT,          -- calls that failed on a non-retryable error
+  OUT failures_by_sqlstate JSONB,    -- retryable failures per SQLSTATE
+  OUT total_backoff_ms DOUBLE PRECISION,
+  OUT backoff_histogram BIGINT[],    -- sleeps in [0,1), [1,2), [2,4) ... [512,1024), >= 1024 ms
+  OUT mean_exec_time_ms DOUBLE PRECISION, -- per attempt
+  OUT p50_exec_time_ms DOUBLE PRECISION,
+  OUT p95_exec_time_ms DOUBLE PRECISION,
+  OUT p99_exec_time_ms DOUBLE PRECISION,
+  OUT max_exec_time_ms DOUBLE PRECISION,
+  OUT breaker_state TEXT,            -- closed, open or half_open; NULL without a breaker
+  OUT breaker_opens BIGINT,          -- times the circuit breaker opened
+  OUT breaker_state_since TIMESTAMPTZ -- last breaker transition
+) RETURNS SETOF RECORD
+AS '$libdir/pg_retry', 'pg_retry_statement_stats'
+LANGUAGE C VOLATILE STRICT PARALLEL RESTRICTED;
+
+CREATE VIEW retry.statement_stats AS
+  SELECT * FROM retry.statement_stats();
+
+GRANT SELECT ON retry.statement_stats TO PUBLIC;
+
+CREATE OR REPLACE FUNCTION retry.statement_stats_reset()
+RETURNS VOID
+AS '$libdir/pg_retry', 'pg_retry_statement_stats_reset'
+LANGUAGE C VOLATILE PARALLEL RESTRICTED;
+
+REVOKE ALL ON FUNCTION retry.statement_stats_reset() FROM PUBLIC;
+
 -- Grant usage on the schema
 GRANT USAGE ON SCHEMA retry TO PUBLIC;
@@ -15,6 +15,45 @@
 #include "parser/parser.h"
 #include "nodes/parsenodes.h"
 #include "nodes/nodes.h"
+#include "common/hashfn.h"
+#include "lib/ilist.h"
+#include "lib/stringinfo.h"
+#include "utils/hsearch.h"
+#include "common/int.h"
+#include "funcapi.h"
+#include "port/atomics.h"
+#include "storage/ipc.h"
+#include "storage/lwlock.h"
+#include "storage/shmem.h"
+#include "utils/timestamp.h"
+#include "catalog/pg_authid.h"
+#include "catalog/pg_class.h"
+#include "access/htup_details.h"
+#include "utils/syscache.h"
+#include "mb/pg_wchar.h"
+#include "nodes/queryjumble.h"
+#include "port/pg_bitutils.h"
+#include "portability/instr_time.h"
+#include "storage/condition_variable.h"
+#include "storage/latch.h"
+#include "storage/proc.h"
+#include "storage/spin.h"
+#include "utils/acl.h"
+#include "utils/plancache.h"
+#include "utils/snapmgr.h"
+#include "optimizer/optimizer.h"
+#include "utils/wait_event.h"
+#include "utils/timeout.h"
+#include "catalog/namespace.h"
+#include "commands/trigger.h"
+#include "utils/inval.h"
+#include "executor/executor.h"
+#include "executor/instrument.h"
+#include "utils/jsonb.h"
+#include "pgstat.h"
+#include "postmaster/bgworker.h"
+#include "postmaster/interrupt.h"
+#include "storage/procarray.h"
 #include <ctype.h>
 #include <math.h>
 #include <stdlib.h>
@@ -26,16 +65,65 @@
 #include "common/pg_prng.h" /* jitter depends on the backend PRNG API added in PG17 */
 #define PG_RETRY_RANDOM_DOUBLE() pg_prng_double(&pg_global_prng_state) /* stay consistent with backend randomness */
 
+/*
+ * PostgreSQL 18+ lets extensions register cumulative statistics kinds; the
+ * call counters use one there, so they persist across restarts.
+ */
+#if PG_VERSION_NUM >= 180000
+#define PG_RETRY_PGSTAT
+#include "utils/pgstat_internal.h"
+#endif
+
 /* PostgreSQL 19+ removed SPI_restore_connection(); keep retries portable. */
 #ifndef SPI_restore_connection
 #define SPI_restore_connection() ((void) 0)
 #endif
 PG_MODULE_MAGIC;
 
+/* Backoff schedules selectable per call or via pg_retry.default_backoff_strategy */
+typedef enum BackoffStrategy
+{
+    BACKOFF_EXPONENTIAL,         /* base * 2^(n-1), capped, +/-20% jitter */
+    BACKOFF_FULL_JITTER,         /* uniform in [0, exponential] */
+    BACKOFF_EQUAL_JITTER,        /* half exponential plus uniform half */
+    BACKOFF_DECORRELATED_JITTER, /* uniform in [base, 3 * previous delay] */
+    BACKOFF_LINEAR,              /* base * n, capped */
+    BACKOFF_CONSTANT             /* base */
+} BackoffStrategy;
+
+static const struct config_enum_entry backoff_strategy_options[] = {
+    {"exponential", BACKOFF_EXPONENTIAL, false},
+    {"full_jitter", BACKOFF_FULL_JITTER, false},
+    {"equal_jitter", BACKOFF_EQUAL_JITTER, false},
+    {"decorrelated_jitter", BACKOFF_DECORRELATED_JITTER, false},
+    {"linear", BACKOFF_LINEAR, false},
+    {"constant", BACKOFF_CONSTANT, false},
+    {NULL, 0, false}
+};
+
+/* Where retry messages go; off also skips building them */
+typedef enum RetryLogLevel
+{
+    RETRY_LOG_OFF,
+    RETRY_LOG_DEBUG,             /* DEBUG1, server log only by default */
+    RETRY_LOG_WARNING            /* WARNING, also sent to the client */
+} RetryLogLevel;
+
+static const struct config_enum_entry log_level_options[] = {
+    {"off", RETRY_LOG_OFF, false},
+    {"debug", RETRY_LOG_DEBUG, false},
+    {"warning", RETRY_LOG_WARNING, false},
+    {NULL, 0, false}
+};
+
+/* Distinct SQLSTATEs aggregated between two summary lines */
+#define PG_RETRY_LOG_SUMMARY_SQLSTATES 8
+
 /* GUC variables */
 static int pg_retry_default_max_tries = 3;
 static int pg_retry_default_base_delay_ms = 50;
 static int pg_retry_default_max_delay_ms = 1000;
+static int pg_retry_default_deadline_ms = 0;
 /* Default SQLSTATEs to retry on 
 40001: serialization_failure
 40P01: deadlock_detected
@@ -43,51 +131,840 @@ static int pg_retry_default_max_delay_ms = 1000;
 57014: query_canceled (e.g., statement_timeout)
 */
 static char *pg_retry_default_sqlstates_str = "40001,40P01,55P03,57014";
+static bool pg_retry_plan_cache_enabled = true;
+static int pg_retry_plan_cache_size = 128;
+static bool pg_retry_track_stats = true;
+#ifdef PG_RETRY_PGSTAT
+static int pg_retry_stats_kind_id = PGSTAT_KIND_EXPERIMENTAL;
+#endif
+static int pg_retry_max_statements = 1000;
+static bool pg_retry_adaptive_backoff = false;
+static int pg_retry_default_backoff_strategy = BACKOFF_EXPONENTIAL;
+static bool pg_retry_wait_for_locks = false;
+static double pg_retry_retry_budget_ratio = -1.0;
+static int pg_retry_retry_budget_burst = 100;
+static int pg_retry_breaker_threshold = 0;
+static int pg_retry_breaker_window_ms = 10000;
+static int pg_retry_breaker_cooldown_ms = 5000;
+static int pg_retry_log_level = RETRY_LOG_WARNING;
+static int pg_retry_log_summary_interval_ms = 0;
+static bool pg_retry_auto = false;
+static bool pg_retry_track_timing = false;
+static int pg_retry_async_max_workers = 4;
+static int pg_retry_async_batch_size = 16;
+static int pg_retry_subxact_warning_threshold = 48;
+static int pg_retry_fairness_after_attempts = 0;
+static int pg_retry_fairness_wait_ms = 10;
+static bool pg_retry_snapshot_fail_fast = true;
+
+/*
+ * Backend-local cache of prepared plans, keyed by a hash of the SQL text.
+ * Plans are saved with SPI_keepplan() so the regular plancache machinery
+ * revalidates them after DDL, search_path changes, etc.; all we have to do
+ * here is bound the number of entries. The full text is kept alongside the
+ * plan so a hash collision is treated as a miss instead of running the
+ * wrong statement.
+ */
+typedef struct PlanCacheEntry
+{
+    uint64 key;          /* hash of the SQL text and parameter types */
+    char *sql;           /* copy of the SQL text */
+    int nargs;           /* number of bound parameters */
+    Oid *argtypes;       /* parameter types, NULL when nargs == 0 */
+    SPIPlanPtr plan;     /* saved plan */
+    uint64 queryid;      /* statement fingerprint for per-statement stats */
+    bool read_only;      /* plain SELECT as of the attempt that last ran it */
+    int refcount;        /* number of active calls using this plan */
+    dlist_node lru_node; /* LRU position, most recently used at head */
+} PlanCacheEntry;
+
+static HTAB *plan_cache = NULL;
+static dlist_head plan_cache_lru = DLIST_STATIC_INIT(plan_cache_lru);
+static MemoryContext plan_cache_context = NULL;
+
+/*
+ * Pins held by running calls, in the order they were taken, with the
+ * subtransaction level that owns them. An error raised outside an attempt
+ * skips plan_cache_release(), so when a subtransaction aborts, the pins it
+ * owns are dropped; pins of a committed subtransaction pass to its parent.
+ */
+typedef struct PlanCachePin
+{
+    PlanCacheEntry *entry;
+    int nestlevel;
+} PlanCachePin;
+
+/*
+ * Backend-local set of SQL texts that passed validate_sql(), so a repeated
+ * statement that is not, or no longer, in the plan cache is parsed by SPI
+ * alone. The outcome depends only on the text and on how the lexer reads
+ * string literals, so standard_conforming_strings is part of the key, and
+ * there is nothing to invalidate. The full text is kept so a hash collision
+ * is treated as a miss.
+ */
+#define PG_RETRY_VALIDATED_CACHE_SIZE 1024
+
+typedef struct ValidatedSqlEntry
+{
+    uint64 key;          /* hash of the SQL text and standard_conforming_strings */
+    char *sql;           /* copy of the SQL text */
+    dlist_node lru_node; /* LRU position, most recently used at head */
+} ValidatedSqlEntry;
+
+static HTAB *validated_cache = NULL;
+static dlist_head validated_cache_lru = DLIST_STATIC_INIT(validated_cache_lru);
+static MemoryContext validated_cache_context = NULL;
+
+static PlanCachePin *plan_cache_pins = NULL;
+static int plan_cache_npins = 0;
+static int plan_cache_maxpins = 0;
+
+/*
+ * Compiled set of retryable SQLSTATEs as packed sqlerrcodes, kept sorted so
+ * classifying an error is a binary search over integers
+ */
+typedef struct SqlStateSet
+{
+    int nstates;
+    int states[FLEXIBLE_ARRAY_MEMBER];
+} SqlStateSet;
+
+/* pg_retry.default_sqlstates compiled by its check hook */
+static SqlStateSet *pg_retry_default_sqlstate_set = NULL;
+
+/*
+ * Per-SQLSTATE overrides of a policy, compiled from the sqlstate_policy
+ * object of a named policy and sorted by sqlerrcode. A code listed here is
+ * retried even when retry_sqlstates leaves it out; a setting of -1 is taken
+ * from the policy.
+ */
+typedef struct SqlStateRule
+{
+    int sqlerrcode;               /* first, so sqlerrcode_cmp() sorts rules */
+    int max_tries;
+    int base_delay_ms;
+    int max_delay_ms;
+    int strategy;
+} SqlStateRule;
+
+typedef struct SqlStatePolicy
+{
+    int nrules;
+    SqlStateRule rules[FLEXIBLE_ARRAY_MEMBER];
+} SqlStatePolicy;
+
+/*
+ * Backend-local cache of the named policies in retry.policy. A column left
+ * NULL in the table is -1 (or NULL) here and falls back to the GUC default
+ * when the policy is used. A statement-level trigger on the table sends a
+ * relcache invalidation for every change, upon which the whole cache is
+ * dropped.
+ */
+typedef struct PolicyCacheEntry
+{
+    char name[NAMEDATALEN];       /* hash key */
+    int max_tries;
+    int base_delay_ms;
+    int max_delay_ms;
+    SqlStateSet *retry_sqlstates;
+    int strategy;
+    int deadline_ms;
+    SqlStatePolicy *sqlstate_policy;
+} PolicyCacheEntry;
+
+static HTAB *policy_cache = NULL;
+static MemoryContext policy_cache_context = NULL;
+static Oid policy_relid = InvalidOid;
+
+/*
+ * Retry settings for one call, resolved from the function arguments with the
+ * GUCs as defaults
+ */
+typedef struct RetryPolicy
+{
+    int max_tries;
+    int base_delay_ms;
+    int max_delay_ms;
+    SqlStateSet *retry_sqlstates;
+    BackoffStrategy strategy;
+    int deadline_ms;          /* total time budget, 0 for none */
+    TimestampTz deadline;     /* when the budget runs out, 0 for none */
+    SqlStatePolicy *sqlstate_policy; /* per-SQLSTATE overrides, NULL for none */
+} RetryPolicy;
+
+/*
+ * DestReceiver for attempts whose rows go to the caller: tuples are written
+ * straight into the SRF's tuplestore, bypassing SPI_tuptable, after checking
+ * they match the descriptor the caller expects. The tuplestore belongs to
+ * the calling query, so it is written under the caller's resource owner and
+ * not the attempt's subtransaction.
+ */
+typedef struct RetryReceiver
+{
+    DestReceiver pub;
+    Tuplestorestate *tstore;
+    TupleDesc expected;
+    ResourceOwner owner;
+    MemoryContext context;
+} RetryReceiver;
+
+/* Number of distinct SQLSTATEs tracked in shared memory */
+#define PG_RETRY_SQLSTATE_SLOTS 64
+/* Distinct SQLSTATEs buffered per backend before forcing a flush */
+#define PG_RETRY_PENDING_SQLSTATES 8
+
+/*
+ * Cluster-wide retry counters. Everything is a lock-free atomic; SQLSTATE
+ * slots are claimed with compare-and-swap and never released, a reset only
+ * zeroes the counts.
+ */
+typedef struct RetrySqlStateCounter
+{
+    pg_atomic_uint32 sqlerrcode; /* 0 while the slot is unused */
+    pg_atomic_uint64 retries;    /* failed attempts that were retried */
+    pg_atomic_uint64 exhausted;  /* calls that gave up on this SQLSTATE */
+} RetrySqlStateCounter;
+
+/*
+ * Contention estimate shared by all backends retrying statements that hash
+ * to the same slot: an EWMA of the failure rate of recent attempts, fixed
+ * point with PG_RETRY_RATE_ONE meaning every attempt failed, and the number
+ * of backends sleeping in backoff right now. With fairness on, the slot also
+ * counts the late attempts running on it; fresh calls wait on fairness_cv
+ * until that drops to zero.
+ */
+#define PG_RETRY_CONTENTION_SLOTS 256
+#define PG_RETRY_RATE_ONE 65536
+/* EWMA weight of one attempt is 1/2^PG_RETRY_RATE_SHIFT */
+#define PG_RETRY_RATE_SHIFT 4
+/* Upper bound on how far contention stretches a delay */
+#define PG_RETRY_ADAPTIVE_MAX_SCALE 16.0
+
+typedef struct RetryContentionSlot
+{
+    pg_atomic_uint32 failure_rate;
+    pg_atomic_uint32 sleepers;
+    pg_atomic_uint32 tickets;
+    ConditionVariable fairness_cv;
+} RetryContentionSlot;
+
+/*
+ * Cluster-wide retry budget, a token bucket: every call deposits
+ * pg_retry.retry_budget_ratio tokens for its first attempt, every retry
+ * takes one, and the balance never exceeds pg_retry.retry_budget_burst. So
+ * over any stretch of time the retries stay within ratio * first attempts
+ * plus the burst, however many backends are failing at once.
+ *
+ * Every call deposits, so the balance is a single atomic in fixed point
+ * (PG_RETRY_BUDGET_ONE per token) updated by compare-and-swap rather than
+ * under a lock. While the bucket is full, which is the usual state when
+ * little is failing, a deposit only reads it.
+ */
+#define PG_RETRY_BUDGET_ONE UINT64CONST(65536)
+
+typedef struct RetryBudget
+{
+    pg_atomic_uint64 tokens;
+} RetryBudget;
+
+/*
+ * Background workers running the jobs queued by retry.retry_async(), at
+ * most one per (database, role). A slot is taken by the backend that
+ * registers the worker and given back by the worker when it exits; pid is 0
+ * until the worker has started.
+ */
+#define PG_RETRY_ASYNC_SLOTS 64
+/* A registered worker that has not started after this long never will */
+#define PG_RETRY_ASYNC_START_TIMEOUT_MS 10000
+/* How long a worker waits for new jobs before it exits */
+#define PG_RETRY_ASYNC_IDLE_MS 10000
+
+typedef struct RetryAsyncSlot
+{
+    bool in_use;
+    Oid dbid;
+    Oid userid;
+    pid_t pid;
+    TimestampTz registered;
+} RetryAsyncSlot;
+
+/*
+ * The counters shown by retry.stats()
+ */
+typedef struct RetryStatCounters
+{
+    PgStat_Counter calls;
+    PgStat_Counter attempts;
+    PgStat_Counter successes;
+    PgStat_Counter retries;
+    PgStat_Counter exhausted;
+    PgStat_Counter non_retryable;
+    PgStat_Counter budget_denied;   /* retries refused by the retry budget */
+    PgStat_Counter sleep_us;
+    TimestampTz stat_reset_timestamp;
+} RetryStatCounters;
+
+#ifdef PG_RETRY_PGSTAT
+/*
+ * Shared part of the fixed-numbered pgstat kind holding RetryStatCounters.
+ * The kind ID comes from pg_retry.stats_kind_id. Backends add their pending
+ * counters under the lock, and readers copy them without it, using the
+ * change count to detect a concurrent update.
+ */
+#define PG_RETRY_PGSTAT_KIND ((PgStat_Kind) pg_retry_stats_kind_id)
+
+typedef struct RetryStatShared
+{
+    LWLock lock;                  /* serializes writers of stats */
+    uint32 changecount;
+    RetryStatCounters stats;
+} RetryStatShared;
+
+/* Counters of this backend that pgstat has not flushed yet */
+static RetryStatCounters retry_pgstat_pending;
+static bool retry_pgstat_have_pending = false;
+#endif
+
+/*
+ * Phases of a retried call timed with pg_retry.track_timing
+ */
+typedef enum RetryPhase
+{
+    RETRY_PHASE_VALIDATE,       /* parsing and checking the text up front */
+    RETRY_PHASE_PREPARE,        /* SPI_prepare() and validation on a plan cache miss */
+    RETRY_PHASE_SPI_CONNECT,
+    RETRY_PHASE_SUBXACT_BEGIN,
+    RETRY_PHASE_EXECUTE,
+    RETRY_PHASE_SUBXACT_RELEASE,
+    RETRY_PHASE_ERROR_ROLLBACK, /* copying the error, rolling back the subtransaction */
+    RETRY_PHASE_BACKOFF,
+    RETRY_PHASE_FAIRNESS_WAIT,  /* a first attempt yielding to older retriers */
+    RETRY_NUM_PHASES
+} RetryPhase;
+
+static const char *const retry_phase_names[RETRY_NUM_PHASES] = {
+    "validate",
+    "prepare",
+    "spi_connect",
+    "subxact_begin",
+    "execute",
+    "subxact_release",
+    "error_rollback",
+    "backoff",
+    "fairness_wait"
+};
+
+/*
+ * Log-linear histogram of microseconds: the values 0 to 3 get a bucket each,
+ * then every power of two is split into four equal buckets. The last bucket
+ * starts at 3.5 * 2^30 us (about an hour) and takes everything above.
+ */
+#define PG_RETRY_TIMING_BUCKETS 124
+
+typedef struct RetryPhaseTimings
+{
+    pg_atomic_uint64 counts[RETRY_NUM_PHASES][PG_RETRY_TIMING_BUCKETS];
+} RetryPhaseTimings;
+
+typedef struct RetrySharedState
+{
+#ifndef PG_RETRY_PGSTAT
+    pg_atomic_uint64 calls;
+    pg_atomic_uint64 attempts;
+    pg_atomic_uint64 successes;
+    pg_atomic_uint64 retries;
+    pg_atomic_uint64 exhausted;
+    pg_atomic_uint64 non_retryable;
+    pg_atomic_uint64 sleep_us;
+    pg_atomic_uint64 stats_reset; /* TimestampTz of the last reset */
+    pg_atomic_uint64 budget_denied; /* retries refused by the retry budget */
+#endif
+    RetrySqlStateCounter sqlstates[PG_RETRY_SQLSTATE_SLOTS];
+    RetrySqlStateCounter other;   /* overflow once all slots are taken */
+    LWLock *lock;                 /* protects the statement hash table */
+    LWLock *breaker_lock;         /* protects the breaker hash table */
+    LWLock *async_lock;           /* protects async_workers */
+    RetryContentionSlot contention[PG_RETRY_CONTENTION_SLOTS];
+    RetryBudget budget;
+    RetryPhaseTimings timings;
+    RetryAsyncSlot async_workers[PG_RETRY_ASYNC_SLOTS];
+} RetrySharedState;
+
+/*
+ * Counters accumulated by this backend and flushed to RetrySharedState at
+ * transaction end, so the hot path never touches shared cache lines.
+ */
+typedef struct RetryPendingStats
+{
+    bool pending;
+    uint64 calls;
+    uint64 attempts;
+    uint64 successes;
+    uint64 retries;
+    uint64 exhausted;
+    uint64 non_retryable;
+    uint64 budget_denied;
+    uint64 sleep_us;
+    int nsqlstates;
+    struct
+    {
+        int sqlerrcode;
+        uint64 retries;
+        uint64 exhausted;
+    } sqlstates[PG_RETRY_PENDING_SQLSTATES];
+} RetryPendingStats;
+
+/*
+ * Per-statement statistics, pg_stat_statements style: a fixed-size shared
+ * hash table keyed by (user, database, fingerprint). The fingerprint is the
+ * core query jumble of the prepared statement, which ignores constants and
+ * whitespace; statements that never got a plan fall back to a hash of their
+ * text. When the table is full the least used entries are evicted.
+ */
+#define PG_RETRY_STATEMENT_TEXT_LEN 256
+/* Distinct retryable SQLSTATEs tracked per statement, beyond that "other" */
+#define PG_RETRY_STATEMENT_SQLSTATES 4
+/* Backoff buckets: [0,1) ms, then [2^(i-1), 2^i) ms, the last is >= 1024 ms */
+#define PG_RETRY_BACKOFF_BUCKETS 12
+/*
+ * Execution-time histogram in microseconds, log-linear: exact below 4 us,
+ * then four buckets per power of two up to 2^PG_RETRY_HIST_MAX_MSB us
+ * (~134 s), so percentiles are within 25% of the true value.
+ */
+#define PG_RETRY_HIST_MAX_MSB 27
+#define PG_RETRY_HIST_BUCKETS (4 + (PG_RETRY_HIST_MAX_MSB - 1) * 4)
+/* Execution times buffered per call before they are pushed to the entry */
+#define PG_RETRY_CALL_EXEC_TIMES 16
+
+#define PG_RETRY_USAGE_INIT 1.0
+#define PG_RETRY_USAGE_DECREASE_FACTOR 0.99
+#define PG_RETRY_USAGE_DEALLOC_PERCENT 5
+#define PG_RETRY_USAGE_DEALLOC_MIN 10
+
+typedef struct RetryStatementKey
+{
+    Oid userid;
+    Oid dbid;
+    uint64 queryid;
+} RetryStatementKey;
+
+typedef struct RetryStatementCounters
+{
+    int64 calls;
+    int64 attempts;
+    int64 successes;
+    int64 exhausted;
+    int64 non_retryable;
+    int nsqlstates;
+    int sqlstates[PG_RETRY_STATEMENT_SQLSTATES];
+    int64 sqlstate_failures[PG_RETRY_STATEMENT_SQLSTATES];
+    int64 other_failures;
+    int64 backoff_hist[PG_RETRY_BACKOFF_BUCKETS];
+    double total_backoff_ms;
+    int64 exec_hist[PG_RETRY_HIST_BUCKETS];
+    double total_exec_ms;
+    double max_exec_ms;
+    double usage;          /* eviction priority, decays on every sweep */
+} RetryStatementCounters;
+
+typedef struct RetryStatementEntry
+{
+    RetryStatementKey key;
+    RetryStatementCounters counters;
+    slock_t mutex;         /* protects the counters */
+    int query_len;
+    char query[PG_RETRY_STATEMENT_TEXT_LEN];
+} RetryStatementEntry;
+
+/*
+ * One call's contribution to its statement entry, accumulated locally and
+ * stored once the call finishes (or the execution-time buffer fills up)
+ */
+typedef struct StatementCallStats
+{
+    uint64 queryid;
+    Oid userid;                  /* role the call ran as */
+    const char *sql;
+    instr_time attempt_start;
+    int64 calls;
+    int64 attempts;
+    int64 successes;
+    int64 exhausted;
+    int64 non_retryable;
+    int nsqlstates;
+    int sqlstates[PG_RETRY_STATEMENT_SQLSTATES];
+    int64 sqlstate_failures[PG_RETRY_STATEMENT_SQLSTATES];
+    int64 other_failures;
+    int64 backoff_hist[PG_RETRY_BACKOFF_BUCKETS];
+    double total_backoff_ms;
+    int nexec;
+    double exec_ms[PG_RETRY_CALL_EXEC_TIMES];
+} StatementCallStats;
+
+/*
+ * The failure of a call's only attempt, which ran without a subtransaction.
+ * Its error is rethrown before the transaction is rolled back, so the
+ * counters, statement stats and circuit breaker see it at transaction end.
+ */
+typedef struct DeferredFailure
+{
+    uint64 fingerprint;
+    int sqlerrcode;
+    bool retryable;
+    bool track;                  /* counted in the pg_retry statistics */
+    StatementCallStats *stats;   /* in TopMemoryContext, or NULL */
+} DeferredFailure;
+
+static List *retry_deferred_failures = NIL;
+
+/*
+ * Circuit breakers, one per (database, fingerprint) in a shared hash table.
+ * A breaker opens after pg_retry.breaker_threshold retryable failures within
+ * pg_retry.breaker_window_ms; while open, calls make a single attempt and
+ * do not retry. After pg_retry.breaker_cooldown_ms the next failing call
+ * becomes the half-open probe and retries as usual: if it succeeds the
+ * breaker closes, if it runs out of attempts the breaker opens again.
+ */
+typedef enum BreakerState
+{
+    BREAKER_CLOSED,
+    BREAKER_OPEN,
+    BREAKER_HALF_OPEN
+} BreakerState;
+
+typedef struct RetryBreakerKey
+{
+    Oid dbid;
+    uint64 queryid;
+} RetryBreakerKey;
+
+typedef struct RetryBreakerEntry
+{
+    RetryBreakerKey key;
+    slock_t mutex;            /* protects the fields below */
+    BreakerState state;
+    int failures;             /* retryable failures in the current window */
+    TimestampTz window_start;
+    TimestampTz state_since;  /* time of the last transition */
+    int probe_pid;            /* backend probing a half-open breaker */
+    int64 opens;              /* times the breaker opened */
+} RetryBreakerEntry;
+
+/*
+ * State that one retried call carries from attempt to attempt. It is
+ * palloc'd so it can be updated from inside PG_TRY blocks without volatile
+ * qualifiers.
+ */
+typedef struct RetryCall
+{
+    const RetryPolicy *policy;
+    int attempt;                     /* current attempt, from 1 */
+    int max_attempts;                /* most attempts any error code allows */
+    uint64 fingerprint;              /* text hash until the statement is prepared */
+    uint64 fairness_key;             /* text hash, the same in every backend */
+    bool track;                      /* counted in the cluster-wide stats */
+    StatementCallStats *stats;       /* NULL when statement stats are off */
+    RetryContentionSlot *contention; /* NULL unless adaptive backoff is on */
+    bool attempt_done;               /* the attempt's run time was recorded */
+    bool breaker_probe;              /* probing a half-open circuit breaker */
+    long prev_delay_ms;              /* for decorrelated jitter */
+    long lock_wait_ms;               /* lock wait bound of the next attempt */
+    bool lock_wait_bounded;          /* this attempt runs with that bound */
+    bool deadline_armed;             /* statement timeout moved to the deadline */
+    TimestampTz outer_timeout_fin;   /* the statement timeout it replaced */
+    bool ticket_held;                /* this attempt holds the fairness ticket */
+} RetryCall;
+
+static RetrySharedState *retry_shared = NULL;
+static HTAB *statement_hash = NULL;
+static HTAB *breaker_hash = NULL;
+static RetryPendingStats retry_pending;
+static bool retry_exit_hook_registered = false;
+/* Custom wait event reported while sleeping in backoff, assigned on first use */
+static uint32 pg_retry_backoff_wait_event = 0;
+/* Wait event of a first attempt yielding to older retriers, likewise */
+static uint32 pg_retry_fairness_wait_event = 0;
+/* Contention slot this backend holds a fairness ticket on, NULL for none */
+static RetryContentionSlot *fairness_ticket = NULL;
+static bool fairness_exit_hook_registered = false;
+
+/*
+ * Retryable failures counted for the next summary line in summary mode
+ * (pg_retry.log_summary_interval_ms > 0), instead of one message each
+ */
+static struct
+{
+    TimestampTz start;        /* first failure since the last summary */
+    int nsqlstates;
+    struct
+    {
+        int sqlerrcode;
+        int64 failures;
+    } sqlstates[PG_RETRY_LOG_SUMMARY_SQLSTATES];
+} retry_log_summary;
+/* Phase timings of this backend not yet flushed, like retry_pending */
+static struct
+{
+    bool pending;
+    bool phases[RETRY_NUM_PHASES]; /* phases with counts to flush */
+    uint32 counts[RETRY_NUM_PHASES][PG_RETRY_TIMING_BUCKETS];
+} retry_timing_pending;
+static shmem_request_hook_type prev_shmem_request_hook = NULL;
+static shmem_startup_hook_type prev_shmem_startup_hook = NULL;
+static ExecutorRun_hook_type prev_ExecutorRun = NULL;
+/* Roles that queued async jobs in this transaction, their workers are woken at commit */
+static List *async_wake_roles = NIL;
+static uint32 pg_retry_async_wait_event = 0;
+/* Subtransactions pg_retry started in the current top-level transaction */
+static int64 retry_xact_subxacts = 0;
+/* The subxid cache warning was given in the current top-level transaction */
+static bool retry_subxact_warned = false;
 
 /* Function declarations */
 PG_FUNCTION_INFO_V1(pg_retry_retry);
+PG_FUNCTION_INFO_V1(pg_retry_retry_params);
+PG_FUNCTION_INFO_V1(pg_retry_retry_batch);
+PG_FUNCTION_INFO_V1(pg_retry_retry_xact);
+PG_FUNCTION_INFO_V1(pg_retry_retry_query);
+PG_FUNCTION_INFO_V1(pg_retry_stats);
+PG_FUNCTION_INFO_V1(pg_retry_sqlstate_stats);
+PG_FUNCTION_INFO_V1(pg_retry_stats_reset);
+PG_FUNCTION_INFO_V1(pg_retry_statement_stats);
+PG_FUNCTION_INFO_V1(pg_retry_statement_stats_reset);
+PG_FUNCTION_INFO_V1(pg_retry_phase_timings);
+PG_FUNCTION_INFO_V1(pg_retry_create_policy);
+PG_FUNCTION_INFO_V1(pg_retry_policy_invalidate);
+PG_FUNCTION_INFO_V1(pg_retry_retry_async);
+PG_FUNCTION_INFO_V1(pg_retry_subxact_usage);
 extern void _PG_init(void);
+extern PGDLLEXPORT void pg_retry_async_main(Datum main_arg);
 
 /* Helper functions */
-static bool is_retryable_sqlstate(const char *sqlstate, ArrayType *retry_sqlstates);
+static bool pack_sqlstate_token(const char *token, size_t len, int *sqlerrcode);
+static int sqlerrcode_cmp(const void *a, const void *b);
+static void finalize_sqlstate_set(SqlStateSet *set);
+static bool check_default_sqlstates(char **newval, void **extra, GucSource source);
+static void assign_default_sqlstates(const char *newval, void *extra);
+static SqlStateSet *copy_sqlstate_set(const SqlStateSet *src);
+static SqlStateSet *copy_default_sqlstate_set(void);
+static SqlStateSet *compile_sqlstate_array(ArrayType *retry_sqlstates);
+static bool is_retryable_sqlstate(int sqlerrcode, const SqlStateSet *retry_sqlstates);
+static void compile_sqlstate_rule(JsonbContainer *container, SqlStateRule *rule);
+static SqlStatePolicy *compile_sqlstate_policy(Jsonb *jb);
+static SqlStatePolicy *copy_sqlstate_policy(const SqlStatePolicy *src);
+static char *sqlstate_policy_to_json(const SqlStatePolicy *map);
+static const SqlStateRule *sqlstate_policy_rule(const RetryPolicy *policy, int sqlerrcode);
+static int retry_policy_max_attempts(const RetryPolicy *policy);
 static bool contains_transaction_control(List *parsetree_list);
-static bool is_single_statement(const char *sql, List **parsed_tree);
-static long calculate_delay(int attempt, int base_delay_ms, int max_delay_ms);
+static void validate_parse_tree(List *raw_parsetree_list);
+static long calculate_delay(const RetryPolicy *policy, int attempt, long *prev_delay_ms);
+static BackoffStrategy parse_backoff_strategy(const char *name);
+static void backoff_sleep(long delay_ms);
+static void contention_sleep_cleanup(int code, Datum arg);
+static bool is_lock_wait_failure(const ErrorData *errdata);
+static void bound_lock_wait(long wait_ms);
+static bool deadline_arm(TimestampTz deadline, TimestampTz *outer_fin);
+static void deadline_disarm(TimestampTz outer_fin);
+static long deadline_remaining_ms(TimestampTz deadline);
+static void log_retry_failure(ErrorData *errdata, int attempt, int max_tries);
+static void retry_subxact_begin(void);
+static void retry_subxact_release(void);
+static void log_summary_flush(bool force);
+static RetryContentionSlot *contention_slot(uint64 fingerprint);
+static void contention_record(RetryContentionSlot *slot, bool failed);
+static long contention_adjust_delay(RetryContentionSlot *slot, long delay_ms, int max_delay_ms);
+static inline void timing_start(instr_time *start);
+static void timing_end(RetryPhase phase, instr_time *start);
+static inline bool fairness_enabled(void);
+static void fairness_release_ticket(void);
+static void fairness_shmem_exit(int code, Datum arg);
+static bool fairness_take_ticket(uint64 fingerprint);
+static void fairness_yield(uint64 fingerprint);
+static void retry_budget_deposit(void);
+static bool retry_budget_withdraw(void);
 static void validate_sql(const char *sql, List **parsed_tree);
-static ArrayType *build_sqlstate_array(const char *csv);
+static void validate_sql_cached(const char *sql);
+static uint64 plan_cache_hash(const char *sql, int nargs, const Oid *argtypes);
+static bool plan_cache_matches(PlanCacheEntry *entry, const char *sql, int nargs,
+                               const Oid *argtypes);
+static PlanCacheEntry *plan_cache_lookup(const char *sql, int nargs, const Oid *argtypes,
+                                         uint64 key, int nestlevel, bool *collision);
+static PlanCacheEntry *plan_cache_insert(const char *sql, int nargs, const Oid *argtypes,
+                                         uint64 key, SPIPlanPtr plan, uint64 queryid,
+                                         int nestlevel);
+static void plan_cache_pin(PlanCacheEntry *entry, int nestlevel);
+static void plan_cache_release(PlanCacheEntry *entry);
+static void plan_cache_evict(PlanCacheEntry *entry);
+static void plan_cache_xact_callback(XactEvent event, void *arg);
+static void plan_cache_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+                                        SubTransactionId parentSubid, void *arg);
+static const struct PolicyCacheEntry *policy_cache_lookup(const char *name);
+static void policy_cache_reset(void);
+static void policy_cache_relcache_callback(Datum arg, Oid relid);
+static void pg_retry_shmem_request(void);
+static void pg_retry_shmem_startup(void);
+static RetrySqlStateCounter *stats_sqlstate_slot(int sqlerrcode);
+static void stats_flush(void);
+static void timing_flush(void);
+static void stats_shmem_exit(int code, Datum arg);
+static void stats_count_sqlstate(int sqlerrcode, bool exhausted);
+static void stats_xact_callback(XactEvent event, void *arg);
+static void retry_deferred_failures_flush(void);
+static void stats_check_loaded(void);
+static uint64 plan_fingerprint(SPIPlanPtr plan, uint64 fallback);
+static bool plan_is_read_only(SPIPlanPtr plan);
+static bool plan_entry_read_only(PlanCacheEntry *entry);
+static int hist_bucket(uint64 value);
+static void hist_bucket_bounds(int bucket, double *lower, double *upper);
+static double hist_percentile(const int64 *hist, int64 total, double fraction);
+static int backoff_bucket(long delay_ms);
+static RetryStatementEntry *statement_entry_alloc(RetryStatementKey *key, const char *sql);
+static int statement_entry_cmp(const void *lhs, const void *rhs);
+static void statement_entry_dealloc(void);
+static StatementCallStats *statement_call_begin(uint64 queryid, const char *sql);
+static void statement_call_attempt_done(StatementCallStats *call);
+static void statement_call_failure(StatementCallStats *call, int sqlerrcode, bool retryable);
+static void statement_call_backoff(StatementCallStats *call, long delay_ms);
+static void statement_call_store(StatementCallStats *call);
+static RetryBreakerEntry *breaker_entry(uint64 fingerprint);
+static bool breaker_on_failure(uint64 fingerprint, bool last, bool *probe);
+static void breaker_on_probe_success(uint64 fingerprint);
+static const char *breaker_state_name(BreakerState state);
+static void parse_retry_policy(FunctionCallInfo fcinfo, int argno, RetryPolicy *policy);
+static void validate_retry_policy(const RetryPolicy *policy);
+static void free_retry_policy(RetryPolicy *policy);
+static void default_retry_policy(RetryPolicy *policy);
+static ParamListInfo build_param_list(int nargs, Oid *argtypes, Datum *values, const char *nulls);
+static void retry_receiver_startup(DestReceiver *self, int operation, TupleDesc typeinfo);
+static bool retry_receiver_receive(TupleTableSlot *slot, DestReceiver *self);
+static void retry_receiver_shutdown(DestReceiver *self);
+static void retry_receiver_destroy(DestReceiver *self);
+static RetryReceiver *retry_receiver_create(Tuplestorestate *tstore, TupleDesc expected);
+static void retry_receiver_reset(RetryReceiver *receiver);
+static int execute_plan_to_receiver(SPIPlanPtr plan, ParamListInfo paramLI, bool read_only,
+                                    RetryReceiver *receiver);
+static int execute_plan_timed(SPIPlanPtr plan, ParamListInfo paramLI, bool read_only,
+                              RetryReceiver *receiver);
+static int execute_statement_attempt(const char *sql, int nargs, Oid *argtypes,
+                                     ParamListInfo paramLI, bool use_plan_cache, uint64 plan_key, PlanCacheEntry *volatile *plan_entry,
+                                     SPIPlanPtr volatile *local_plan, int nestlevel, RetryCall *rc,
+                                     RetryReceiver *receiver);
+static int retry_statement(const char *sql, int nargs, Oid *argtypes, Datum *values,
+                           const char *nulls, RetryPolicy *policy, bool validated, int *attempts,
+                           RetryReceiver *receiver);
+static void retry_batch_release_plans(PlanCacheEntry **plan_entries, SPIPlanPtr *local_plans,
+                                      int nstatements);
+static int retry_batch_shared_subxact(char **sqls, int nstatements, RetryPolicy *policy,
+                                      int *processed);
+static char **validate_statement_array(ArrayType *statements, const char *group, int *nstatements);
+static int execute_with_retry(const char *sql, int nargs, Oid *argtypes, Datum *values,
+                              const char *nulls, RetryPolicy *policy);
+static bool auto_retry_eligible(QueryDesc *queryDesc);
+static uint64 auto_retry_execute(QueryDesc *queryDesc, int attempt);
+static void auto_retry_run(QueryDesc *queryDesc);
+#if PG_VERSION_NUM >= 180000
+static void pg_retry_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count);
+#else
+static void pg_retry_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count,
+                                 bool execute_once);
+#endif
+static const char *backoff_strategy_name(BackoffStrategy strategy);
+static ArrayType *sqlstate_set_to_array(const SqlStateSet *set);
+static void async_wake(Oid userid);
+static void async_queue_switch_to_owner(Oid *save_userid, int *save_sec_context);
+static void async_xact_callback(XactEvent event, void *arg);
+static void async_worker_exit(int code, Datum arg);
+static bool async_worker_retire(int slotno);
+static int async_run_batch(Oid userid, MemoryContext batch_context);
+static bool async_run_next_job(Oid userid, MemoryContext batch_context);
+static void async_run_job(int64 job_id, TimestampTz started_at, HeapTuple tuple,
+                          TupleDesc tupdesc);
+static void async_record_failure(int64 job_id, TimestampTz started_at, ErrorData *errdata);
 
 /*
- * Convert a comma-separated SQLSTATE string into a TEXT[] for retry matching.
- * Returns an empty array when the string is NULL/empty.
+ * Pack a five-character SQLSTATE token into a sqlerrcode.
+ * Lowercase letters are accepted; returns false for anything that is not
+ * five digits or letters.
  */
-static ArrayType *
-build_sqlstate_array(const char *csv)
+static bool
+pack_sqlstate_token(const char *token, size_t len, int *sqlerrcode)
+{
+    char code[5];
+    size_t i;
+
+    if (len != 5)
+        return false;
+
+    for (i = 0; i < 5; i++)
+    {
+        unsigned char ch = (unsigned char) token[i];
+
+        if (!isdigit(ch) && !isalpha(ch))
+            return false;
+        code[i] = (char) toupper(ch);
+    }
+
+    *sqlerrcode = MAKE_SQLSTATE(code[0], code[1], code[2], code[3], code[4]);
+    return true;
+}
+
+/*
+ * qsort/bsearch comparator for packed sqlerrcodes
+ */
+static int
+sqlerrcode_cmp(const void *a, const void *b)
+{
+    return pg_cmp_s32(*(const int *) a, *(const int *) b);
+}
+
+/*
+ * Sort the codes in a set and drop duplicates
+ */
+static void
+finalize_sqlstate_set(SqlStateSet *set)
+{
+    int i;
+    int n = 0;
+
+    qsort(set->states, set->nstates, sizeof(int), sqlerrcode_cmp);
+    for (i = 0; i < set->nstates; i++)
+    {
+        if (n == 0 || set->states[n - 1] != set->states[i])
+            set->states[n++] = set->states[i];
+    }
+    set->nstates = n;
+}
+
+/*
+ * GUC check hook for pg_retry.default_sqlstates: compile the comma-separated
+ * list once into a sorted SqlStateSet handed to the assign hook, so calls
+ * taking the default never re-parse the string.
+ */
+static bool
+check_default_sqlstates(char **newval, void **extra, GucSource source)
 {
+    const char *csv = *newval ? *newval : "";
     const char *ptr;
     const char *start;
     const char *end;
-    size_t len;
-    char *token;
-    int count = 0;
-    Datum *elements;
-    int idx = 0;
-    ArrayType *volatile array;
-
-    if (csv == NULL || *csv == '\0')
-        return construct_empty_array(TEXTOID);
+    int count = 1;
+    SqlStateSet *set;
 
     for (ptr = csv; *ptr; ptr++)
     {
         if (*ptr == ',')
-            count++;
+            count++; /* number of tokens = commas + 1 */
     }
-    count++; /* number of tokens = commas + 1 */
 
-    elements = palloc(sizeof(Datum) * count);
+    set = (SqlStateSet *) guc_malloc(LOG, offsetof(SqlStateSet, states) + count * sizeof(int));
+    if (set == NULL)
+        return false;
+    set->nstates = 0;
+
     ptr = csv;
     while (*ptr)
     {
-        while (*ptr && isspace((unsigned char)*ptr))
+        while (*ptr && isspace((unsigned char) *ptr))
             ptr++;
 
         start = ptr;
@@ -95,356 +972,5368 @@ build_sqlstate_array(const char *csv)
             ptr++;
         end = ptr;
 
-        while (end > start && isspace((unsigned char)*(end - 1)))
+        while (end > start && isspace((unsigned char) *(end - 1)))
             end--;
 
         if (end > start)
         {
-            len = end - start;
-            token = palloc(len + 1);
-            memcpy(token, start, len);
-            token[len] = '\0';
-            elements[idx++] = CStringGetTextDatum(token);
-            pfree(token);
+            if (!pack_sqlstate_token(start, end - start, &set->states[set->nstates]))
+            {
+                GUC_check_errdetail("\"%.*s\" is not a valid SQLSTATE.", (int) (end - start), start);
+                guc_free(set);
+                return false;
+            }
+            set->nstates++;
         }
 
         if (*ptr == ',')
             ptr++;
     }
 
-    if (idx == 0)
-    {
-        pfree(elements);
-        return construct_empty_array(TEXTOID);
-    }
+    finalize_sqlstate_set(set);
+    *extra = set;
+    return true;
+}
 
-    array = construct_array(elements, idx, TEXTOID, -1, false, 'i');
-    pfree(elements);
-    return array;
+/*
+ * GUC assign hook for pg_retry.default_sqlstates
+ */
+static void
+assign_default_sqlstates(const char *newval, void *extra)
+{
+    pg_retry_default_sqlstate_set = (SqlStateSet *) extra;
 }
 
 /*
- * Check if a SQLSTATE is in the retry list, NOTE: SQLSTATEs are assigned at runtime by PostgreSQL
+ * Copy the compiled GUC default for one call. The GUC machinery may free its
+ * copy if the retried statement itself changes the setting.
  */
-static bool
-is_retryable_sqlstate(const char *sqlstate, ArrayType *retry_sqlstates)
+static SqlStateSet *
+copy_default_sqlstate_set(void)
+{
+    return copy_sqlstate_set(pg_retry_default_sqlstate_set);
+}
+
+/*
+ * Copy a compiled SQLSTATE set into the current memory context
+ */
+static SqlStateSet *
+copy_sqlstate_set(const SqlStateSet *src)
+{
+    int nstates = src ? src->nstates : 0;
+    SqlStateSet *set = palloc(offsetof(SqlStateSet, states) + Max(nstates, 1) * sizeof(int));
+
+    set->nstates = nstates;
+    if (nstates > 0)
+        memcpy(set->states, src->states, nstates * sizeof(int));
+    return set;
+}
+
+/*
+ * Compile a user-supplied TEXT[] of SQLSTATEs once per call.
+ * NULL elements are ignored; malformed codes raise an error.
+ */
+static SqlStateSet *
+compile_sqlstate_array(ArrayType *retry_sqlstates)
 {
     int i;
     int nelems;
     Datum *elements;
     bool *nulls;
+    SqlStateSet *set;
 
     deconstruct_array(retry_sqlstates, TEXTOID, -1, false, 'i', &elements, &nulls, &nelems);
 
+    set = palloc(offsetof(SqlStateSet, states) + Max(nelems, 1) * sizeof(int));
+    set->nstates = 0;
+
     for (i = 0; i < nelems; i++)
     {
-        if (!nulls[i])
+        text *elem;
+
+        if (nulls[i])
+            continue;
+
+        elem = DatumGetTextPP(elements[i]);
+        if (!pack_sqlstate_token(VARDATA_ANY(elem), VARSIZE_ANY_EXHDR(elem),
+                                 &set->states[set->nstates]))
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("pg_retry: invalid SQLSTATE \"%s\" in retry_sqlstates",
+                            text_to_cstring(elem))));
+        set->nstates++;
+    }
+
+    pfree(elements);
+    pfree(nulls);
+
+    finalize_sqlstate_set(set);
+    return set;
+}
+
+/*
+ * The TEXT[] that compile_sqlstate_array() turns back into the same set
+ */
+static ArrayType *
+sqlstate_set_to_array(const SqlStateSet *set)
+{
+    Datum *elements = palloc(Max(set->nstates, 1) * sizeof(Datum));
+    ArrayType *result;
+    int i;
+
+    for (i = 0; i < set->nstates; i++)
+        elements[i] = CStringGetTextDatum(unpack_sql_state(set->states[i]));
+
+    result = construct_array_builtin(elements, set->nstates, TEXTOID);
+    pfree(elements);
+    return result;
+}
+
+/*
+ * Check if an error code is in the retry set, NOTE: SQLSTATEs are assigned at runtime by PostgreSQL
+ */
+static bool
+is_retryable_sqlstate(int sqlerrcode, const SqlStateSet *retry_sqlstates)
+{
+    if (retry_sqlstates->nstates == 0)
+        return false;
+
+    return bsearch(&sqlerrcode, retry_sqlstates->states, retry_sqlstates->nstates,
+                   sizeof(int), sqlerrcode_cmp) != NULL;
+}
+
+/*
+ * Read one entry of a sqlstate_policy object into rule
+ */
+static void
+compile_sqlstate_rule(JsonbContainer *container, SqlStateRule *rule)
+{
+    JsonbIterator *it = JsonbIteratorInit(container);
+    JsonbIteratorToken tok;
+    JsonbValue v;
+    char *key = NULL;
+
+    while ((tok = JsonbIteratorNext(&it, &v, true)) != WJB_DONE)
+    {
+        int *field;
+
+        if (tok == WJB_KEY)
+        {
+            key = pnstrdup(v.val.string.val, v.val.string.len);
+            continue;
+        }
+        if (tok != WJB_VALUE)
+            continue;
+
+        if (strcmp(key, "strategy") == 0)
         {
-            text *elem = DatumGetTextPP(elements[i]);
-            char *elem_str = text_to_cstring(elem);
+            if (v.type != jbvString)
+                ereport(ERROR,
+                        (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                         errmsg("pg_retry: strategy for SQLSTATE %s in sqlstate_policy must be a string",
+                                unpack_sql_state(rule->sqlerrcode))));
+            rule->strategy = (int) parse_backoff_strategy(pnstrdup(v.val.string.val,
+                                                                   v.val.string.len));
+            continue;
+        }
+
+        if (strcmp(key, "max_tries") == 0)
+            field = &rule->max_tries;
+        else if (strcmp(key, "base_delay_ms") == 0)
+            field = &rule->base_delay_ms;
+        else if (strcmp(key, "max_delay_ms") == 0)
+            field = &rule->max_delay_ms;
+        else
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("pg_retry: unknown setting \"%s\" for SQLSTATE %s in sqlstate_policy",
+                            key, unpack_sql_state(rule->sqlerrcode)),
+                     errhint("Valid settings are max_tries, base_delay_ms, max_delay_ms and strategy.")));
+
+        if (v.type != jbvNumeric)
+            ereport(ERROR,
+                    (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                     errmsg("pg_retry: %s for SQLSTATE %s in sqlstate_policy must be a number",
+                            key, unpack_sql_state(rule->sqlerrcode))));
+        *field = DatumGetInt32(DirectFunctionCall1(numeric_int4, NumericGetDatum(v.val.numeric)));
+    }
+
+    if (rule->max_tries == 0 || rule->max_tries < -1)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("pg_retry: max_tries for SQLSTATE %s in sqlstate_policy must be >= 1",
+                        unpack_sql_state(rule->sqlerrcode))));
+    if (rule->base_delay_ms < -1 || rule->max_delay_ms < -1)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("pg_retry: delays for SQLSTATE %s in sqlstate_policy must be >= 0",
+                        unpack_sql_state(rule->sqlerrcode))));
+    if (rule->base_delay_ms >= 0 && rule->max_delay_ms >= 0 &&
+        rule->base_delay_ms > rule->max_delay_ms)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("pg_retry: base_delay_ms for SQLSTATE %s in sqlstate_policy cannot be greater than max_delay_ms",
+                        unpack_sql_state(rule->sqlerrcode))));
+}
+
+/*
+ * Compile a sqlstate_policy object, keyed by SQLSTATE, whose values set any
+ * of max_tries, base_delay_ms, max_delay_ms and strategy for that code:
+ *   {"40001": {"max_tries": 10, "base_delay_ms": 0},
+ *    "55P03": {"base_delay_ms": 200, "max_delay_ms": 5000}}
+ */
+static SqlStatePolicy *
+compile_sqlstate_policy(Jsonb *jb)
+{
+    SqlStatePolicy *map;
+    SqlStateRule *rule = NULL;
+    JsonbIterator *it;
+    JsonbIteratorToken tok;
+    JsonbValue v;
+
+    if (!JB_ROOT_IS_OBJECT(jb))
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("pg_retry: sqlstate_policy must be a JSON object keyed by SQLSTATE")));
+
+    map = palloc(offsetof(SqlStatePolicy, rules) + Max(JB_ROOT_COUNT(jb), 1) * sizeof(SqlStateRule));
+    map->nrules = 0;
+
+    it = JsonbIteratorInit(&jb->root);
+    while ((tok = JsonbIteratorNext(&it, &v, true)) != WJB_DONE)
+    {
+        if (tok == WJB_KEY)
+        {
+            rule = &map->rules[map->nrules++];
+            if (!pack_sqlstate_token(v.val.string.val, v.val.string.len, &rule->sqlerrcode))
+                ereport(ERROR,
+                        (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                         errmsg("pg_retry: invalid SQLSTATE \"%s\" in sqlstate_policy",
+                                pnstrdup(v.val.string.val, v.val.string.len))));
+            rule->max_tries = rule->base_delay_ms = rule->max_delay_ms = rule->strategy = -1;
+        }
+        else if (tok == WJB_VALUE)
+        {
+            if (v.type != jbvBinary || !JsonContainerIsObject(v.val.binary.data))
+                ereport(ERROR,
+                        (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                         errmsg("pg_retry: sqlstate_policy entry for SQLSTATE %s must be a JSON object",
+                                unpack_sql_state(rule->sqlerrcode))));
+            compile_sqlstate_rule(v.val.binary.data, rule);
+        }
+    }
+
+    qsort(map->rules, map->nrules, sizeof(SqlStateRule), sqlerrcode_cmp);
+    return map;
+}
+
+/*
+ * Copy a compiled sqlstate_policy into the current memory context
+ */
+static SqlStatePolicy *
+copy_sqlstate_policy(const SqlStatePolicy *src)
+{
+    Size size = offsetof(SqlStatePolicy, rules) + Max(src->nrules, 1) * sizeof(SqlStateRule);
+    SqlStatePolicy *map = palloc(size);
+
+    memcpy(map, src, size);
+    return map;
+}
+
+/*
+ * The JSON text that compile_sqlstate_policy() turns back into the same map
+ */
+static char *
+sqlstate_policy_to_json(const SqlStatePolicy *map)
+{
+    StringInfoData buf;
+    int i;
+
+    initStringInfo(&buf);
+    appendStringInfoChar(&buf, '{');
+    for (i = 0; i < map->nrules; i++)
+    {
+        const SqlStateRule *rule = &map->rules[i];
+        const char *sep = "";
+
+        appendStringInfo(&buf, "%s\"%s\": {", i > 0 ? ", " : "",
+                         unpack_sql_state(rule->sqlerrcode));
+        if (rule->max_tries >= 0)
+        {
+            appendStringInfo(&buf, "%s\"max_tries\": %d", sep, rule->max_tries);
+            sep = ", ";
+        }
+        if (rule->base_delay_ms >= 0)
+        {
+            appendStringInfo(&buf, "%s\"base_delay_ms\": %d", sep, rule->base_delay_ms);
+            sep = ", ";
+        }
+        if (rule->max_delay_ms >= 0)
+        {
+            appendStringInfo(&buf, "%s\"max_delay_ms\": %d", sep, rule->max_delay_ms);
+            sep = ", ";
+        }
+        if (rule->strategy >= 0)
+            appendStringInfo(&buf, "%s\"strategy\": \"%s\"", sep,
+                             backoff_strategy_name((BackoffStrategy) rule->strategy));
+        appendStringInfoChar(&buf, '}');
+    }
+    appendStringInfoChar(&buf, '}');
+
+    return buf.data;
+}
+
+/*
+ * The sqlstate_policy rule of a policy for an error code, NULL for none
+ */
+static const SqlStateRule *
+sqlstate_policy_rule(const RetryPolicy *policy, int sqlerrcode)
+{
+    if (policy->sqlstate_policy == NULL || policy->sqlstate_policy->nrules == 0)
+        return NULL;
+
+    return bsearch(&sqlerrcode, policy->sqlstate_policy->rules, policy->sqlstate_policy->nrules,
+                   sizeof(SqlStateRule), sqlerrcode_cmp);
+}
+
+/*
+ * Most attempts a call can take: a sqlstate_policy rule may allow more than
+ * the policy's own max_tries
+ */
+static int
+retry_policy_max_attempts(const RetryPolicy *policy)
+{
+    int max_attempts = policy->max_tries;
+    int i;
+
+    if (policy->sqlstate_policy != NULL)
+    {
+        for (i = 0; i < policy->sqlstate_policy->nrules; i++)
+            max_attempts = Max(max_attempts, policy->sqlstate_policy->rules[i].max_tries);
+    }
+
+    return max_attempts;
+}
+
+/*
+ * Check if parsed statement is a transaction control statement
+ */
+static bool
+contains_transaction_control(List *parsetree_list)
+{
+    RawStmt *raw_stmt;
+
+    if (parsetree_list == NULL || list_length(parsetree_list) != 1)
+        return false;
+
+    raw_stmt = (RawStmt *) linitial(parsetree_list);
+
+    /* Check if the statement is a transaction control command */
+    if (IsA(raw_stmt->stmt, TransactionStmt))
+        return true;
+
+    return false;
+}
+
+/*
+ * Check a raw parse tree list: exactly one statement, no transaction control
+ */
+static void
+validate_parse_tree(List *raw_parsetree_list)
+{
+    if (list_length(raw_parsetree_list) != 1)
+        ereport(ERROR,
+                (errcode(ERRCODE_SYNTAX_ERROR),
+                 errmsg("pg_retry: SQL must contain exactly one statement")));
+
+    if (contains_transaction_control(raw_parsetree_list))
+        ereport(ERROR,
+                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
+                 errmsg("pg_retry: transaction control statements are not allowed")));
+}
+
+/*
+ * Validate SQL input before execution
+ *
+ * Performs pre-execution validation to ensure SQL safety and correctness:
+ * 1. Parse the SQL and verify it contains exactly one statement
+ * 2. Check if the statement is a transaction control command (not allowed)
+ *
+ * The validation uses PostgreSQL's parser to properly handle SQL syntax,
+ * including semicolons within string literals, comments, and JSON values.
+ *
+ * Parameters:
+ * - sql: the SQL string to validate
+ * - parsed_tree: pointer to store the parsed statement tree for reuse
+ *
+ * Returns:
+ * - void (success) or raises an error if validation fails
+ *
+ * Errors:
+ * - SYNTAX_ERROR: if SQL contains multiple statements or parsing fails
+ * - FEATURE_NOT_SUPPORTED: if SQL contains transaction control statements
+
+ *
+ * NOTE: We use SPI to execute SQL queries within subtransactions so that
+ * errors can be captured and retried without propagating further.
+ */
+static void
+validate_sql(const char *sql, List **parsed_tree)
+{
+    /* Parse the SQL using PostgreSQL's query parser */
+    *parsed_tree = pg_parse_query(sql);
+
+    validate_parse_tree(*parsed_tree);
+}
+
+/*
+ * validate_sql() for a text this backend has not validated yet, timed as the
+ * validate phase; a text that already passed is not parsed again
+ */
+static void
+validate_sql_cached(const char *sql)
+{
+    ValidatedSqlEntry *entry;
+    List *parsed_tree;
+    char *sql_copy;
+    uint64 key;
+    bool found;
+    instr_time timing;
+
+    key = hash_combine64(hash_bytes_extended((const unsigned char *) sql, strlen(sql), 0),
+                         (uint64) standard_conforming_strings);
+    if (validated_cache != NULL)
+    {
+        entry = (ValidatedSqlEntry *) hash_search(validated_cache, &key, HASH_FIND, NULL);
+        if (entry != NULL && strcmp(entry->sql, sql) == 0)
+        {
+            dlist_move_head(&validated_cache_lru, &entry->lru_node);
+            return;
+        }
+    }
+
+    timing_start(&timing);
+    validate_sql(sql, &parsed_tree);
+    timing_end(RETRY_PHASE_VALIDATE, &timing);
+
+    if (validated_cache == NULL)
+    {
+        HASHCTL ctl;
+
+        validated_cache_context = AllocSetContextCreate(CacheMemoryContext,
+                                                        "pg_retry validated SQL",
+                                                        ALLOCSET_SMALL_SIZES);
+        ctl.keysize = sizeof(uint64);
+        ctl.entrysize = sizeof(ValidatedSqlEntry);
+        ctl.hcxt = validated_cache_context;
+        validated_cache = hash_create("pg_retry validated SQL",
+                                      PG_RETRY_VALIDATED_CACHE_SIZE,
+                                      &ctl,
+                                      HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    }
+
+    sql_copy = MemoryContextStrdup(validated_cache_context, sql);
+    entry = (ValidatedSqlEntry *) hash_search(validated_cache, &key, HASH_ENTER, &found);
+    if (found)
+    {
+        /* A colliding text takes the slot over */
+        pfree(entry->sql);
+        dlist_delete(&entry->lru_node);
+    }
+    else if (hash_get_num_entries(validated_cache) > PG_RETRY_VALIDATED_CACHE_SIZE)
+    {
+        ValidatedSqlEntry *victim = dlist_container(ValidatedSqlEntry, lru_node,
+                                                    dlist_tail_node(&validated_cache_lru));
+
+        pfree(victim->sql);
+        dlist_delete(&victim->lru_node);
+        hash_search(validated_cache, &victim->key, HASH_REMOVE, NULL);
+    }
+    entry->sql = sql_copy;
+    dlist_push_head(&validated_cache_lru, &entry->lru_node);
+}
+
+/*
+ * Hash the SQL text and parameter types for plan cache lookups. The same text
+ * bound with different parameter types needs a different plan.
+ */
+static uint64
+plan_cache_hash(const char *sql, int nargs, const Oid *argtypes)
+{
+    uint64 key = hash_bytes_extended((const unsigned char *) sql, strlen(sql), 0);
+
+    if (nargs > 0)
+        key = hash_combine64(key,
+                             hash_bytes_extended((const unsigned char *) argtypes,
+                                                 nargs * sizeof(Oid), 0));
+    return key;
+}
+
+/*
+ * Check that an entry was prepared for exactly this text and parameter types
+ */
+static bool
+plan_cache_matches(PlanCacheEntry *entry, const char *sql, int nargs, const Oid *argtypes)
+{
+    if (entry->nargs != nargs || strcmp(entry->sql, sql) != 0)
+        return false;
+
+    return nargs == 0 || memcmp(entry->argtypes, argtypes, nargs * sizeof(Oid)) == 0;
+}
+
+/*
+ * Find a cached plan for the given SQL text and pin it for the caller, on
+ * behalf of the subtransaction level nestlevel; see plan_cache_pin().
+ *
+ * Returns NULL on a miss. If the hash slot is taken by a different statement
+ * that is currently in use, *collision is set so the caller can run the
+ * statement without caching it; an unused colliding entry is simply evicted.
+ */
+static PlanCacheEntry *
+plan_cache_lookup(const char *sql, int nargs, const Oid *argtypes, uint64 key, int nestlevel,
+                  bool *collision)
+{
+    PlanCacheEntry *entry;
+
+    *collision = false;
+
+    if (plan_cache == NULL)
+        return NULL;
+
+    entry = (PlanCacheEntry *) hash_search(plan_cache, &key, HASH_FIND, NULL);
+    if (entry == NULL)
+        return NULL;
+
+    if (!plan_cache_matches(entry, sql, nargs, argtypes))
+    {
+        if (entry->refcount > 0)
+            *collision = true;
+        else
+            plan_cache_evict(entry);
+        return NULL;
+    }
+
+    dlist_move_head(&plan_cache_lru, &entry->lru_node);
+    plan_cache_pin(entry, nestlevel);
+    return entry;
+}
+
+/*
+ * Remember a saved plan for later calls, evicting the least recently used
+ * unpinned entries to stay within pg_retry.plan_cache_size.
+ * The new entry is returned pinned on behalf of nestlevel.
+ */
+static PlanCacheEntry *
+plan_cache_insert(const char *sql, int nargs, const Oid *argtypes, uint64 key, SPIPlanPtr plan,
+                  uint64 queryid, int nestlevel)
+{
+    PlanCacheEntry *entry;
+    char *sql_copy;
+    Oid *argtypes_copy = NULL;
+    bool found;
+
+    if (plan_cache == NULL)
+    {
+        HASHCTL ctl;
+
+        plan_cache_context = AllocSetContextCreate(CacheMemoryContext,
+                                                   "pg_retry plan cache",
+                                                   ALLOCSET_SMALL_SIZES);
+        ctl.keysize = sizeof(uint64);
+        ctl.entrysize = sizeof(PlanCacheEntry);
+        ctl.hcxt = plan_cache_context;
+        plan_cache = hash_create("pg_retry plan cache",
+                                 pg_retry_plan_cache_size,
+                                 &ctl,
+                                 HASH_ELEM | HASH_BLOBS | HASH_CONTEXT);
+    }
+
+    while (hash_get_num_entries(plan_cache) >= pg_retry_plan_cache_size)
+    {
+        PlanCacheEntry *victim = NULL;
+        dlist_iter iter;
+
+        dlist_reverse_foreach(iter, &plan_cache_lru)
+        {
+            PlanCacheEntry *candidate = dlist_container(PlanCacheEntry, lru_node, iter.cur);
+
+            if (candidate->refcount == 0)
+            {
+                victim = candidate;
+                break;
+            }
+        }
+
+        /* Everything is in use by nested calls; go over budget for now */
+        if (victim == NULL)
+            break;
+        plan_cache_evict(victim);
+    }
+
+    sql_copy = MemoryContextStrdup(plan_cache_context, sql);
+    if (nargs > 0)
+    {
+        argtypes_copy = MemoryContextAlloc(plan_cache_context, nargs * sizeof(Oid));
+        memcpy(argtypes_copy, argtypes, nargs * sizeof(Oid));
+    }
+
+    entry = (PlanCacheEntry *) hash_search(plan_cache, &key, HASH_ENTER, &found);
+    Assert(!found);
+    entry->sql = sql_copy;
+    entry->nargs = nargs;
+    entry->argtypes = argtypes_copy;
+    entry->plan = plan;
+    entry->queryid = queryid;
+    entry->read_only = plan_is_read_only(plan);
+    entry->refcount = 0;
+    dlist_push_head(&plan_cache_lru, &entry->lru_node);
+    plan_cache_pin(entry, nestlevel);
+
+    return entry;
+}
+
+/*
+ * Pin an entry for a call running at subtransaction level nestlevel. The
+ * call's attempts run in subtransactions of their own, so the pin belongs
+ * to the level the call was made at, not to the attempt that took it.
+ */
+static void
+plan_cache_pin(PlanCacheEntry *entry, int nestlevel)
+{
+    if (plan_cache_npins == plan_cache_maxpins)
+    {
+        plan_cache_maxpins = Max(plan_cache_maxpins * 2, 8);
+        if (plan_cache_pins == NULL)
+            plan_cache_pins = MemoryContextAlloc(TopMemoryContext,
+                                                 plan_cache_maxpins * sizeof(PlanCachePin));
+        else
+            plan_cache_pins = repalloc(plan_cache_pins, plan_cache_maxpins * sizeof(PlanCachePin));
+    }
+
+    plan_cache_pins[plan_cache_npins].entry = entry;
+    plan_cache_pins[plan_cache_npins].nestlevel = nestlevel;
+    plan_cache_npins++;
+    entry->refcount++;
+}
+
+/*
+ * Unpin an entry returned by plan_cache_lookup() or plan_cache_insert()
+ */
+static void
+plan_cache_release(PlanCacheEntry *entry)
+{
+    int i;
+
+    Assert(entry->refcount > 0);
+    entry->refcount--;
+
+    /* Calls release in the reverse order they pinned, so this is the top */
+    for (i = plan_cache_npins - 1; i >= 0; i--)
+    {
+        if (plan_cache_pins[i].entry == entry)
+        {
+            memmove(&plan_cache_pins[i], &plan_cache_pins[i + 1],
+                    (plan_cache_npins - i - 1) * sizeof(PlanCachePin));
+            plan_cache_npins--;
+            return;
+        }
+    }
+    Assert(false);
+}
+
+/*
+ * Drop an unpinned entry and free its saved plan
+ */
+static void
+plan_cache_evict(PlanCacheEntry *entry)
+{
+    uint64 key = entry->key;
+
+    Assert(entry->refcount == 0);
+    dlist_delete(&entry->lru_node);
+    SPI_freeplan(entry->plan);
+    pfree(entry->sql);
+    if (entry->argtypes != NULL)
+        pfree(entry->argtypes);
+    hash_search(plan_cache, &key, HASH_REMOVE, NULL);
+}
+
+/*
+ * Errors raised outside an attempt, such as a cancel during the backoff,
+ * skip plan_cache_release(), so drop any leftover pins once the top-level
+ * transaction is gone. No call can still
+ * be running at that point.
+ */
+static void
+plan_cache_xact_callback(XactEvent event, void *arg)
+{
+    if (event != XACT_EVENT_ABORT && event != XACT_EVENT_PARALLEL_ABORT)
+        return;
+
+    while (plan_cache_npins > 0)
+        plan_cache_pins[--plan_cache_npins].entry->refcount--;
+}
+
+/*
+ * Drop the pins of calls unwound by an aborted subtransaction, such as one
+ * whose error a PL/pgSQL exception block caught; without this they would
+ * stay pinned, and unevictable, for the rest of the session. Pins of a
+ * committed subtransaction pass to its parent.
+ */
+static void
+plan_cache_subxact_callback(SubXactEvent event, SubTransactionId mySubid,
+                            SubTransactionId parentSubid, void *arg)
+{
+    int nestlevel;
+    int kept = 0;
+    int i;
+
+    if (plan_cache_npins == 0)
+        return;
+
+    nestlevel = GetCurrentTransactionNestLevel();
+
+    for (i = 0; i < plan_cache_npins; i++)
+    {
+        PlanCachePin *pin = &plan_cache_pins[i];
+
+        if (pin->nestlevel >= nestlevel)
+        {
+            if (event == SUBXACT_EVENT_ABORT_SUB)
+            {
+                pin->entry->refcount--;
+                continue;
+            }
+            if (event == SUBXACT_EVENT_COMMIT_SUB)
+                pin->nestlevel = nestlevel - 1;
+        }
+        plan_cache_pins[kept++] = *pin;
+    }
+    plan_cache_npins = kept;
+}
+
+/*
+ * Find a named policy, loading it from retry.policy on a cache miss. The
+ * entry is only valid until invalidation messages are next processed, so
+ * callers copy what they need before doing anything that takes a lock.
+ */
+static const PolicyCacheEntry *
+policy_cache_lookup(const char *name)
+{
+    PolicyCacheEntry *entry;
+    PolicyCacheEntry loaded;
+    Oid argtypes[1] = {TEXTOID};
+    Datum values[1];
+    bool isnull;
+    Datum value;
+    SqlStateSet *sqlstates = NULL;
+    SqlStatePolicy *sqlstate_policy = NULL;
+    int ret;
+
+    if (strlen(name) >= NAMEDATALEN)
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_OBJECT),
+                 errmsg("pg_retry: retry policy \"%s\" does not exist", name)));
+
+    if (policy_cache != NULL)
+    {
+        entry = (PolicyCacheEntry *) hash_search(policy_cache, name, HASH_FIND, NULL);
+        if (entry != NULL)
+            return entry;
+    }
+
+    if (SPI_connect() != SPI_OK_CONNECT)
+        ereport(ERROR,
+                (errcode(ERRCODE_INTERNAL_ERROR),
+                 errmsg("pg_retry: SPI_connect failed")));
+
+    values[0] = CStringGetTextDatum(name);
+    ret = SPI_execute_with_args("SELECT max_tries, base_delay_ms, max_delay_ms, retry_sqlstates, "
+                                "strategy, deadline_ms, sqlstate_policy FROM retry.policy WHERE name = $1",
+                                1, argtypes, values, NULL, true, 1);
+    if (ret != SPI_OK_SELECT)
+        ereport(ERROR,
+                (errcode(ERRCODE_INTERNAL_ERROR),
+                 errmsg("pg_retry: SPI_execute failed with code %d", ret)));
+    if (SPI_processed == 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_OBJECT),
+                 errmsg("pg_retry: retry policy \"%s\" does not exist", name),
+                 errhint("Create it with retry.create_policy().")));
+
+    /*
+     * Resolve everything before touching the cache, in case of errors; the
+     * cache itself may be reset by invalidations until the query is done.
+     */
+    memset(&loaded, 0, sizeof(loaded));
+    value = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull);
+    loaded.max_tries = isnull ? -1 : DatumGetInt32(value);
+    value = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 2, &isnull);
+    loaded.base_delay_ms = isnull ? -1 : DatumGetInt32(value);
+    value = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 3, &isnull);
+    loaded.max_delay_ms = isnull ? -1 : DatumGetInt32(value);
+    value = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 4, &isnull);
+    if (!isnull)
+        sqlstates = compile_sqlstate_array(DatumGetArrayTypeP(value));
+    value = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 5, &isnull);
+    loaded.strategy = isnull ? -1 : (int) parse_backoff_strategy(TextDatumGetCString(value));
+    value = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 6, &isnull);
+    loaded.deadline_ms = isnull ? -1 : DatumGetInt32(value);
+    value = SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 7, &isnull);
+    if (!isnull)
+        sqlstate_policy = compile_sqlstate_policy(DatumGetJsonbP(value));
+
+    if (!OidIsValid(policy_relid))
+        policy_relid = get_relname_relid("policy", get_namespace_oid("retry", false));
+
+    /* Nothing below processes invalidations */
+    if (policy_cache == NULL)
+    {
+        HASHCTL ctl;
+
+        policy_cache_context = AllocSetContextCreate(CacheMemoryContext,
+                                                     "pg_retry policy cache",
+                                                     ALLOCSET_SMALL_SIZES);
+        ctl.keysize = NAMEDATALEN;
+        ctl.entrysize = sizeof(PolicyCacheEntry);
+        ctl.hcxt = policy_cache_context;
+        policy_cache = hash_create("pg_retry policy cache", 16, &ctl,
+                                   HASH_ELEM | HASH_STRINGS | HASH_CONTEXT);
+    }
+
+    if (sqlstates != NULL)
+    {
+        MemoryContext oldcontext = MemoryContextSwitchTo(policy_cache_context);
+
+        loaded.retry_sqlstates = copy_sqlstate_set(sqlstates);
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    if (sqlstate_policy != NULL)
+    {
+        MemoryContext oldcontext = MemoryContextSwitchTo(policy_cache_context);
+
+        loaded.sqlstate_policy = copy_sqlstate_policy(sqlstate_policy);
+        MemoryContextSwitchTo(oldcontext);
+    }
+
+    SPI_finish();
+
+    entry = (PolicyCacheEntry *) hash_search(policy_cache, name, HASH_ENTER, NULL);
+    entry->max_tries = loaded.max_tries;
+    entry->base_delay_ms = loaded.base_delay_ms;
+    entry->max_delay_ms = loaded.max_delay_ms;
+    entry->retry_sqlstates = loaded.retry_sqlstates;
+    entry->strategy = loaded.strategy;
+    entry->deadline_ms = loaded.deadline_ms;
+    entry->sqlstate_policy = loaded.sqlstate_policy;
+
+    return entry;
+}
+
+/*
+ * Forget all cached policies
+ */
+static void
+policy_cache_reset(void)
+{
+    if (policy_cache_context != NULL)
+        MemoryContextDelete(policy_cache_context);
+    policy_cache = NULL;
+    policy_cache_context = NULL;
+    policy_relid = InvalidOid;
+}
+
+/*
+ * Relcache callback: drop the cache when retry.policy changed. InvalidOid
+ * means all relations, e.g. after an invalidation queue overflow.
+ */
+static void
+policy_cache_relcache_callback(Datum arg, Oid relid)
+{
+    if (policy_cache != NULL && (relid == InvalidOid || relid == policy_relid))
+        policy_cache_reset();
+}
+
+/*
+ * Calculate the delay before the attempt following `attempt` according to
+ * the policy's backoff strategy. *prev_delay_ms carries the previous delay
+ * for decorrelated jitter and must start out as 0.
+ */
+static long
+calculate_delay(const RetryPolicy *policy, int attempt, long *prev_delay_ms)
+{
+    double base = policy->base_delay_ms;
+    double cap = policy->max_delay_ms;
+    double exponential = Min(base * pow(2.0, attempt - 1), cap);
+    double delay;
+    double jitter;
+    double uniform;
+
+    /* Uniform in [0, 1) from the backend PRNG */
+    uniform = PG_RETRY_RANDOM_DOUBLE();
+
+    switch (policy->strategy)
+    {
+        case BACKOFF_FULL_JITTER:
+            delay = uniform * exponential;
+            break;
+        case BACKOFF_EQUAL_JITTER:
+            delay = exponential / 2.0 + uniform * exponential / 2.0;
+            break;
+        case BACKOFF_DECORRELATED_JITTER:
+            {
+                double prev = *prev_delay_ms > 0 ? (double) *prev_delay_ms : base;
+                double upper = Max(base, prev * 3.0);
+
+                delay = Min(cap, base + uniform * (upper - base));
+                break;
+            }
+        case BACKOFF_LINEAR:
+            delay = Min(base * attempt, cap);
+            break;
+        case BACKOFF_CONSTANT:
+            delay = base;
+            break;
+        case BACKOFF_EXPONENTIAL:
+        default:
+            /* Add jitter: ±20% */
+            jitter = (uniform * exponential * 0.4) - exponential * 0.2;
+            delay = exponential + jitter;
+            break;
+    }
+
+    /* Ensure minimum delay of 1ms */
+    *prev_delay_ms = Max(1L, (long) delay);
+    return *prev_delay_ms;
+}
+
+/*
+ * Sleep for delay_ms on the process latch, so cancel and terminate requests
+ * are served right away instead of after the whole delay, and the backend
+ * shows up in pg_stat_activity with wait event PgRetryBackoff.
+ */
+static void
+backoff_sleep(long delay_ms)
+{
+    TimestampTz wake_at = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), delay_ms);
+
+    if (pg_retry_backoff_wait_event == 0)
+        pg_retry_backoff_wait_event = WaitEventExtensionNew("PgRetryBackoff");
+
+    for (;;)
+    {
+        long remaining = TimestampDifferenceMilliseconds(GetCurrentTimestamp(), wake_at);
+
+        if (remaining <= 0)
+            break;
+
+        (void) WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                         remaining, pg_retry_backoff_wait_event);
+        ResetLatch(MyLatch);
+        CHECK_FOR_INTERRUPTS();
+    }
+}
+
+/*
+ * Leave a contention slot's sleeper count, also when the sleep is cut short
+ * by an error or backend exit
+ */
+static void
+contention_sleep_cleanup(int code, Datum arg)
+{
+    RetryContentionSlot *slot = (RetryContentionSlot *) DatumGetPointer(arg);
+
+    pg_atomic_fetch_sub_u32(&slot->sleepers, 1);
+}
+
+/*
+ * Errors that mean the attempt waited on a heavyweight lock and lost: a
+ * deadlock, or lock_timeout expiring. The same 55P03 also comes from NOWAIT
+ * locking, which never waits and so ignores lock_timeout; the timeout is the
+ * one raised by the interrupt handler.
+ */
+static bool
+is_lock_wait_failure(const ErrorData *errdata)
+{
+    if (errdata->sqlerrcode == ERRCODE_T_R_DEADLOCK_DETECTED)
+        return true;
+    return errdata->sqlerrcode == ERRCODE_LOCK_NOT_AVAILABLE &&
+           errdata->funcname != NULL &&
+           strcmp(errdata->funcname, "ProcessInterrupts") == 0;
+}
+
+/*
+ * For pg_retry.wait_for_locks: instead of sleeping after a lock conflict,
+ * let the next attempt queue on the conflicting lock for at most wait_ms.
+ * The lock manager wakes us the moment the blocker releases it, and the
+ * setting is reverted when the attempt's subtransaction ends. This replaces
+ * a sleep of the same length, so it also overrides a shorter session
+ * lock_timeout.
+ */
+static void
+bound_lock_wait(long wait_ms)
+{
+    char value[32];
+
+    snprintf(value, sizeof(value), "%ld", wait_ms);
+    (void) set_config_option("lock_timeout", value, PGC_USERSET, PGC_S_SESSION,
+                             GUC_ACTION_SAVE, true, 0, false);
+}
+
+/*
+ * Make the statement timeout fire at the call's deadline for one attempt.
+ * The timer of statement_timeout is only armed when the top-level statement
+ * starts, so setting the GUC would not help; we move the timer itself and
+ * remember in *outer_fin when it was due, 0 if it was not running. An outer
+ * timeout that is due first is left alone and false is returned.
+ */
+static bool
+deadline_arm(TimestampTz deadline, TimestampTz *outer_fin)
+{
+    *outer_fin = 0;
+    if (get_timeout_active(STATEMENT_TIMEOUT))
+    {
+        *outer_fin = get_timeout_finish_time(STATEMENT_TIMEOUT);
+        if (*outer_fin <= deadline)
+            return false;
+    }
+
+    enable_timeout_at(STATEMENT_TIMEOUT, deadline);
+    return true;
+}
+
+/*
+ * Put back the statement timeout that deadline_arm() replaced
+ */
+static void
+deadline_disarm(TimestampTz outer_fin)
+{
+    if (outer_fin != 0)
+        enable_timeout_at(STATEMENT_TIMEOUT, outer_fin);
+    else
+        disable_timeout(STATEMENT_TIMEOUT, false);
+}
+
+/*
+ * Milliseconds left until a deadline, never negative
+ */
+static long
+deadline_remaining_ms(TimestampTz deadline)
+{
+    TimestampTz now = GetCurrentTimestamp();
+
+    if (now >= deadline)
+        return 0;
+    return (long) ((deadline - now) / 1000);
+}
+
+/*
+ * True when pg_retry reports retries at all
+ */
+static inline bool
+retry_log_enabled(void)
+{
+    return pg_retry_log_level != RETRY_LOG_OFF;
+}
+
+/*
+ * Message level for pg_retry.log_level
+ */
+static inline int
+retry_log_elevel(void)
+{
+    return pg_retry_log_level == RETRY_LOG_DEBUG ? DEBUG1 : WARNING;
+}
+
+/*
+ * Report a failed attempt that will be retried or was the last one. In
+ * summary mode only its SQLSTATE is counted, and a summary goes out once
+ * the interval has passed.
+ */
+static void
+log_retry_failure(ErrorData *errdata, int attempt, int max_tries)
+{
+    int i;
+
+    if (!retry_log_enabled())
+        return;
+
+    if (pg_retry_log_summary_interval_ms <= 0)
+    {
+        ereport(retry_log_elevel(),
+                (errcode(errdata->sqlerrcode),
+                 errmsg("pg_retry: attempt %d/%d failed with SQLSTATE %s: %s",
+                        attempt, max_tries,
+                        unpack_sql_state(errdata->sqlerrcode),
+                        errdata->message ? errdata->message : "unknown error")));
+        return;
+    }
+
+    for (i = 0; i < retry_log_summary.nsqlstates; i++)
+    {
+        if (retry_log_summary.sqlstates[i].sqlerrcode == errdata->sqlerrcode)
+            break;
+    }
+
+    if (i == PG_RETRY_LOG_SUMMARY_SQLSTATES)
+    {
+        /* Out of slots: report what we have early and start over */
+        log_summary_flush(true);
+        i = 0;
+    }
+
+    if (i == retry_log_summary.nsqlstates)
+    {
+        if (i == 0)
+            retry_log_summary.start = GetCurrentTimestamp();
+        retry_log_summary.sqlstates[i].sqlerrcode = errdata->sqlerrcode;
+        retry_log_summary.sqlstates[i].failures = 0;
+        retry_log_summary.nsqlstates = i + 1;
+    }
+    retry_log_summary.sqlstates[i].failures++;
+
+    log_summary_flush(false);
+}
+
+/*
+ * Emit one line per SQLSTATE counted since the last summary, unless the
+ * interval has not passed yet and force is false
+ */
+static void
+log_summary_flush(bool force)
+{
+    TimestampTz now;
+    long elapsed_ms;
+    int nsqlstates;
+    int i;
+
+    if (retry_log_summary.nsqlstates == 0)
+        return;
+
+    now = GetCurrentTimestamp();
+    if (!force &&
+        !TimestampDifferenceExceeds(retry_log_summary.start, now,
+                                    pg_retry_log_summary_interval_ms))
+        return;
+
+    elapsed_ms = (long) ((now - retry_log_summary.start) / 1000);
+    /* Clear first, so a failure while reporting cannot loop back in here */
+    nsqlstates = retry_log_summary.nsqlstates;
+    retry_log_summary.nsqlstates = 0;
+
+    if (!retry_log_enabled())
+        return;
+
+    for (i = 0; i < nsqlstates; i++)
+        ereport(retry_log_elevel(),
+                (errcode(retry_log_summary.sqlstates[i].sqlerrcode),
+                 errmsg("pg_retry: " INT64_FORMAT " retryable failures with SQLSTATE %s in the last %ld ms",
+                        retry_log_summary.sqlstates[i].failures,
+                        unpack_sql_state(retry_log_summary.sqlstates[i].sqlerrcode),
+                        elapsed_ms)));
+}
+
+/*
+ * Start an attempt's subtransaction, counting it for retry.subxact_usage()
+ */
+static void
+retry_subxact_begin(void)
+{
+    BeginInternalSubTransaction(NULL);
+    retry_xact_subxacts++;
+}
+
+/*
+ * Release an attempt's subtransaction. A subtransaction that wrote data
+ * keeps its XID in the backend's PGPROC cache until the top-level
+ * transaction ends; once more than PGPROC_MAX_CACHED_SUBXIDS are cached,
+ * every snapshot taken on the server has to look the transaction up in
+ * pg_subtrans, so warn once per transaction when it gets close.
+ */
+static void
+retry_subxact_release(void)
+{
+    ReleaseCurrentSubTransaction();
+
+    if (pg_retry_subxact_warning_threshold == 0 || retry_subxact_warned)
+        return;
+
+    if (MyProc->subxidStatus.overflowed)
+    {
+        retry_subxact_warned = true;
+        ereport(WARNING,
+                (errmsg("pg_retry: the subtransaction ID cache of this transaction has overflowed"),
+                 errdetail("More than %d subtransactions of this transaction wrote data, which slows down snapshots on the whole server until it ends.",
+                           PGPROC_MAX_CACHED_SUBXIDS),
+                 errhint("Run the statements with retry.retry_batch(..., idempotent => true) to use one subtransaction per batch.")));
+    }
+    else if (MyProc->subxidStatus.count >= pg_retry_subxact_warning_threshold)
+    {
+        retry_subxact_warned = true;
+        ereport(WARNING,
+                (errmsg("pg_retry: this transaction holds %d of %d cached subtransaction IDs",
+                        (int) MyProc->subxidStatus.count, PGPROC_MAX_CACHED_SUBXIDS),
+                 errdetail("Beyond that, snapshots on the whole server slow down until the transaction ends."),
+                 errhint("Run the statements with retry.retry_batch(..., idempotent => true) to use one subtransaction per batch.")));
+    }
+}
+
+/*
+ * Look up a backoff strategy by the same names the GUC accepts
+ */
+static BackoffStrategy
+parse_backoff_strategy(const char *name)
+{
+    const struct config_enum_entry *option;
+
+    for (option = backoff_strategy_options; option->name != NULL; option++)
+    {
+        if (pg_strcasecmp(option->name, name) == 0)
+            return (BackoffStrategy) option->val;
+    }
+
+    ereport(ERROR,
+            (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+             errmsg("pg_retry: unknown backoff strategy \"%s\"", name),
+             errhint("Valid strategies are exponential, full_jitter, equal_jitter, decorrelated_jitter, linear and constant.")));
+    return BACKOFF_EXPONENTIAL; /* keep compiler quiet */
+}
+
+/*
+ * Name of a backoff strategy, one parse_backoff_strategy() accepts
+ */
+static const char *
+backoff_strategy_name(BackoffStrategy strategy)
+{
+    const struct config_enum_entry *option;
+
+    for (option = backoff_strategy_options; option->name != NULL; option++)
+    {
+        if (option->val == (int) strategy)
+            return option->name;
+    }
+
+    elog(ERROR, "unrecognized backoff strategy: %d", (int) strategy);
+    return NULL; /* keep compiler quiet */
+}
+
+/*
+ * Contention slot for a statement fingerprint, or NULL unless adaptive
+ * backoff is enabled and shared memory is available
+ */
+static RetryContentionSlot *
+contention_slot(uint64 fingerprint)
+{
+    if (!pg_retry_adaptive_backoff || retry_shared == NULL)
+        return NULL;
+
+    return &retry_shared->contention[fingerprint % PG_RETRY_CONTENTION_SLOTS];
+}
+
+/*
+ * Fold the outcome of one attempt into the slot's failure rate
+ */
+static void
+contention_record(RetryContentionSlot *slot, bool failed)
+{
+    uint32 old = pg_atomic_read_u32(&slot->failure_rate);
+    uint32 new;
+
+    do
+    {
+        new = old - (old >> PG_RETRY_RATE_SHIFT);
+        if (failed)
+            new += PG_RETRY_RATE_ONE >> PG_RETRY_RATE_SHIFT;
+    } while (!pg_atomic_compare_exchange_u32(&slot->failure_rate, &old, new));
+}
+
+/*
+ * Stretch a backoff delay by the current contention: the more of the recent
+ * attempts failed and the more backends are already sleeping on the same
+ * statement, the further apart the retries are spread. Without contention
+ * the delay is unchanged; it is never stretched past max_delay_ms.
+ */
+static long
+contention_adjust_delay(RetryContentionSlot *slot, long delay_ms, int max_delay_ms)
+{
+    double rate = (double) pg_atomic_read_u32(&slot->failure_rate) / PG_RETRY_RATE_ONE;
+    uint32 sleepers = pg_atomic_read_u32(&slot->sleepers);
+    double scale = 1.0 + rate * log2(1.0 + sleepers);
+    double stretched;
+
+    scale = Min(scale, PG_RETRY_ADAPTIVE_MAX_SCALE);
+    stretched = Min((double) delay_ms * scale, (double) max_delay_ms);
+
+    return Max(delay_ms, (long) stretched);
+}
+
+/*
+ * True when pg_retry.fairness_after_attempts has late attempts take tickets
+ */
+static inline bool
+fairness_enabled(void)
+{
+    return pg_retry_fairness_after_attempts > 0 && retry_shared != NULL;
+}
+
+/*
+ * Give back the ticket of this backend, also when the attempt holding it is
+ * cut short by backend exit
+ */
+static void
+fairness_release_ticket(void)
+{
+    RetryContentionSlot *slot = fairness_ticket;
+
+    if (slot == NULL)
+        return;
+
+    fairness_ticket = NULL;
+    if (pg_atomic_sub_fetch_u32(&slot->tickets, 1) == 0)
+        ConditionVariableBroadcast(&slot->fairness_cv);
+}
+
+/*
+ * Return a ticket still held when the backend exits
+ */
+static void
+fairness_shmem_exit(int code, Datum arg)
+{
+    fairness_release_ticket();
+}
+
+/*
+ * A call on its attempt past pg_retry.fairness_after_attempts has lost often
+ * enough: hold a ticket on its fingerprint's slot for the attempt, so fresh
+ * calls on the same statement let it go first. A backend holds at most one
+ * ticket; a call nested in a ticketed attempt goes without, and gets false.
+ */
+static bool
+fairness_take_ticket(uint64 fingerprint)
+{
+    RetryContentionSlot *slot = &retry_shared->contention[fingerprint % PG_RETRY_CONTENTION_SLOTS];
+
+    if (fairness_ticket != NULL)
+        return false;
+
+    if (!fairness_exit_hook_registered)
+    {
+        before_shmem_exit(fairness_shmem_exit, (Datum) 0);
+        fairness_exit_hook_registered = true;
+    }
+
+    pg_atomic_fetch_add_u32(&slot->tickets, 1);
+    fairness_ticket = slot;
+    return true;
+}
+
+/*
+ * Before the first attempt of a call, wait up to pg_retry.fairness_wait_ms
+ * while older retriers of the same fingerprint hold tickets, instead of
+ * racing them to the same rows
+ */
+static void
+fairness_yield(uint64 fingerprint)
+{
+    RetryContentionSlot *slot = &retry_shared->contention[fingerprint % PG_RETRY_CONTENTION_SLOTS];
+    TimestampTz give_up_at;
+    instr_time timing;
+
+    if (pg_retry_fairness_wait_ms == 0 || pg_atomic_read_u32(&slot->tickets) == 0)
+        return;
+
+    if (pg_retry_fairness_wait_event == 0)
+        pg_retry_fairness_wait_event = WaitEventExtensionNew("PgRetryFairness");
+
+    timing_start(&timing);
+    give_up_at = TimestampTzPlusMilliseconds(GetCurrentTimestamp(), pg_retry_fairness_wait_ms);
+    ConditionVariablePrepareToSleep(&slot->fairness_cv);
+    while (pg_atomic_read_u32(&slot->tickets) > 0)
+    {
+        long remaining = TimestampDifferenceMilliseconds(GetCurrentTimestamp(), give_up_at);
+
+        if (remaining <= 0 ||
+            ConditionVariableTimedSleep(&slot->fairness_cv, remaining, pg_retry_fairness_wait_event))
+            break;
+    }
+    ConditionVariableCancelSleep();
+    timing_end(RETRY_PHASE_FAIRNESS_WAIT, &timing);
+}
+
+/*
+ * True when the retry budget is enforced
+ */
+static inline bool
+retry_budget_enabled(void)
+{
+    return pg_retry_retry_budget_ratio >= 0 && retry_shared != NULL;
+}
+
+/*
+ * The retry budget's burst in fixed point
+ */
+static inline uint64
+retry_budget_cap(void)
+{
+    return (uint64) pg_retry_retry_budget_burst * PG_RETRY_BUDGET_ONE;
+}
+
+/*
+ * Earn the budget for one call's first attempt
+ */
+static void
+retry_budget_deposit(void)
+{
+    pg_atomic_uint64 *tokens;
+    uint64 cap;
+    uint64 deposit;
+    uint64 old;
+    uint64 new;
+
+    if (!retry_budget_enabled())
+        return;
+
+    tokens = &retry_shared->budget.tokens;
+    cap = retry_budget_cap();
+    deposit = (uint64) (pg_retry_retry_budget_ratio * PG_RETRY_BUDGET_ONE);
+    old = pg_atomic_read_u64(tokens);
+    do
+    {
+        /* Nothing to add to a full bucket, so leave its cache line alone */
+        if (old >= cap || deposit == 0)
+            return;
+        new = Min(old + deposit, cap);
+    } while (!pg_atomic_compare_exchange_u64(tokens, &old, new));
+}
+
+/*
+ * Take the token for one retry; false means the budget is used up and the
+ * caller must give up instead of retrying
+ */
+static bool
+retry_budget_withdraw(void)
+{
+    pg_atomic_uint64 *tokens;
+    uint64 cap;
+    uint64 old;
+    uint64 new;
+
+    if (!retry_budget_enabled())
+        return true;
+
+    tokens = &retry_shared->budget.tokens;
+    cap = retry_budget_cap();
+    old = pg_atomic_read_u64(tokens);
+    do
+    {
+        /* The burst may have been lowered since the tokens were deposited */
+        new = Min(old, cap);
+        if (new < PG_RETRY_BUDGET_ONE)
+            return false;
+        new -= PG_RETRY_BUDGET_ONE;
+    } while (!pg_atomic_compare_exchange_u64(tokens, &old, new));
+
+    return true;
+}
+
+/*
+ * Reserve shared memory for the retry counters
+ */
+static void
+pg_retry_shmem_request(void)
+{
+    if (prev_shmem_request_hook)
+        prev_shmem_request_hook();
+
+    RequestAddinShmemSpace(MAXALIGN(sizeof(RetrySharedState)));
+    RequestAddinShmemSpace(hash_estimate_size(pg_retry_max_statements,
+                                              sizeof(RetryStatementEntry)));
+    RequestAddinShmemSpace(hash_estimate_size(pg_retry_max_statements,
+                                              sizeof(RetryBreakerEntry)));
+    RequestNamedLWLockTranche("pg_retry", 3);
+}
+
+/*
+ * Attach to (and on first use initialize) the retry counters and the
+ * statement hash table
+ */
+static void
+pg_retry_shmem_startup(void)
+{
+    bool found;
+    HASHCTL info;
+
+    if (prev_shmem_startup_hook)
+        prev_shmem_startup_hook();
+
+    LWLockAcquire(AddinShmemInitLock, LW_EXCLUSIVE);
+    retry_shared = ShmemInitStruct("pg_retry", sizeof(RetrySharedState), &found);
+    if (!found)
+    {
+        LWLockPadded *locks;
+        int i;
+
+#ifndef PG_RETRY_PGSTAT
+        pg_atomic_init_u64(&retry_shared->calls, 0);
+        pg_atomic_init_u64(&retry_shared->attempts, 0);
+        pg_atomic_init_u64(&retry_shared->successes, 0);
+        pg_atomic_init_u64(&retry_shared->retries, 0);
+        pg_atomic_init_u64(&retry_shared->exhausted, 0);
+        pg_atomic_init_u64(&retry_shared->non_retryable, 0);
+        pg_atomic_init_u64(&retry_shared->sleep_us, 0);
+        pg_atomic_init_u64(&retry_shared->budget_denied, 0);
+        pg_atomic_init_u64(&retry_shared->stats_reset, (uint64) GetCurrentTimestamp());
+#endif
+        for (i = 0; i < PG_RETRY_SQLSTATE_SLOTS; i++)
+        {
+            pg_atomic_init_u32(&retry_shared->sqlstates[i].sqlerrcode, 0);
+            pg_atomic_init_u64(&retry_shared->sqlstates[i].retries, 0);
+            pg_atomic_init_u64(&retry_shared->sqlstates[i].exhausted, 0);
+        }
+        pg_atomic_init_u32(&retry_shared->other.sqlerrcode, 0);
+        pg_atomic_init_u64(&retry_shared->other.retries, 0);
+        pg_atomic_init_u64(&retry_shared->other.exhausted, 0);
+        locks = GetNamedLWLockTranche("pg_retry");
+        retry_shared->lock = &locks[0].lock;
+        retry_shared->breaker_lock = &locks[1].lock;
+        retry_shared->async_lock = &locks[2].lock;
+        memset(retry_shared->async_workers, 0, sizeof(retry_shared->async_workers));
+        for (i = 0; i < PG_RETRY_CONTENTION_SLOTS; i++)
+        {
+            pg_atomic_init_u32(&retry_shared->contention[i].failure_rate, 0);
+            pg_atomic_init_u32(&retry_shared->contention[i].sleepers, 0);
+            pg_atomic_init_u32(&retry_shared->contention[i].tickets, 0);
+            ConditionVariableInit(&retry_shared->contention[i].fairness_cv);
+        }
+        pg_atomic_init_u64(&retry_shared->budget.tokens, retry_budget_cap());
+        for (i = 0; i < RETRY_NUM_PHASES; i++)
+        {
+            int bucket;
+
+            for (bucket = 0; bucket < PG_RETRY_TIMING_BUCKETS; bucket++)
+                pg_atomic_init_u64(&retry_shared->timings.counts[i][bucket], 0);
+        }
+    }
+
+    info.keysize = sizeof(RetryStatementKey);
+    info.entrysize = sizeof(RetryStatementEntry);
+    statement_hash = ShmemInitHash("pg_retry statements",
+                                   pg_retry_max_statements, pg_retry_max_statements,
+                                   &info, HASH_ELEM | HASH_BLOBS);
+
+    info.keysize = sizeof(RetryBreakerKey);
+    info.entrysize = sizeof(RetryBreakerEntry);
+    breaker_hash = ShmemInitHash("pg_retry breakers",
+                                 pg_retry_max_statements, pg_retry_max_statements,
+                                 &info, HASH_ELEM | HASH_BLOBS);
+    LWLockRelease(AddinShmemInitLock);
+}
+
+#ifdef PG_RETRY_PGSTAT
+/*
+ * pgstat callbacks of the kind holding RetryStatCounters. pgstat writes the
+ * counters to its file at shutdown and restores them at startup.
+ */
+static void
+retry_pgstat_init_shmem(void *stats)
+{
+    RetryStatShared *shared = (RetryStatShared *) stats;
+
+    LWLockInitialize(&shared->lock, LWTRANCHE_PGSTATS_DATA);
+}
+
+static void
+retry_pgstat_reset_all(TimestampTz ts)
+{
+    RetryStatShared *shared = pgstat_get_custom_shmem_data(PG_RETRY_PGSTAT_KIND);
+
+    LWLockAcquire(&shared->lock, LW_EXCLUSIVE);
+    pgstat_begin_changecount_write(&shared->changecount);
+    memset(&shared->stats, 0, sizeof(shared->stats));
+    shared->stats.stat_reset_timestamp = ts;
+    pgstat_end_changecount_write(&shared->changecount);
+    LWLockRelease(&shared->lock);
+}
+
+static void
+retry_pgstat_snapshot(void)
+{
+    RetryStatShared *shared = pgstat_get_custom_shmem_data(PG_RETRY_PGSTAT_KIND);
+    RetryStatCounters *snapshot = pgstat_get_custom_snapshot_data(PG_RETRY_PGSTAT_KIND);
+
+    pgstat_copy_changecounted_stats(snapshot, &shared->stats, sizeof(shared->stats),
+                                    &shared->changecount);
+}
+
+static bool
+retry_pgstat_have_static_pending(void)
+{
+    return retry_pgstat_have_pending;
+}
+
+/*
+ * Add this backend's pending counters to the shared ones. Called by
+ * pgstat_report_stat(), which passes nowait while the backend is busy: the
+ * counters then stay pending if another backend holds the lock, and true is
+ * returned so pgstat tries again later.
+ */
+static bool
+retry_pgstat_flush(bool nowait)
+{
+    RetryStatShared *shared;
+
+    if (!retry_pgstat_have_pending)
+        return false;
+
+    shared = pgstat_get_custom_shmem_data(PG_RETRY_PGSTAT_KIND);
+    if (!nowait)
+        LWLockAcquire(&shared->lock, LW_EXCLUSIVE);
+    else if (!LWLockConditionalAcquire(&shared->lock, LW_EXCLUSIVE))
+        return true;
+
+    pgstat_begin_changecount_write(&shared->changecount);
+    shared->stats.calls += retry_pgstat_pending.calls;
+    shared->stats.attempts += retry_pgstat_pending.attempts;
+    shared->stats.successes += retry_pgstat_pending.successes;
+    shared->stats.retries += retry_pgstat_pending.retries;
+    shared->stats.exhausted += retry_pgstat_pending.exhausted;
+    shared->stats.non_retryable += retry_pgstat_pending.non_retryable;
+    shared->stats.budget_denied += retry_pgstat_pending.budget_denied;
+    shared->stats.sleep_us += retry_pgstat_pending.sleep_us;
+    pgstat_end_changecount_write(&shared->changecount);
+    LWLockRelease(&shared->lock);
+
+    memset(&retry_pgstat_pending, 0, sizeof(retry_pgstat_pending));
+    retry_pgstat_have_pending = false;
+
+    return false;
+}
+
+static const PgStat_KindInfo retry_pgstat_kind = {
+    .name = "pg_retry",
+    .fixed_amount = true,
+    .write_to_file = true,
+    .shared_size = sizeof(RetryStatShared),
+    .shared_data_off = offsetof(RetryStatShared, stats),
+    .shared_data_len = sizeof(((RetryStatShared *) 0)->stats),
+    .have_static_pending_cb = retry_pgstat_have_static_pending,
+    .flush_static_cb = retry_pgstat_flush,
+    .init_shmem_cb = retry_pgstat_init_shmem,
+    .reset_all_cb = retry_pgstat_reset_all,
+    .snapshot_cb = retry_pgstat_snapshot,
+};
+#endif
+
+/*
+ * True when failures should be counted at all
+ */
+static inline bool
+stats_enabled(void)
+{
+    return retry_shared != NULL && pg_retry_track_stats;
+}
+
+/*
+ * Find or claim the shared slot for a SQLSTATE
+ */
+static RetrySqlStateCounter *
+stats_sqlstate_slot(int sqlerrcode)
+{
+    int i;
+
+    for (i = 0; i < PG_RETRY_SQLSTATE_SLOTS; i++)
+    {
+        RetrySqlStateCounter *slot = &retry_shared->sqlstates[i];
+        uint32 current = pg_atomic_read_u32(&slot->sqlerrcode);
+
+        if (current == (uint32) sqlerrcode)
+            return slot;
+
+        if (current == 0)
+        {
+            uint32 expected = 0;
+
+            if (pg_atomic_compare_exchange_u32(&slot->sqlerrcode, &expected, (uint32) sqlerrcode) ||
+                expected == (uint32) sqlerrcode)
+                return slot;
+        }
+    }
+
+    return &retry_shared->other;
+}
+
+/*
+ * Add this backend's pending counters to shared memory
+ */
+static void
+stats_flush(void)
+{
+    int i;
+
+    if (!retry_pending.pending || retry_shared == NULL)
+        return;
+
+    timing_flush();
+
+#ifdef PG_RETRY_PGSTAT
+    /* pgstat_report_stat() pushes these out with the built-in statistics */
+    retry_pgstat_pending.calls += retry_pending.calls;
+    retry_pgstat_pending.attempts += retry_pending.attempts;
+    retry_pgstat_pending.successes += retry_pending.successes;
+    retry_pgstat_pending.retries += retry_pending.retries;
+    retry_pgstat_pending.exhausted += retry_pending.exhausted;
+    retry_pgstat_pending.non_retryable += retry_pending.non_retryable;
+    retry_pgstat_pending.budget_denied += retry_pending.budget_denied;
+    retry_pgstat_pending.sleep_us += retry_pending.sleep_us;
+    retry_pgstat_have_pending = true;
+#else
+    pg_atomic_fetch_add_u64(&retry_shared->calls, retry_pending.calls);
+    pg_atomic_fetch_add_u64(&retry_shared->attempts, retry_pending.attempts);
+    pg_atomic_fetch_add_u64(&retry_shared->successes, retry_pending.successes);
+    if (retry_pending.retries > 0)
+        pg_atomic_fetch_add_u64(&retry_shared->retries, retry_pending.retries);
+    if (retry_pending.exhausted > 0)
+        pg_atomic_fetch_add_u64(&retry_shared->exhausted, retry_pending.exhausted);
+    if (retry_pending.non_retryable > 0)
+        pg_atomic_fetch_add_u64(&retry_shared->non_retryable, retry_pending.non_retryable);
+    if (retry_pending.budget_denied > 0)
+        pg_atomic_fetch_add_u64(&retry_shared->budget_denied, retry_pending.budget_denied);
+    if (retry_pending.sleep_us > 0)
+        pg_atomic_fetch_add_u64(&retry_shared->sleep_us, retry_pending.sleep_us);
+#endif
+
+    for (i = 0; i < retry_pending.nsqlstates; i++)
+    {
+        RetrySqlStateCounter *slot = stats_sqlstate_slot(retry_pending.sqlstates[i].sqlerrcode);
+
+        if (retry_pending.sqlstates[i].retries > 0)
+            pg_atomic_fetch_add_u64(&slot->retries, retry_pending.sqlstates[i].retries);
+        if (retry_pending.sqlstates[i].exhausted > 0)
+            pg_atomic_fetch_add_u64(&slot->exhausted, retry_pending.sqlstates[i].exhausted);
+    }
+
+    memset(&retry_pending, 0, sizeof(retry_pending));
+}
+
+/*
+ * Flush pending counters when the backend exits
+ */
+static void
+stats_shmem_exit(int code, Datum arg)
+{
+    stats_flush();
+}
+
+/*
+ * Mark counters as pending, arranging for a flush at backend exit
+ */
+static inline void
+stats_mark_pending(void)
+{
+    if (!retry_exit_hook_registered)
+    {
+        before_shmem_exit(stats_shmem_exit, (Datum) 0);
+        retry_exit_hook_registered = true;
+    }
+    retry_pending.pending = true;
+}
+
+/*
+ * True when pg_retry.track_timing asks for phase timings
+ */
+static inline bool
+timing_enabled(void)
+{
+    return retry_shared != NULL && pg_retry_track_timing;
+}
+
+/*
+ * Start timing a phase. The start stays zero while timing is off, which
+ * timing_end() takes as nothing to record.
+ */
+static inline void
+timing_start(instr_time *start)
+{
+    if (timing_enabled())
+        INSTR_TIME_SET_CURRENT(*start);
+    else
+        INSTR_TIME_SET_ZERO(*start);
+}
+
+/*
+ * Histogram bucket of a duration in microseconds
+ */
+static int
+timing_bucket(uint64 us)
+{
+    int msb;
+    int bucket;
+
+    if (us < 4)
+        return (int) us;
+
+    msb = pg_leftmost_one_pos64(us);
+    bucket = 4 * (msb - 1) + (int) ((us >> (msb - 2)) & 3);
+
+    return Min(bucket, PG_RETRY_TIMING_BUCKETS - 1);
+}
+
+/*
+ * Lowest duration in microseconds that falls into a bucket
+ */
+static uint64
+timing_bucket_lower(int bucket)
+{
+    int msb;
+
+    if (bucket < 4)
+        return (uint64) bucket;
+
+    msb = bucket / 4 + 1;
+    return (uint64) (4 + bucket % 4) << (msb - 2);
+}
+
+/*
+ * Record the time spent in a phase since timing_start()
+ */
+static void
+timing_end(RetryPhase phase, instr_time *start)
+{
+    instr_time elapsed;
+
+    if (INSTR_TIME_IS_ZERO(*start))
+        return;
+
+    INSTR_TIME_SET_CURRENT(elapsed);
+    INSTR_TIME_SUBTRACT(elapsed, *start);
+
+    stats_mark_pending();
+    retry_timing_pending.pending = true;
+    retry_timing_pending.phases[phase] = true;
+    retry_timing_pending.counts[phase][timing_bucket(INSTR_TIME_GET_MICROSEC(elapsed))]++;
+}
+
+/*
+ * Add this backend's pending phase timings to shared memory
+ */
+static void
+timing_flush(void)
+{
+    int phase;
+    int bucket;
+
+    if (!retry_timing_pending.pending)
+        return;
+
+    for (phase = 0; phase < RETRY_NUM_PHASES; phase++)
+    {
+        if (!retry_timing_pending.phases[phase])
+            continue;
+
+        for (bucket = 0; bucket < PG_RETRY_TIMING_BUCKETS; bucket++)
+        {
+            if (retry_timing_pending.counts[phase][bucket] > 0)
+                pg_atomic_fetch_add_u64(&retry_shared->timings.counts[phase][bucket],
+                                        retry_timing_pending.counts[phase][bucket]);
+        }
+    }
+
+    memset(&retry_timing_pending, 0, sizeof(retry_timing_pending));
+}
+
+/*
+ * Count a retryable failure, either retried or (exhausted) the last one
+ */
+static void
+stats_count_sqlstate(int sqlerrcode, bool exhausted)
+{
+    int i;
+
+    if (exhausted)
+        retry_pending.exhausted++;
+    else
+        retry_pending.retries++;
+
+    for (i = 0; i < retry_pending.nsqlstates; i++)
+    {
+        if (retry_pending.sqlstates[i].sqlerrcode == sqlerrcode)
+            break;
+    }
+
+    if (i == retry_pending.nsqlstates)
+    {
+        if (i == PG_RETRY_PENDING_SQLSTATES)
+        {
+            /* Local buffer is full; push it out and start over */
+            stats_flush();
+            stats_mark_pending();
+            i = 0;
+        }
+        retry_pending.sqlstates[i].sqlerrcode = sqlerrcode;
+        retry_pending.sqlstates[i].retries = 0;
+        retry_pending.sqlstates[i].exhausted = 0;
+        retry_pending.nsqlstates = i + 1;
+    }
+
+    if (exhausted)
+        retry_pending.sqlstates[i].exhausted++;
+    else
+        retry_pending.sqlstates[i].retries++;
+}
+
+/*
+ * Flush pending counters at the end of each top-level transaction
+ */
+static void
+stats_xact_callback(XactEvent event, void *arg)
+{
+    switch (event)
+    {
+        case XACT_EVENT_COMMIT:
+        case XACT_EVENT_ABORT:
+        case XACT_EVENT_PREPARE:
+            retry_deferred_failures_flush();
+            stats_flush();
+            /* Subtransactions are counted per top-level transaction */
+            retry_xact_subxacts = 0;
+            retry_subxact_warned = false;
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Error out unless the shared counters exist
+ */
+static void
+stats_check_loaded(void)
+{
+    if (retry_shared == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_retry: statistics require pg_retry to be loaded via shared_preload_libraries")));
+}
+
+/*
+ * Fingerprint of a prepared statement: the query ID core computed while
+ * analyzing it (constants and formatting don't matter), or the fallback
+ * when query IDs are disabled.
+ */
+static uint64
+plan_fingerprint(SPIPlanPtr plan, uint64 fallback)
+{
+    List *plansources = SPI_plan_get_plan_sources(plan);
+
+    if (list_length(plansources) == 1)
+    {
+        CachedPlanSource *plansource = (CachedPlanSource *) linitial(plansources);
+
+        if (plansource->query_list != NIL)
+        {
+            Query *query = linitial_node(Query, plansource->query_list);
+
+            if (query->queryId != 0)
+                return (uint64) query->queryId;
+        }
+    }
+
+    return fallback;
+}
+
+/*
+ * True if the analyzed statement only reads: a SELECT without data-modifying
+ * CTEs, row locks or volatile functions (which may write). Such statements
+ * run with read_only = true, so SPI neither bumps the command counter nor
+ * copies a snapshot per execution.
+ */
+static bool
+plan_is_read_only(SPIPlanPtr plan)
+{
+    List *plansources = SPI_plan_get_plan_sources(plan);
+    CachedPlanSource *plansource;
+    Query *query;
+
+    if (list_length(plansources) != 1)
+        return false;
+
+    plansource = (CachedPlanSource *) linitial(plansources);
+    if (list_length(plansource->query_list) != 1)
+        return false;
+
+    query = linitial_node(Query, plansource->query_list);
+    return query->commandType == CMD_SELECT &&
+           query->utilityStmt == NULL &&
+           !query->hasModifyingCTE &&
+           query->rowMarks == NIL &&
+           !contain_volatile_functions((Node *) query);
+}
+
+/*
+ * Whether a cached statement can run this attempt with read_only = true. A
+ * replan analyzes the statement again, and a function it calls may have been
+ * redefined as VOLATILE in between, so the answer is worked out afresh once
+ * pending invalidations are in. Until the plan is analyzed again, a statement
+ * they invalidated runs as if it could write.
+ */
+static bool
+plan_entry_read_only(PlanCacheEntry *entry)
+{
+    List *plansources = SPI_plan_get_plan_sources(entry->plan);
+
+    AcceptInvalidationMessages();
+    if (list_length(plansources) != 1 ||
+        !CachedPlanIsValid((CachedPlanSource *) linitial(plansources)))
+        entry->read_only = false;
+    else
+        entry->read_only = plan_is_read_only(entry->plan);
+
+    return entry->read_only;
+}
+
+/*
+ * Log-linear histogram bucket of a value in microseconds
+ */
+static int
+hist_bucket(uint64 value)
+{
+    int msb;
+
+    if (value < 4)
+        return (int) value;
+
+    msb = pg_leftmost_one_pos64(value);
+    if (msb > PG_RETRY_HIST_MAX_MSB)
+        return PG_RETRY_HIST_BUCKETS - 1;
+
+    return 4 + (msb - 2) * 4 + (int) ((value >> (msb - 2)) & 3);
+}
+
+/*
+ * Value range [lower, upper) covered by a histogram bucket
+ */
+static void
+hist_bucket_bounds(int bucket, double *lower, double *upper)
+{
+    int shift;
+    uint64 sub;
+
+    if (bucket < 4)
+    {
+        *lower = bucket;
+        *upper = bucket + 1;
+        return;
+    }
+
+    shift = (bucket - 4) / 4;
+    sub = (bucket - 4) % 4 + 4;
+    *lower = (double) (sub << shift);
+    *upper = (double) ((sub + 1) << shift);
+}
+
+/*
+ * Estimate a percentile (fraction in 0..1) from a histogram holding total
+ * samples, interpolating linearly inside the bucket it falls into
+ */
+static double
+hist_percentile(const int64 *hist, int64 total, double fraction)
+{
+    double rank;
+    int64 cumulative = 0;
+    int i;
+
+    if (total <= 0)
+        return 0.0;
+
+    rank = fraction * total;
+    for (i = 0; i < PG_RETRY_HIST_BUCKETS; i++)
+    {
+        double lower;
+        double upper;
+
+        if (hist[i] == 0)
+            continue;
+
+        if (cumulative + hist[i] >= rank)
+        {
+            hist_bucket_bounds(i, &lower, &upper);
+            return lower + (upper - lower) * (rank - cumulative) / hist[i];
+        }
+        cumulative += hist[i];
+    }
+
+    return 0.0;
+}
+
+/*
+ * Backoff histogram bucket of a delay in milliseconds
+ */
+static int
+backoff_bucket(long delay_ms)
+{
+    if (delay_ms < 1)
+        return 0;
+
+    return Min(PG_RETRY_BACKOFF_BUCKETS - 1, pg_leftmost_one_pos64((uint64) delay_ms) + 1);
+}
+
+/*
+ * Create the entry for a statement, evicting the least used ones when the
+ * table is full. Caller must hold the lock exclusively.
+ */
+static RetryStatementEntry *
+statement_entry_alloc(RetryStatementKey *key, const char *sql)
+{
+    RetryStatementEntry *entry;
+    bool found;
+
+    while (hash_get_num_entries(statement_hash) >= pg_retry_max_statements)
+        statement_entry_dealloc();
+
+    entry = (RetryStatementEntry *) hash_search(statement_hash, key, HASH_ENTER, &found);
+    if (!found)
+    {
+        int len = strlen(sql);
+
+        memset(&entry->counters, 0, sizeof(entry->counters));
+        entry->counters.usage = PG_RETRY_USAGE_INIT;
+        SpinLockInit(&entry->mutex);
+        if (len >= PG_RETRY_STATEMENT_TEXT_LEN)
+            len = pg_mbcliplen(sql, len, PG_RETRY_STATEMENT_TEXT_LEN - 1);
+        memcpy(entry->query, sql, len);
+        entry->query[len] = '\0';
+        entry->query_len = len;
+    }
+
+    return entry;
+}
+
+/*
+ * qsort comparator ordering entries by usage
+ */
+static int
+statement_entry_cmp(const void *lhs, const void *rhs)
+{
+    double l_usage = (*(RetryStatementEntry *const *) lhs)->counters.usage;
+    double r_usage = (*(RetryStatementEntry *const *) rhs)->counters.usage;
+
+    if (l_usage < r_usage)
+        return -1;
+    else if (l_usage > r_usage)
+        return +1;
+    else
+        return 0;
+}
+
+/*
+ * Age every entry and drop the least used few percent.
+ * Caller must hold the lock exclusively.
+ */
+static void
+statement_entry_dealloc(void)
+{
+    HASH_SEQ_STATUS hash_seq;
+    RetryStatementEntry **entries;
+    RetryStatementEntry *entry;
+    int nentries = 0;
+    int nvictims;
+    int i;
+
+    entries = palloc(hash_get_num_entries(statement_hash) * sizeof(RetryStatementEntry *));
+
+    hash_seq_init(&hash_seq, statement_hash);
+    while ((entry = (RetryStatementEntry *) hash_seq_search(&hash_seq)) != NULL)
+    {
+        entries[nentries++] = entry;
+        entry->counters.usage *= PG_RETRY_USAGE_DECREASE_FACTOR;
+    }
+
+    qsort(entries, nentries, sizeof(RetryStatementEntry *), statement_entry_cmp);
+
+    nvictims = Max(PG_RETRY_USAGE_DEALLOC_MIN, nentries * PG_RETRY_USAGE_DEALLOC_PERCENT / 100);
+    nvictims = Min(nvictims, nentries);
+
+    for (i = 0; i < nvictims; i++)
+        hash_search(statement_hash, &entries[i]->key, HASH_REMOVE, NULL);
+
+    pfree(entries);
+}
+
+/*
+ * Start collecting one call's statement stats, or return NULL when
+ * statistics are off. The struct is palloc'd so it can be updated from
+ * inside PG_TRY blocks without volatile qualifiers.
+ */
+static StatementCallStats *
+statement_call_begin(uint64 queryid, const char *sql)
+{
+    StatementCallStats *call;
+
+    if (!stats_enabled() || statement_hash == NULL)
+        return NULL;
+
+    call = palloc0(sizeof(StatementCallStats));
+    call->queryid = queryid;
+    call->userid = GetUserId();
+    call->sql = sql;
+    call->calls = 1;
+    return call;
+}
+
+/*
+ * Record the run time of the attempt that began at call->attempt_start
+ */
+static void
+statement_call_attempt_done(StatementCallStats *call)
+{
+    instr_time elapsed;
+
+    INSTR_TIME_SET_CURRENT(elapsed);
+    INSTR_TIME_SUBTRACT(elapsed, call->attempt_start);
+
+    if (call->nexec == PG_RETRY_CALL_EXEC_TIMES)
+        statement_call_store(call);
+
+    call->attempts++;
+    call->exec_ms[call->nexec++] = INSTR_TIME_GET_MILLISEC(elapsed);
+}
+
+/*
+ * Record a failed attempt
+ */
+static void
+statement_call_failure(StatementCallStats *call, int sqlerrcode, bool retryable)
+{
+    int i;
+
+    if (!retryable)
+    {
+        call->non_retryable++;
+        return;
+    }
+
+    for (i = 0; i < call->nsqlstates; i++)
+    {
+        if (call->sqlstates[i] == sqlerrcode)
+        {
+            call->sqlstate_failures[i]++;
+            return;
+        }
+    }
+
+    if (call->nsqlstates < PG_RETRY_STATEMENT_SQLSTATES)
+    {
+        call->sqlstates[call->nsqlstates] = sqlerrcode;
+        call->sqlstate_failures[call->nsqlstates++] = 1;
+    }
+    else
+        call->other_failures++;
+}
+
+/*
+ * Record a backoff sleep
+ */
+static void
+statement_call_backoff(StatementCallStats *call, long delay_ms)
+{
+    call->backoff_hist[backoff_bucket(delay_ms)]++;
+    call->total_backoff_ms += delay_ms;
+}
+
+/*
+ * Add the accumulated counters to the statement's shared entry and clear
+ * them, keeping the fingerprint for further attempts
+ */
+static void
+statement_call_store(StatementCallStats *call)
+{
+    RetryStatementKey key;
+    RetryStatementEntry *entry;
+    RetryStatementCounters *c;
+    int i;
+    int j;
+
+    memset(&key, 0, sizeof(key));
+    key.userid = call->userid;
+    key.dbid = MyDatabaseId;
+    key.queryid = call->queryid;
+
+    LWLockAcquire(retry_shared->lock, LW_SHARED);
+    entry = (RetryStatementEntry *) hash_search(statement_hash, &key, HASH_FIND, NULL);
+    if (entry == NULL)
+    {
+        LWLockRelease(retry_shared->lock);
+        LWLockAcquire(retry_shared->lock, LW_EXCLUSIVE);
+        entry = statement_entry_alloc(&key, call->sql);
+    }
+
+    SpinLockAcquire(&entry->mutex);
+    c = &entry->counters;
+    c->calls += call->calls;
+    c->attempts += call->attempts;
+    c->successes += call->successes;
+    c->exhausted += call->exhausted;
+    c->non_retryable += call->non_retryable;
+    c->usage += call->calls;
+
+    for (i = 0; i < call->nsqlstates; i++)
+    {
+        for (j = 0; j < c->nsqlstates; j++)
+        {
+            if (c->sqlstates[j] == call->sqlstates[i])
+                break;
+        }
+
+        if (j == c->nsqlstates && j < PG_RETRY_STATEMENT_SQLSTATES)
+        {
+            c->sqlstates[j] = call->sqlstates[i];
+            c->sqlstate_failures[j] = 0;
+            c->nsqlstates++;
+        }
+
+        if (j < PG_RETRY_STATEMENT_SQLSTATES)
+            c->sqlstate_failures[j] += call->sqlstate_failures[i];
+        else
+            c->other_failures += call->sqlstate_failures[i];
+    }
+    c->other_failures += call->other_failures;
+
+    for (i = 0; i < PG_RETRY_BACKOFF_BUCKETS; i++)
+        c->backoff_hist[i] += call->backoff_hist[i];
+    c->total_backoff_ms += call->total_backoff_ms;
+
+    for (i = 0; i < call->nexec; i++)
+    {
+        double ms = call->exec_ms[i];
+
+        c->exec_hist[hist_bucket((uint64) (ms * 1000.0))]++;
+        c->total_exec_ms += ms;
+        c->max_exec_ms = Max(c->max_exec_ms, ms);
+    }
+    SpinLockRelease(&entry->mutex);
+
+    LWLockRelease(retry_shared->lock);
+
+    memset(&call->calls, 0,
+           sizeof(StatementCallStats) - offsetof(StatementCallStats, calls));
+}
+
+/*
+ * Find or create the breaker of a fingerprint in this database. When the
+ * table is full, idle closed breakers are dropped to make room; if there
+ * are none the statement goes unguarded and NULL is returned. Caller must
+ * hold the breaker lock shared; it may be upgraded to exclusive and is held
+ * in that mode on return.
+ */
+static RetryBreakerEntry *
+breaker_entry(uint64 fingerprint)
+{
+    RetryBreakerKey key;
+    RetryBreakerEntry *entry;
+    bool found;
+
+    memset(&key, 0, sizeof(key));
+    key.dbid = MyDatabaseId;
+    key.queryid = fingerprint;
+
+    entry = (RetryBreakerEntry *) hash_search(breaker_hash, &key, HASH_FIND, NULL);
+    if (entry != NULL)
+        return entry;
+
+    LWLockRelease(retry_shared->breaker_lock);
+    LWLockAcquire(retry_shared->breaker_lock, LW_EXCLUSIVE);
+
+    if (hash_get_num_entries(breaker_hash) >= pg_retry_max_statements &&
+        hash_search(breaker_hash, &key, HASH_FIND, NULL) == NULL)
+    {
+        HASH_SEQ_STATUS hash_seq;
+        RetryBreakerEntry *victim;
+        TimestampTz now = GetCurrentTimestamp();
+
+        hash_seq_init(&hash_seq, breaker_hash);
+        while ((victim = (RetryBreakerEntry *) hash_seq_search(&hash_seq)) != NULL)
+        {
+            if (victim->state == BREAKER_CLOSED &&
+                TimestampDifferenceExceeds(victim->window_start, now, pg_retry_breaker_window_ms))
+                hash_search(breaker_hash, &victim->key, HASH_REMOVE, NULL);
+        }
+
+        if (hash_get_num_entries(breaker_hash) >= pg_retry_max_statements)
+            return NULL;
+    }
+
+    entry = (RetryBreakerEntry *) hash_search(breaker_hash, &key, HASH_ENTER, &found);
+    if (!found)
+    {
+        SpinLockInit(&entry->mutex);
+        entry->state = BREAKER_CLOSED;
+        entry->failures = 0;
+        entry->window_start = GetCurrentTimestamp();
+        entry->state_since = entry->window_start;
+        entry->probe_pid = 0;
+        entry->opens = 0;
+    }
+
+    return entry;
+}
+
+/*
+ * Feed a retryable failure to the breaker of a fingerprint and return
+ * whether the call may retry. last says no attempt is left anyway. *probe
+ * is set when this backend is probing a half-open breaker.
+ */
+static bool
+breaker_on_failure(uint64 fingerprint, bool last, bool *probe)
+{
+    RetryBreakerEntry *entry;
+    TimestampTz now;
+    bool allow = true;
+
+    *probe = false;
+    if (pg_retry_breaker_threshold <= 0 || retry_shared == NULL)
+        return true;
+
+    LWLockAcquire(retry_shared->breaker_lock, LW_SHARED);
+    entry = breaker_entry(fingerprint);
+    if (entry == NULL)
+    {
+        LWLockRelease(retry_shared->breaker_lock);
+        return true;
+    }
+
+    now = GetCurrentTimestamp();
+    SpinLockAcquire(&entry->mutex);
+    switch (entry->state)
+    {
+        case BREAKER_CLOSED:
+            if (TimestampDifferenceExceeds(entry->window_start, now, pg_retry_breaker_window_ms))
+            {
+                entry->window_start = now;
+                entry->failures = 0;
+            }
+            if (++entry->failures >= pg_retry_breaker_threshold)
+            {
+                entry->state = BREAKER_OPEN;
+                entry->state_since = now;
+                entry->opens++;
+                allow = false;
+            }
+            break;
+
+        case BREAKER_HALF_OPEN:
+            if (entry->probe_pid == MyProcPid)
+            {
+                /* Our probe ran out of attempts: back to open */
+                if (last)
+                {
+                    entry->state = BREAKER_OPEN;
+                    entry->state_since = now;
+                    entry->probe_pid = 0;
+                    entry->opens++;
+                }
+                *probe = true;
+                break;
+            }
+            /* A probe that never reported back is replaced after a cooldown */
+            /* FALLTHROUGH */
+
+        case BREAKER_OPEN:
+            if (!last &&
+                TimestampDifferenceExceeds(entry->state_since, now, pg_retry_breaker_cooldown_ms))
+            {
+                entry->state = BREAKER_HALF_OPEN;
+                entry->state_since = now;
+                entry->probe_pid = MyProcPid;
+                *probe = true;
+            }
+            else
+                allow = false;
+            break;
+    }
+    SpinLockRelease(&entry->mutex);
+    LWLockRelease(retry_shared->breaker_lock);
+
+    return allow;
+}
+
+/*
+ * The half-open probe of a fingerprint succeeded: close its breaker
+ */
+static void
+breaker_on_probe_success(uint64 fingerprint)
+{
+    RetryBreakerKey key;
+    RetryBreakerEntry *entry;
+
+    if (retry_shared == NULL)
+        return;
+
+    memset(&key, 0, sizeof(key));
+    key.dbid = MyDatabaseId;
+    key.queryid = fingerprint;
+
+    LWLockAcquire(retry_shared->breaker_lock, LW_SHARED);
+    entry = (RetryBreakerEntry *) hash_search(breaker_hash, &key, HASH_FIND, NULL);
+    if (entry != NULL)
+    {
+        TimestampTz now = GetCurrentTimestamp();
+
+        SpinLockAcquire(&entry->mutex);
+        if (entry->state == BREAKER_HALF_OPEN && entry->probe_pid == MyProcPid)
+        {
+            entry->state = BREAKER_CLOSED;
+            entry->state_since = now;
+            entry->window_start = now;
+            entry->failures = 0;
+            entry->probe_pid = 0;
+        }
+        SpinLockRelease(&entry->mutex);
+    }
+    LWLockRelease(retry_shared->breaker_lock);
+}
+
+/*
+ * Name of a breaker state as shown by retry.statement_stats
+ */
+static const char *
+breaker_state_name(BreakerState state)
+{
+    switch (state)
+    {
+        case BREAKER_CLOSED:
+            return "closed";
+        case BREAKER_OPEN:
+            return "open";
+        case BREAKER_HALF_OPEN:
+            return "half_open";
+    }
+    return "unknown"; /* keep compiler quiet */
+}
+
+/*
+ * Resolve the retry settings that follow the statement arguments.
+ * Arguments argno .. argno + 6 are max_tries, base_delay_ms, max_delay_ms,
+ * retry_sqlstates, strategy, deadline_ms and the name of a policy in
+ * retry.policy. An argument given explicitly wins over the named policy,
+ * and anything neither sets comes from the matching GUC default.
+ */
+static void
+parse_retry_policy(FunctionCallInfo fcinfo, int argno, RetryPolicy *policy)
+{
+    PolicyCacheEntry named;
+
+    /* Without a named policy, every setting falls through to the GUCs */
+    memset(&named, 0, sizeof(named));
+    named.max_tries = named.base_delay_ms = named.max_delay_ms = -1;
+    named.strategy = named.deadline_ms = -1;
+
+    if (!PG_ARGISNULL(argno + 6))
+    {
+        char *name = text_to_cstring(PG_GETARG_TEXT_PP(argno + 6));
+
+        /* Copy the entry: detoasting the other arguments may invalidate it */
+        named = *policy_cache_lookup(name);
+        pfree(name);
+    }
+
+    if (!PG_ARGISNULL(argno))
+        policy->max_tries = PG_GETARG_INT32(argno);
+    else if (named.max_tries >= 0)
+        policy->max_tries = named.max_tries;
+    else
+        policy->max_tries = pg_retry_default_max_tries;
+
+    if (!PG_ARGISNULL(argno + 1))
+        policy->base_delay_ms = PG_GETARG_INT32(argno + 1);
+    else if (named.base_delay_ms >= 0)
+        policy->base_delay_ms = named.base_delay_ms;
+    else
+        policy->base_delay_ms = pg_retry_default_base_delay_ms;
+
+    if (!PG_ARGISNULL(argno + 2))
+        policy->max_delay_ms = PG_GETARG_INT32(argno + 2);
+    else if (named.max_delay_ms >= 0)
+        policy->max_delay_ms = named.max_delay_ms;
+    else
+        policy->max_delay_ms = pg_retry_default_max_delay_ms;
+
+    if (!PG_ARGISNULL(argno + 3))
+    {
+        ArrayType *retry_sqlstates = PG_GETARG_ARRAYTYPE_P(argno + 3);
+
+        policy->retry_sqlstates = compile_sqlstate_array(retry_sqlstates);
+        PG_FREE_IF_COPY(retry_sqlstates, argno + 3);
+    }
+    else if (named.retry_sqlstates != NULL)
+        policy->retry_sqlstates = copy_sqlstate_set(named.retry_sqlstates);
+    else
+        policy->retry_sqlstates = copy_default_sqlstate_set();
+
+    if (!PG_ARGISNULL(argno + 4))
+    {
+        char *strategy = text_to_cstring(PG_GETARG_TEXT_PP(argno + 4));
+
+        policy->strategy = parse_backoff_strategy(strategy);
+        pfree(strategy);
+    }
+    else if (named.strategy >= 0)
+        policy->strategy = (BackoffStrategy) named.strategy;
+    else
+        policy->strategy = (BackoffStrategy) pg_retry_default_backoff_strategy;
+
+    if (!PG_ARGISNULL(argno + 5))
+        policy->deadline_ms = PG_GETARG_INT32(argno + 5);
+    else if (named.deadline_ms >= 0)
+        policy->deadline_ms = named.deadline_ms;
+    else
+        policy->deadline_ms = pg_retry_default_deadline_ms;
+
+    /* Per-SQLSTATE overrides only come from a named policy */
+    policy->sqlstate_policy = named.sqlstate_policy != NULL ?
+        copy_sqlstate_policy(named.sqlstate_policy) : NULL;
+
+    validate_retry_policy(policy);
+
+    /* The clock starts now, so a batch shares one deadline */
+    policy->deadline = policy->deadline_ms > 0 ?
+        TimestampTzPlusMilliseconds(GetCurrentTimestamp(), policy->deadline_ms) : 0;
+}
+
+/*
+ * Check the numeric settings of a resolved policy
+ */
+static void
+validate_retry_policy(const RetryPolicy *policy)
+{
+    if (policy->max_tries < 1)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("pg_retry: max_tries must be >= 1")));
+
+    if (policy->base_delay_ms < 0 || policy->max_delay_ms < 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("pg_retry: delay parameters must be >= 0")));
+
+    if (policy->base_delay_ms > policy->max_delay_ms)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("pg_retry: base_delay_ms cannot be greater than max_delay_ms")));
+
+    if (policy->deadline_ms < 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("pg_retry: deadline_ms must be >= 0")));
+}
+
+/*
+ * Resolve a policy from the GUC defaults alone
+ */
+static void
+default_retry_policy(RetryPolicy *policy)
+{
+    policy->max_tries = pg_retry_default_max_tries;
+    policy->base_delay_ms = pg_retry_default_base_delay_ms;
+    policy->max_delay_ms = pg_retry_default_max_delay_ms;
+    policy->retry_sqlstates = copy_default_sqlstate_set();
+    policy->strategy = (BackoffStrategy) pg_retry_default_backoff_strategy;
+    policy->deadline_ms = pg_retry_default_deadline_ms;
+    policy->sqlstate_policy = NULL;
+
+    validate_retry_policy(policy);
+
+    policy->deadline = policy->deadline_ms > 0 ?
+        TimestampTzPlusMilliseconds(GetCurrentTimestamp(), policy->deadline_ms) : 0;
+}
+
+/*
+ * Release what parse_retry_policy() allocated
+ */
+static void
+free_retry_policy(RetryPolicy *policy)
+{
+    pfree(policy->retry_sqlstates);
+    if (policy->sqlstate_policy != NULL)
+        pfree(policy->sqlstate_policy);
+}
+
+/*
+ * Wrap bind values in the ParamListInfo that SPI_execute_plan_extended()
+ * takes, following the nulls conventions of SPI_execute_plan()
+ */
+static ParamListInfo
+build_param_list(int nargs, Oid *argtypes, Datum *values, const char *nulls)
+{
+    ParamListInfo paramLI;
+    int i;
+
+    if (nargs <= 0)
+        return NULL;
+
+    paramLI = makeParamList(nargs);
+    for (i = 0; i < nargs; i++)
+    {
+        ParamExternData *prm = &paramLI->params[i];
+
+        prm->value = values[i];
+        prm->isnull = (nulls && nulls[i] == 'n');
+        prm->pflags = PARAM_FLAG_CONST;
+        prm->ptype = argtypes[i];
+    }
+
+    return paramLI;
+}
+
+static void
+retry_receiver_startup(DestReceiver *self, int operation, TupleDesc typeinfo)
+{
+    RetryReceiver *receiver = (RetryReceiver *) self;
+    TupleDesc expected = receiver->expected;
+    int i;
+
+    if (expected == NULL)
+        return;
+
+    if (typeinfo->natts != expected->natts)
+        ereport(ERROR,
+                (errcode(ERRCODE_DATATYPE_MISMATCH),
+                 errmsg("pg_retry: structure of query does not match the column definition list"),
+                 errdetail("Query returns %d columns, but %d are expected.",
+                           typeinfo->natts, expected->natts)));
+
+    for (i = 0; i < expected->natts; i++)
+    {
+        Oid returned = TupleDescAttr(typeinfo, i)->atttypid;
+        Oid wanted = TupleDescAttr(expected, i)->atttypid;
+
+        if (returned != wanted)
+            ereport(ERROR,
+                    (errcode(ERRCODE_DATATYPE_MISMATCH),
+                     errmsg("pg_retry: structure of query does not match the column definition list"),
+                     errdetail("Returned type %s does not match expected type %s in column %d.",
+                               format_type_be(returned), format_type_be(wanted), i + 1)));
+    }
+}
+
+static bool
+retry_receiver_receive(TupleTableSlot *slot, DestReceiver *self)
+{
+    RetryReceiver *receiver = (RetryReceiver *) self;
+    ResourceOwner oldowner = CurrentResourceOwner;
+    MemoryContext oldcontext = MemoryContextSwitchTo(receiver->context);
+
+    CurrentResourceOwner = receiver->owner;
+    tuplestore_puttupleslot(receiver->tstore, slot);
+    CurrentResourceOwner = oldowner;
+    MemoryContextSwitchTo(oldcontext);
+
+    return true;
+}
+
+static void
+retry_receiver_shutdown(DestReceiver *self)
+{
+}
+
+static void
+retry_receiver_destroy(DestReceiver *self)
+{
+    pfree(self);
+}
+
+/*
+ * Create a receiver that stores rows in tstore, checking them against
+ * expected when that is not NULL
+ */
+static RetryReceiver *
+retry_receiver_create(Tuplestorestate *tstore, TupleDesc expected)
+{
+    RetryReceiver *receiver = palloc0(sizeof(RetryReceiver));
+
+    receiver->pub.receiveSlot = retry_receiver_receive;
+    receiver->pub.rStartup = retry_receiver_startup;
+    receiver->pub.rShutdown = retry_receiver_shutdown;
+    receiver->pub.rDestroy = retry_receiver_destroy;
+    receiver->pub.mydest = DestTuplestore;
+    receiver->tstore = tstore;
+    receiver->expected = expected;
+    receiver->owner = CurrentResourceOwner;
+    receiver->context = CurrentMemoryContext;
+
+    return receiver;
+}
+
+/*
+ * Drop whatever a failed attempt managed to store
+ */
+static void
+retry_receiver_reset(RetryReceiver *receiver)
+{
+    ResourceOwner oldowner = CurrentResourceOwner;
+
+    CurrentResourceOwner = receiver->owner;
+    tuplestore_clear(receiver->tstore);
+    CurrentResourceOwner = oldowner;
+}
+
+/*
+ * Execute a plan sending its rows to receiver, or discarding them when
+ * receiver is NULL. Either way no SPI_tuptable is built, so memory stays
+ * flat however many rows a SELECT or RETURNING produces; SPI_processed is
+ * still set from the executor's row count.
+ */
+static int
+execute_plan_to_receiver(SPIPlanPtr plan, ParamListInfo paramLI, bool read_only,
+                         RetryReceiver *receiver)
+{
+    SPIExecuteOptions options;
+
+    memset(&options, 0, sizeof(options));
+    options.params = paramLI;
+    options.read_only = read_only;
+    options.must_return_tuples = receiver != NULL;
+    options.dest = receiver != NULL ? &receiver->pub : None_Receiver;
+
+    return SPI_execute_plan_extended(plan, &options);
+}
+
+/*
+ * Start a retried call: count it, earn its retry budget and look up the
+ * shared state of its fingerprint. Fairness tickets are keyed by text_key,
+ * the hash of the statement text, since the fingerprint changes once the
+ * statement is prepared and only some backends have it prepared already.
+ */
+static RetryCall *
+retry_call_begin(const RetryPolicy *policy, uint64 fingerprint, uint64 text_key, const char *sql)
+{
+    RetryCall *rc = palloc0(sizeof(RetryCall));
+
+    rc->policy = policy;
+    rc->max_attempts = retry_policy_max_attempts(policy);
+    rc->track = stats_enabled();
+    if (rc->track)
+    {
+        stats_mark_pending();
+        retry_pending.calls++;
+    }
+    retry_budget_deposit();
+    /* Failures stopped? Then the last summary is due here, not on the next one */
+    log_summary_flush(false);
+
+    rc->fingerprint = fingerprint;
+    rc->fairness_key = text_key;
+    rc->stats = statement_call_begin(fingerprint, sql);
+    rc->contention = contention_slot(fingerprint);
+
+    return rc;
+}
+
+/*
+ * Switch to the real fingerprint once the statement has been prepared
+ */
+static void
+retry_call_set_fingerprint(RetryCall *rc, uint64 fingerprint)
+{
+    rc->fingerprint = fingerprint;
+    if (rc->stats)
+        rc->stats->queryid = fingerprint;
+    rc->contention = contention_slot(fingerprint);
+}
+
+/*
+ * Set up attempt rc->attempt. Runs inside the attempt's subtransaction, if
+ * there is one, so the settings made here end with it.
+ */
+static void
+retry_attempt_begin(RetryCall *rc)
+{
+    if (rc->track)
+        retry_pending.attempts++;
+    if (rc->stats)
+        INSTR_TIME_SET_CURRENT(rc->stats->attempt_start);
+    rc->attempt_done = false;
+
+    /* Late attempts go ahead of fresh calls on the same statement */
+    if (fairness_enabled())
+    {
+        if (rc->attempt > pg_retry_fairness_after_attempts)
+            rc->ticket_held = fairness_take_ticket(rc->fairness_key);
+        else if (rc->attempt == 1)
+            fairness_yield(rc->fairness_key);
+    }
+
+    /* Spend the backoff of the last lock conflict queued on the lock */
+    rc->lock_wait_bounded = false;
+    if (rc->lock_wait_ms > 0)
+    {
+        bound_lock_wait(rc->lock_wait_ms);
+        rc->lock_wait_bounded = true;
+    }
+
+    /* Cut the attempt off when the call's time budget runs out */
+    if (rc->policy->deadline != 0)
+        rc->deadline_armed = deadline_arm(rc->policy->deadline, &rc->outer_timeout_fin);
+}
+
+/*
+ * The attempt's statement stopped running, successfully or with an error
+ */
+static void
+retry_attempt_end(RetryCall *rc)
+{
+    if (rc->deadline_armed)
+    {
+        deadline_disarm(rc->outer_timeout_fin);
+        rc->deadline_armed = false;
+    }
+
+    if (rc->ticket_held)
+    {
+        fairness_release_ticket();
+        rc->ticket_held = false;
+    }
+}
+
+/*
+ * The attempt succeeded
+ */
+static void
+retry_attempt_succeeded(RetryCall *rc)
+{
+    if (rc->stats)
+        statement_call_attempt_done(rc->stats);
+    rc->attempt_done = true;
+    if (rc->contention)
+        contention_record(rc->contention, false);
+}
+
+/*
+ * Note the failure of a call's only attempt on the way to rethrowing its
+ * error. There was no subtransaction, so the transaction has not been rolled
+ * back yet and may hold LWLocks: nothing here takes a lock or reports
+ * anything, and retry_deferred_failures_flush() does the rest.
+ */
+static void
+retry_single_attempt_failed(RetryCall *rc, ErrorData *errdata)
+{
+    const SqlStateRule *rule = sqlstate_policy_rule(rc->policy, errdata->sqlerrcode);
+    bool retryable = errdata->sqlerrcode != 0 &&
+        (rule != NULL || is_retryable_sqlstate(errdata->sqlerrcode, rc->policy->retry_sqlstates));
+    DeferredFailure *failure;
+    MemoryContext oldcontext;
+
+    if (rc->stats)
+    {
+        if (!rc->attempt_done)
+            statement_call_attempt_done(rc->stats);
+        statement_call_failure(rc->stats, errdata->sqlerrcode, retryable);
+        if (retryable)
+            rc->stats->exhausted++;
+    }
+    /* The contention slot is updated lock-free */
+    if (rc->contention && retryable)
+        contention_record(rc->contention, true);
+
+    oldcontext = MemoryContextSwitchTo(TopMemoryContext);
+    failure = palloc(sizeof(DeferredFailure));
+    failure->fingerprint = rc->fingerprint;
+    failure->sqlerrcode = errdata->sqlerrcode;
+    failure->retryable = retryable;
+    failure->track = rc->track;
+    failure->stats = NULL;
+    if (rc->stats)
+    {
+        failure->stats = pmemdup(rc->stats, sizeof(StatementCallStats));
+        failure->stats->sql = pstrdup(rc->stats->sql);
+    }
+    retry_deferred_failures = lappend(retry_deferred_failures, failure);
+    MemoryContextSwitchTo(oldcontext);
+}
+
+/*
+ * Record the failures retry_single_attempt_failed() put off, once the
+ * transaction has committed or rolled back
+ */
+static void
+retry_deferred_failures_flush(void)
+{
+    ListCell *lc;
+
+    foreach(lc, retry_deferred_failures)
+    {
+        DeferredFailure *failure = (DeferredFailure *) lfirst(lc);
+        bool probe;
+
+        if (failure->track)
+        {
+            if (failure->retryable)
+                stats_count_sqlstate(failure->sqlerrcode, true);
+            else
+                retry_pending.non_retryable++;
+        }
+        if (failure->retryable)
+            (void) breaker_on_failure(failure->fingerprint, true, &probe);
+        if (failure->stats)
+        {
+            statement_call_store(failure->stats);
+            pfree((char *) failure->stats->sql);
+            pfree(failure->stats);
+        }
+    }
+
+    list_free_deep(retry_deferred_failures);
+    retry_deferred_failures = NIL;
+}
+
+/*
+ * Decide what follows a failed attempt, once its subtransaction has been
+ * rolled back. Returns false when the call gives up and errdata must be
+ * rethrown; otherwise *delay_ms is the backoff to sleep before the next
+ * attempt, 0 to go ahead right away.
+ */
+static bool
+retry_attempt_failed(RetryCall *rc, ErrorData *errdata, long *delay_ms)
+{
+    const RetryPolicy *policy = rc->policy;
+    int attempt = rc->attempt;
+    const SqlStateRule *rule = sqlstate_policy_rule(policy, errdata->sqlerrcode);
+    int max_tries = rule != NULL && rule->max_tries >= 0 ? rule->max_tries : policy->max_tries;
+    bool should_retry = false;
+    bool breaker_open = false;
+    bool deadline_hit = false;
+    bool budget_denied = false;
+    bool stale_snapshot = false;
+
+    if (rc->stats && !rc->attempt_done)
+        statement_call_attempt_done(rc->stats);
+
+    /*
+     * Check if this is a retryable error. A lock timeout we imposed
+     * ourselves only means the blocker outlived the backoff, and a code with
+     * its own sqlstate_policy rule is retryable by that rule.
+     */
+    if (errdata->sqlerrcode != 0 &&
+        (rule != NULL || is_retryable_sqlstate(errdata->sqlerrcode, policy->retry_sqlstates) ||
+         (rc->lock_wait_bounded && errdata->sqlerrcode == ERRCODE_LOCK_NOT_AVAILABLE &&
+          is_lock_wait_failure(errdata))))
+    {
+        should_retry = true;
+
+        log_retry_failure(errdata, attempt, max_tries);
+    }
+
+    if (should_retry)
+    {
+        bool last = attempt >= max_tries;
+        bool probe = false;
+
+        /*
+         * Under REPEATABLE READ and SERIALIZABLE every attempt reads the same
+         * transaction snapshot, so a serialization failure would only repeat
+         */
+        if (!last && pg_retry_snapshot_fail_fast &&
+            errdata->sqlerrcode == ERRCODE_T_R_SERIALIZATION_FAILURE &&
+            IsolationUsesXactSnapshot())
+        {
+            stale_snapshot = true;
+
+            /* The call gives up here, so this was its last failure */
+            breaker_on_failure(rc->fingerprint, true, &probe);
+            if (retry_log_enabled())
+                ereport(retry_log_elevel(),
+                        (errmsg("pg_retry: serialization failure under %s, giving up after attempt %d/%d",
+                                IsolationIsSerializable() ? "SERIALIZABLE" : "REPEATABLE READ",
+                                attempt, max_tries),
+                         errhint("See pg_retry.snapshot_fail_fast.")));
+        }
+        /* An open circuit breaker leaves the call its single attempt */
+        else if (!breaker_on_failure(rc->fingerprint, last, &probe) && !last)
+        {
+            breaker_open = true;
+            if (retry_log_enabled())
+                ereport(retry_log_elevel(),
+                        (errmsg("pg_retry: circuit breaker is open for this statement, giving up after attempt %d/%d",
+                                attempt, max_tries),
+                         errhint("See pg_retry.breaker_threshold and pg_retry.breaker_cooldown_ms.")));
+        }
+        /* The deadline bounds the whole call, attempts and sleeps alike */
+        else if (!last && policy->deadline != 0 &&
+                 deadline_remaining_ms(policy->deadline) == 0)
+        {
+            deadline_hit = true;
+            if (retry_log_enabled())
+                ereport(retry_log_elevel(),
+                        (errmsg("pg_retry: deadline of %d ms reached, giving up after attempt %d/%d",
+                                policy->deadline_ms, attempt, max_tries)));
+        }
+        /* Under a retry storm fail fast rather than add to the load */
+        else if (!last && !retry_budget_withdraw())
+        {
+            budget_denied = true;
+            if (retry_log_enabled())
+                ereport(retry_log_elevel(),
+                        (errmsg("pg_retry: retry budget exhausted, giving up after attempt %d/%d",
+                                attempt, max_tries),
+                         errhint("See pg_retry.retry_budget_ratio and pg_retry.retry_budget_burst.")));
+        }
+        rc->breaker_probe = probe;
+    }
+
+    if (rc->track)
+    {
+        if (should_retry)
+            stats_count_sqlstate(errdata->sqlerrcode,
+                                 breaker_open || deadline_hit || budget_denied ||
+                                 stale_snapshot || attempt >= max_tries);
+        else
+            retry_pending.non_retryable++;
+        if (budget_denied)
+            retry_pending.budget_denied++;
+    }
+    if (rc->stats)
+        statement_call_failure(rc->stats, errdata->sqlerrcode, should_retry);
+    if (rc->contention && should_retry)
+        contention_record(rc->contention, true);
+
+    if (!should_retry || breaker_open || deadline_hit || budget_denied ||
+        stale_snapshot || attempt >= max_tries)
+    {
+        /* The error itself says why it came back before max_tries */
+        if (stale_snapshot)
+        {
+            MemoryContext oldcontext = MemoryContextSwitchTo(GetMemoryChunkContext(errdata));
+
+            if (errdata->hint)
+                pfree(errdata->hint);
+            errdata->hint = pstrdup("The transaction snapshot of a REPEATABLE READ or SERIALIZABLE "
+                                    "transaction never changes, so pg_retry does not retry inside it; "
+                                    "retry the whole transaction instead.");
+            MemoryContextSwitchTo(oldcontext);
+        }
+
+        /* Not retryable, cut short or exhausted attempts */
+        if (rc->stats)
+        {
+            if (should_retry)
+                rc->stats->exhausted++;
+            statement_call_store(rc->stats);
+        }
+        return false;
+    }
+
+    /* Retry after delay, slept outside the error handler */
+    if (rule != NULL)
+    {
+        RetryPolicy schedule = *policy;
+
+        /* The rule's backoff settings replace the policy's for this code */
+        if (rule->base_delay_ms >= 0)
+            schedule.base_delay_ms = rule->base_delay_ms;
+        if (rule->max_delay_ms >= 0)
+            schedule.max_delay_ms = rule->max_delay_ms;
+        if (rule->strategy >= 0)
+            schedule.strategy = (BackoffStrategy) rule->strategy;
+        schedule.base_delay_ms = Min(schedule.base_delay_ms, schedule.max_delay_ms);
+        *delay_ms = calculate_delay(&schedule, attempt, &rc->prev_delay_ms);
+        if (rc->contention)
+            *delay_ms = contention_adjust_delay(rc->contention, *delay_ms, schedule.max_delay_ms);
+    }
+    else
+    {
+        *delay_ms = calculate_delay(policy, attempt, &rc->prev_delay_ms);
+        if (rc->contention)
+            *delay_ms = contention_adjust_delay(rc->contention, *delay_ms, policy->max_delay_ms);
+    }
+    /* Never sleep past the deadline */
+    if (policy->deadline != 0)
+        *delay_ms = Min(*delay_ms, deadline_remaining_ms(policy->deadline));
+
+    /* A NOWAIT failure would not wait on the lock, so it keeps its sleep */
+    rc->lock_wait_ms = 0;
+    if (pg_retry_wait_for_locks && is_lock_wait_failure(errdata))
+    {
+        rc->lock_wait_ms = *delay_ms;
+        *delay_ms = 0;
+    }
+
+    return true;
+}
+
+/*
+ * Sleep between two attempts, letting adaptive backoff know we do
+ */
+static void
+retry_backoff(RetryCall *rc, long delay_ms)
+{
+    RetryContentionSlot *contention = rc->contention;
+    instr_time timing;
+
+    if (delay_ms <= 0)
+        return;
+
+    timing_start(&timing);
+
+    if (contention)
+    {
+        pg_atomic_fetch_add_u32(&contention->sleepers, 1);
+        PG_ENSURE_ERROR_CLEANUP(contention_sleep_cleanup, PointerGetDatum(contention));
+        {
+            backoff_sleep(delay_ms);
+        }
+        PG_END_ENSURE_ERROR_CLEANUP(contention_sleep_cleanup, PointerGetDatum(contention));
+        contention_sleep_cleanup(0, PointerGetDatum(contention));
+    }
+    else
+        backoff_sleep(delay_ms);
+    timing_end(RETRY_PHASE_BACKOFF, &timing);
+
+    if (rc->track)
+        retry_pending.sleep_us += delay_ms * 1000L;
+    if (rc->stats)
+        statement_call_backoff(rc->stats, delay_ms);
+}
+
+/*
+ * Finish a call whose last attempt succeeded
+ */
+static void
+retry_call_succeeded(RetryCall *rc)
+{
+    if (rc->breaker_probe)
+        breaker_on_probe_success(rc->fingerprint);
+
+    if (rc->track)
+        retry_pending.successes++;
+
+    if (rc->stats)
+    {
+        rc->stats->successes++;
+        statement_call_store(rc->stats);
+    }
+}
+
+/*
+ * execute_plan_to_receiver() timed as the execute phase, whether it returns
+ * or throws: failed executions are what the phase histogram is there to show
+ */
+static int
+execute_plan_timed(SPIPlanPtr plan, ParamListInfo paramLI, bool read_only,
+                   RetryReceiver *receiver)
+{
+    int spi_result;
+    instr_time timing;
+
+    timing_start(&timing);
+    PG_TRY();
+    {
+        spi_result = execute_plan_to_receiver(plan, paramLI, read_only, receiver);
+    }
+    PG_CATCH();
+    {
+        timing_end(RETRY_PHASE_EXECUTE, &timing);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    timing_end(RETRY_PHASE_EXECUTE, &timing);
+
+    return spi_result;
+}
+
+/*
+ * Run an attempt's statement; the caller handles errors and owns the
+ * subtransaction. On the plan cache path the statement is prepared on its
+ * first attempt (inside the subtransaction, so lock timeouts during parse
+ * analysis are retried like any other failure) and *plan_entry keeps the
+ * saved plan for every later attempt and call, pinned for the call at
+ * subtransaction level nestlevel; rc, when not NULL, takes over the plan's
+ * fingerprint. Off the plan cache, local_plan, when not NULL, keeps a saved
+ * plan of the caller's own across attempts, which the caller frees with
+ * SPI_freeplan(); otherwise every attempt prepares a throwaway plan.
+ * Read-only statements run with read_only =
+ * true on a snapshot taken for this attempt, so a retry in READ COMMITTED
+ * sees the data committed since the failure; everything else passes false
+ * as the statement can modify data. Returns the SPI result code.
+ */
+static int
+execute_statement_attempt(const char *sql, int nargs, Oid *argtypes, ParamListInfo paramLI,
+                          bool use_plan_cache, uint64 plan_key,
+                          PlanCacheEntry *volatile *plan_entry, SPIPlanPtr volatile *local_plan,
+                          int nestlevel, RetryCall *rc, RetryReceiver *receiver)
+{
+    int spi_result;
+    bool read_only;
+    instr_time timing;
+
+    if (use_plan_cache)
+    {
+        if (*plan_entry == NULL)
+        {
+            SPIPlanPtr plan;
+
+            timing_start(&timing);
+            plan = SPI_prepare(sql, nargs, argtypes);
+
+            if (plan == NULL)
+                ereport(ERROR,
+                        (errcode(ERRCODE_INTERNAL_ERROR),
+                         errmsg("pg_retry: SPI_prepare failed: %s",
+                                SPI_result_code_string(SPI_result))));
+            if (SPI_keepplan(plan) != 0)
+                ereport(ERROR,
+                        (errcode(ERRCODE_INTERNAL_ERROR),
+                         errmsg("pg_retry: SPI_keepplan failed")));
+
+            *plan_entry = plan_cache_insert(sql, nargs, argtypes, plan_key, plan,
+                                            plan_fingerprint(plan, plan_key), nestlevel);
+            if (rc != NULL)
+                retry_call_set_fingerprint(rc, (*plan_entry)->queryid);
+            timing_end(RETRY_PHASE_PREPARE, &timing);
+        }
+
+        read_only = plan_entry_read_only(*plan_entry);
+        if (read_only)
+            PushActiveSnapshot(GetTransactionSnapshot());
+        spi_result = execute_plan_timed((*plan_entry)->plan, paramLI, read_only, receiver);
+        if (read_only)
+            PopActiveSnapshot();
+    }
+    else if (local_plan != NULL)
+    {
+        /* Plan cache not used: prepare once for all of the caller's attempts */
+        if (*local_plan == NULL)
+        {
+            SPIPlanPtr plan;
+
+            timing_start(&timing);
+            plan = SPI_prepare(sql, nargs, argtypes);
+
+            if (plan == NULL)
+                ereport(ERROR,
+                        (errcode(ERRCODE_INTERNAL_ERROR),
+                         errmsg("pg_retry: SPI_prepare failed: %s",
+                                SPI_result_code_string(SPI_result))));
+            if (SPI_keepplan(plan) != 0)
+                ereport(ERROR,
+                        (errcode(ERRCODE_INTERNAL_ERROR),
+                         errmsg("pg_retry: SPI_keepplan failed")));
+            *local_plan = plan;
+            timing_end(RETRY_PHASE_PREPARE, &timing);
+        }
+
+        spi_result = execute_plan_timed(*local_plan, paramLI, false, receiver);
+    }
+    else
+    {
+        /* Plan cache disabled: use a throwaway plan */
+        SPIPlanPtr plan;
+
+        timing_start(&timing);
+        plan = SPI_prepare(sql, nargs, argtypes);
+
+        if (plan == NULL)
+            ereport(ERROR,
+                    (errcode(ERRCODE_INTERNAL_ERROR),
+                     errmsg("pg_retry: SPI_prepare failed: %s",
+                            SPI_result_code_string(SPI_result))));
+        timing_end(RETRY_PHASE_PREPARE, &timing);
+
+        spi_result = execute_plan_timed(plan, paramLI, false, receiver);
+        SPI_freeplan(plan);
+    }
+
+    return spi_result;
+}
+
+/*
+ * Run one statement with retry logic and return the number of rows processed.
+ * Each attempt runs inside its own subtransaction so we can roll back safely,
+ * then we retry on configured SQLSTATEs using exponential backoff + jitter.
+ *
+ * nargs/argtypes/values/nulls describe the bind values for $1..$n, with the
+ * same conventions as SPI_execute_with_args(). The caller must be connected
+ * to SPI. Unless validated says the caller already ran validate_sql() on the
+ * text, or the plan cache holds it, the text is validated before the first
+ * attempt, so a rejected statement is neither analyzed nor counted as a
+ * failed call; the number of attempts used is returned in *attempts if not NULL. Rows of
+ * the successful attempt go to receiver, or are only counted when it is NULL.
+ */
+static int
+retry_statement(const char *sql, int nargs, Oid *argtypes, Datum *values,
+                const char *nulls, RetryPolicy *policy, bool validated, int *attempts,
+                RetryReceiver *receiver)
+{
+    int spi_result;
+    volatile int processed_rows = 0;
+    volatile bool success = false;
+    MemoryContext caller_context = CurrentMemoryContext;
+    MemoryContext call_context;
+    MemoryContext retry_context;
+    MemoryContext error_context;
+    ResourceOwner retry_owner = CurrentResourceOwner;
+    bool use_plan_cache = pg_retry_plan_cache_enabled;
+    bool plan_collision = false;
+    uint64 plan_key = 0;
+    PlanCacheEntry *volatile plan_entry = NULL;
+    RetryCall *rc;
+    /* With a single attempt there is nothing to recover for, so no subxact */
+    bool use_subxact = retry_policy_max_attempts(policy) > 1;
+    ParamListInfo paramLI = NULL;
+    int nestlevel = GetCurrentTransactionNestLevel();
+
+    /*
+     * Everything this call allocates lives in call_context, so a batch or a
+     * long retry loop does not grow the caller's (SPI procedure) context.
+     * Attempt-local garbage goes to retry_context, which is reset after
+     * every attempt, and the copy of each caught error to the small
+     * error_context, reset once the error has been handled.
+     */
+    call_context = AllocSetContextCreate(caller_context,
+                                         "pg_retry call",
+                                         ALLOCSET_DEFAULT_SIZES);
+    retry_context = AllocSetContextCreate(call_context,
+                                          "pg_retry attempt",
+                                          ALLOCSET_DEFAULT_SIZES);
+    error_context = AllocSetContextCreate(call_context,
+                                          "pg_retry error",
+                                          ALLOCSET_SMALL_SIZES);
+    MemoryContextSwitchTo(call_context);
+
+    plan_key = plan_cache_hash(sql, nargs, argtypes);
+    if (use_plan_cache)
+    {
+        plan_entry = plan_cache_lookup(sql, nargs, argtypes, plan_key, nestlevel,
+                                       &plan_collision);
+        if (plan_collision)
+            use_plan_cache = false;
+    }
+
+    /* A cached plan was validated when it was first prepared */
+    if (!validated && plan_entry == NULL)
+        validate_sql_cached(sql);
+
+    /* Until the statement is prepared its text hash stands in as fingerprint */
+    rc = retry_call_begin(policy, plan_entry ? plan_entry->queryid : plan_key, plan_key, sql);
+
+    paramLI = build_param_list(nargs, argtypes, values, nulls);
+
+    /* Retry loop */
+    for (rc->attempt = 1; rc->attempt <= rc->max_attempts; rc->attempt++)
+    {
+        long delay_ms = 0;
+
+        MemoryContextSwitchTo(retry_context);
+        PG_TRY();
+        {
+            instr_time timing;
+
+            /* Run each attempt inside its own subtransaction */
+            if (use_subxact)
+            {
+                timing_start(&timing);
+                retry_subxact_begin();
+                MemoryContextSwitchTo(retry_context);
+                timing_end(RETRY_PHASE_SUBXACT_BEGIN, &timing);
+            }
+            retry_attempt_begin(rc);
+
+            spi_result = execute_statement_attempt(sql, nargs, argtypes, paramLI, use_plan_cache,
+                                                   plan_key, &plan_entry, NULL, nestlevel, rc,
+                                                   receiver);
+            retry_attempt_end(rc);
+
+            if (spi_result < 0)
+            {
+                /* SPI error */
+                ereport(ERROR,
+                        (errcode(ERRCODE_INTERNAL_ERROR),
+                         errmsg("pg_retry: SPI_execute failed with code %d", spi_result)));
+            }
+
+            processed_rows = SPI_processed; // global variable set by SPI_execute
+            success = true; // set to true if the statement executed successfully
+            retry_attempt_succeeded(rc);
+
+            if (use_subxact)
+            {
+                timing_start(&timing);
+                retry_subxact_release();
+                SPI_restore_connection(); // ensure SPI is reconnected for the parent
+                MemoryContextSwitchTo(retry_context);
+                CurrentResourceOwner = retry_owner; // restore the resource owner
+                timing_end(RETRY_PHASE_SUBXACT_RELEASE, &timing);
+            }
+        }
+        PG_CATCH();
+        {
+            ErrorData *errdata;
+            instr_time timing;
+
+            MemoryContextSwitchTo(error_context);
+
+            /*
+             * Without a subtransaction there is nothing to roll back to, and
+             * the transaction may still hold LWLocks: note the failure where
+             * it stays backend-local and rethrow the error as it is, leaving
+             * the cleanup to the enclosing transaction's abort.
+             */
+            if (!use_subxact)
+            {
+                errdata = CopyErrorData();
+                retry_attempt_end(rc);
+                retry_single_attempt_failed(rc, errdata);
+                if (plan_entry != NULL)
+                    plan_cache_release(plan_entry);
+                PG_RE_THROW();
+            }
+
+            timing_start(&timing);
+            errdata = CopyErrorData();
+            FlushErrorState();
+            retry_attempt_end(rc);
+
+            RollbackAndReleaseCurrentSubTransaction(); // rollback the subtransaction and release the resources 
+            SPI_restore_connection(); // SPI needs reconnect after subtransaction cleanup
+            MemoryContextSwitchTo(retry_context);
+            CurrentResourceOwner = retry_owner;
+            timing_end(RETRY_PHASE_ERROR_ROLLBACK, &timing);
+
+            /* Rows of a failed attempt must not reach the caller */
+            if (receiver != NULL)
+                retry_receiver_reset(receiver);
+
+            /* Not retryable, cut short or exhausted attempts - rethrow immediately */
+            if (!retry_attempt_failed(rc, errdata, &delay_ms))
+            {
+                if (plan_entry != NULL)
+                    plan_cache_release(plan_entry);
+                ReThrowError(errdata);
+            }
+
+            MemoryContextReset(error_context);
+        }
+        PG_END_TRY();
+
+        if (success)
+            break;
+
+        MemoryContextReset(retry_context);
+        retry_backoff(rc, delay_ms);
+    }
+
+    if (plan_entry != NULL)
+        plan_cache_release(plan_entry);
+
+    if (success)
+        retry_call_succeeded(rc);
+
+    if (attempts != NULL)
+        *attempts = rc->attempt;
+
+    MemoryContextSwitchTo(caller_context);
+    MemoryContextDelete(call_context);
+
+    if (!success)
+    {
+        /* Should not reach here - errors should be rethrown in PG_CATCH */
+        ereport(ERROR,
+                (errcode(ERRCODE_INTERNAL_ERROR),
+                 errmsg("pg_retry: unexpected error state")));
+    }
+
+    return processed_rows;
+}
+
+/*
+ * Unpin the cached plans of a batch's statements and free the plans it kept
+ * itself for the statements off the plan cache
+ */
+static void
+retry_batch_release_plans(PlanCacheEntry **plan_entries, SPIPlanPtr *local_plans,
+                          int nstatements)
+{
+    int i;
+
+    for (i = 0; i < nstatements; i++)
+    {
+        if (plan_entries[i] != NULL)
+            plan_cache_release(plan_entries[i]);
+        if (local_plans[i] != NULL)
+            SPI_freeplan(local_plans[i]);
+    }
+}
+
+/*
+ * Run the statements of an idempotent batch or of retry_xact() with retry,
+ * sharing one subtransaction per attempt instead of taking one per
+ * statement: a failure rolls back the whole batch, and the next attempt runs
+ * it again from the first statement. The batch counts as a single call for
+ * the statistics, retry budget and circuit breakers. Statements must have
+ * been validated. The rows processed by each statement go to processed[];
+ * returns the number of attempts used.
+ */
+static int
+retry_batch_shared_subxact(char **sqls, int nstatements, RetryPolicy *policy, int *processed)
+{
+    volatile bool success = false;
+    MemoryContext caller_context = CurrentMemoryContext;
+    MemoryContext call_context;
+    MemoryContext retry_context;
+    MemoryContext error_context;
+    ResourceOwner retry_owner = CurrentResourceOwner;
+    PlanCacheEntry **plan_entries;
+    SPIPlanPtr *local_plans;
+    bool *use_plan_cache;
+    uint64 *plan_keys;
+    uint64 fingerprint = 0;
+    StringInfoData label;
+    RetryCall *rc;
+    int nestlevel = GetCurrentTransactionNestLevel();
+    int attempts;
+    int i;
+
+    call_context = AllocSetContextCreate(caller_context,
+                                         "pg_retry call",
+                                         ALLOCSET_DEFAULT_SIZES);
+    retry_context = AllocSetContextCreate(call_context,
+                                          "pg_retry attempt",
+                                          ALLOCSET_DEFAULT_SIZES);
+    error_context = AllocSetContextCreate(call_context,
+                                          "pg_retry error",
+                                          ALLOCSET_SMALL_SIZES);
+    MemoryContextSwitchTo(call_context);
+
+    plan_entries = palloc0(Max(nstatements, 1) * sizeof(PlanCacheEntry *));
+    local_plans = palloc0(Max(nstatements, 1) * sizeof(SPIPlanPtr));
+    use_plan_cache = palloc(Max(nstatements, 1) * sizeof(bool));
+    plan_keys = palloc(Max(nstatements, 1) * sizeof(uint64));
+    initStringInfo(&label);
+    for (i = 0; i < nstatements; i++)
+    {
+        bool collision = false;
+
+        plan_keys[i] = plan_cache_hash(sqls[i], 0, NULL);
+        use_plan_cache[i] = pg_retry_plan_cache_enabled;
+        if (use_plan_cache[i])
+        {
+            plan_entries[i] = plan_cache_lookup(sqls[i], 0, NULL, plan_keys[i], nestlevel,
+                                                &collision);
+            if (collision)
+                use_plan_cache[i] = false;
+        }
+
+        /* The batch is fingerprinted by its texts and shown as all of them */
+        fingerprint = hash_combine64(fingerprint, plan_keys[i]);
+        appendStringInfo(&label, "%s%s", i > 0 ? "; " : "", sqls[i]);
+    }
+
+    rc = retry_call_begin(policy, fingerprint, fingerprint, label.data);
+
+    for (rc->attempt = 1; rc->attempt <= rc->max_attempts; rc->attempt++)
+    {
+        long delay_ms = 0;
+
+        MemoryContextSwitchTo(retry_context);
+        PG_TRY();
+        {
+            instr_time timing;
+
+            timing_start(&timing);
+            retry_subxact_begin();
+            MemoryContextSwitchTo(retry_context);
+            timing_end(RETRY_PHASE_SUBXACT_BEGIN, &timing);
+            retry_attempt_begin(rc);
+
+            for (i = 0; i < nstatements; i++)
+            {
+                int spi_result;
+
+                /* An earlier statement of the batch may have cached the same text */
+                if (use_plan_cache[i] && plan_entries[i] == NULL)
+                {
+                    bool collision = false;
+
+                    plan_entries[i] = plan_cache_lookup(sqls[i], 0, NULL, plan_keys[i],
+                                                        nestlevel, &collision);
+                    if (collision)
+                        use_plan_cache[i] = false;
+                }
+
+                spi_result = execute_statement_attempt(sqls[i], 0, NULL, NULL, use_plan_cache[i],
+                                                       plan_keys[i], &plan_entries[i], &local_plans[i],
+                                                       nestlevel, NULL, NULL);
+                if (spi_result < 0)
+                    ereport(ERROR,
+                            (errcode(ERRCODE_INTERNAL_ERROR),
+                             errmsg("pg_retry: SPI_execute failed with code %d", spi_result)));
+                processed[i] = SPI_processed;
+            }
+            retry_attempt_end(rc);
+
+            success = true;
+            retry_attempt_succeeded(rc);
+
+            timing_start(&timing);
+            retry_subxact_release();
+            MemoryContextSwitchTo(retry_context);
+            CurrentResourceOwner = retry_owner;
+            timing_end(RETRY_PHASE_SUBXACT_RELEASE, &timing);
+        }
+        PG_CATCH();
+        {
+            ErrorData *errdata;
+            instr_time timing;
+
+            timing_start(&timing);
+            MemoryContextSwitchTo(error_context);
+            errdata = CopyErrorData();
+            FlushErrorState();
+            retry_attempt_end(rc);
+
+            RollbackAndReleaseCurrentSubTransaction();
+            MemoryContextSwitchTo(retry_context);
+            CurrentResourceOwner = retry_owner;
+            timing_end(RETRY_PHASE_ERROR_ROLLBACK, &timing);
+
+            if (!retry_attempt_failed(rc, errdata, &delay_ms))
+            {
+                /* The plans stay evictable whoever catches the error */
+                retry_batch_release_plans(plan_entries, local_plans, nstatements);
+                ReThrowError(errdata);
+            }
+
+            MemoryContextReset(error_context);
+        }
+        PG_END_TRY();
+
+        if (success)
+            break;
+
+        MemoryContextReset(retry_context);
+        retry_backoff(rc, delay_ms);
+    }
+
+    retry_batch_release_plans(plan_entries, local_plans, nstatements);
+
+    if (success)
+        retry_call_succeeded(rc);
+    attempts = rc->attempt;
+
+    MemoryContextSwitchTo(caller_context);
+    MemoryContextDelete(call_context);
+
+    if (!success)
+        ereport(ERROR,
+                (errcode(ERRCODE_INTERNAL_ERROR),
+                 errmsg("pg_retry: unexpected error state")));
+
+    return attempts;
+}
+
+/*
+ * Connect to SPI, run one statement with retry_statement() and disconnect
+ */
+static int
+execute_with_retry(const char *sql, int nargs, Oid *argtypes, Datum *values,
+                   const char *nulls, RetryPolicy *policy)
+{
+    int processed_rows;
+    instr_time timing;
+
+    /* Connect to SPI */
+    timing_start(&timing);
+    if (SPI_connect_ext(SPI_OPT_NONATOMIC) != SPI_OK_CONNECT)
+        ereport(ERROR,
+                (errcode(ERRCODE_CONNECTION_FAILURE),
+                 errmsg("pg_retry: SPI_connect failed")));
+    timing_end(RETRY_PHASE_SPI_CONNECT, &timing);
+
+    processed_rows = retry_statement(sql, nargs, argtypes, values, nulls, policy, false, NULL, NULL);
+
+    /* Disconnect from SPI */
+    SPI_finish();
+
+    return processed_rows;
+}
+
+/*
+ * Can pg_retry.auto rerun this statement? Only a data-modifying statement a
+ * client sent directly qualifies, and only when it returns no rows: rows
+ * already sent cannot be taken back, and the ModifyTable nodes of
+ * data-modifying CTEs would run again in the caller's ExecutorFinish().
+ */
+static bool
+auto_retry_eligible(QueryDesc *queryDesc)
+{
+    PlannedStmt *stmt = queryDesc->plannedstmt;
+    CommandDest dest = queryDesc->dest->mydest;
+
+    if (!pg_retry_auto || pg_retry_default_max_tries <= 1)
+        return false;
+
+    /* Statements run by functions, procedures and triggers go to SPI */
+    if (dest != DestRemote && dest != DestRemoteExecute)
+        return false;
+
+    if (queryDesc->operation != CMD_INSERT && queryDesc->operation != CMD_UPDATE &&
+        queryDesc->operation != CMD_DELETE && queryDesc->operation != CMD_MERGE)
+        return false;
+
+    return !stmt->hasReturning && !stmt->hasModifyingCTE &&
+        (queryDesc->estate->es_top_eflags & EXEC_FLAG_EXPLAIN_ONLY) == 0 &&
+        !IsInParallelMode();
+}
+
+/*
+ * Execute one attempt of a pg_retry.auto statement on a QueryDesc of its
+ * own, timed as the execute phase whether it returns or throws. Returns the
+ * number of rows processed.
+ */
+static uint64
+auto_retry_execute(QueryDesc *queryDesc, int attempt)
+{
+    QueryDesc *attempt_desc;
+    uint64 processed = 0;
+    instr_time timing;
+
+    timing_start(&timing);
+    PG_TRY();
+    {
+        /* A retry in READ COMMITTED sees what committed since the failure */
+        PushActiveSnapshot(attempt == 1 ? queryDesc->snapshot : GetTransactionSnapshot());
+        attempt_desc = CreateQueryDesc(queryDesc->plannedstmt, queryDesc->sourceText,
+                                       GetActiveSnapshot(), InvalidSnapshot,
+                                       queryDesc->dest, queryDesc->params,
+                                       queryDesc->queryEnv,
+                                       queryDesc->instrument_options);
+        standard_ExecutorStart(attempt_desc, 0);
+#if PG_VERSION_NUM >= 180000
+        standard_ExecutorRun(attempt_desc, ForwardScanDirection, 0);
+#else
+        standard_ExecutorRun(attempt_desc, ForwardScanDirection, 0, true);
+#endif
+        standard_ExecutorFinish(attempt_desc);
+
+        processed = attempt_desc->estate->es_processed;
+        standard_ExecutorEnd(attempt_desc);
+        FreeQueryDesc(attempt_desc);
+        PopActiveSnapshot();
+    }
+    PG_CATCH();
+    {
+        timing_end(RETRY_PHASE_EXECUTE, &timing);
+        PG_RE_THROW();
+    }
+    PG_END_TRY();
+    timing_end(RETRY_PHASE_EXECUTE, &timing);
+
+    return processed;
+}
+
+/*
+ * Run a statement for pg_retry.auto with the default policy. Each attempt
+ * executes the already planned statement afresh in its own subtransaction;
+ * the caller's QueryDesc is never run and only receives the row counts, so
+ * its ExecutorFinish() and ExecutorEnd() have nothing left to do. Attempts
+ * call the standard executor directly: the hooks of other extensions, such
+ * as pg_stat_statements, already run around the caller's QueryDesc and would
+ * otherwise see each attempt as another, nested, statement.
+ */
+static void
+auto_retry_run(QueryDesc *queryDesc)
+{
+    PlannedStmt *stmt = queryDesc->plannedstmt;
+    MemoryContext caller_context = CurrentMemoryContext;
+    MemoryContext call_context;
+    MemoryContext retry_context;
+    MemoryContext error_context;
+    ResourceOwner retry_owner = CurrentResourceOwner;
+    RetryPolicy policy;
+    RetryCall *rc;
+    const char *sql;
+    uint64 text_key;
+    volatile uint64 processed = 0;
+    volatile bool success = false;
+
+    call_context = AllocSetContextCreate(caller_context,
+                                         "pg_retry call",
+                                         ALLOCSET_DEFAULT_SIZES);
+    retry_context = AllocSetContextCreate(call_context,
+                                          "pg_retry attempt",
+                                          ALLOCSET_DEFAULT_SIZES);
+    error_context = AllocSetContextCreate(call_context,
+                                          "pg_retry error",
+                                          ALLOCSET_SMALL_SIZES);
+    MemoryContextSwitchTo(call_context);
+
+    default_retry_policy(&policy);
+
+    /* A multi-statement query string holds more than this statement */
+    sql = queryDesc->sourceText;
+    if (stmt->stmt_len > 0)
+        sql = pnstrdup(sql + stmt->stmt_location, stmt->stmt_len);
+
+    text_key = hash_bytes_extended((const unsigned char *) sql, strlen(sql), 0);
+    rc = retry_call_begin(&policy, stmt->queryId != 0 ? (uint64) stmt->queryId : text_key,
+                          text_key, sql);
+
+    /* What standard_ExecutorRun() would have timed for the caller's hooks */
+    if (queryDesc->totaltime)
+        InstrStartNode(queryDesc->totaltime);
+
+    for (rc->attempt = 1; rc->attempt <= rc->max_attempts; rc->attempt++)
+    {
+        long delay_ms = 0;
+
+        MemoryContextSwitchTo(retry_context);
+        PG_TRY();
+        {
+            instr_time timing;
+
+            timing_start(&timing);
+            retry_subxact_begin();
+            MemoryContextSwitchTo(retry_context);
+            timing_end(RETRY_PHASE_SUBXACT_BEGIN, &timing);
+            retry_attempt_begin(rc);
+
+            processed = auto_retry_execute(queryDesc, rc->attempt);
+            retry_attempt_end(rc);
+
+            success = true;
+            retry_attempt_succeeded(rc);
+
+            timing_start(&timing);
+            retry_subxact_release();
+            MemoryContextSwitchTo(retry_context);
+            CurrentResourceOwner = retry_owner;
+            timing_end(RETRY_PHASE_SUBXACT_RELEASE, &timing);
+        }
+        PG_CATCH();
+        {
+            ErrorData *errdata;
+            instr_time timing;
+
+            timing_start(&timing);
+            MemoryContextSwitchTo(error_context);
+            errdata = CopyErrorData();
+            FlushErrorState();
+            retry_attempt_end(rc);
+
+            RollbackAndReleaseCurrentSubTransaction();
+            MemoryContextSwitchTo(retry_context);
+            CurrentResourceOwner = retry_owner;
+            timing_end(RETRY_PHASE_ERROR_ROLLBACK, &timing);
+
+            if (!retry_attempt_failed(rc, errdata, &delay_ms))
+                ReThrowError(errdata);
+
+            MemoryContextReset(error_context);
+        }
+        PG_END_TRY();
+
+        if (success)
+            break;
+
+        MemoryContextReset(retry_context);
+        retry_backoff(rc, delay_ms);
+    }
+
+    if (success)
+        retry_call_succeeded(rc);
+
+    MemoryContextSwitchTo(caller_context);
+    MemoryContextDelete(call_context);
+
+    if (!success)
+        ereport(ERROR,
+                (errcode(ERRCODE_INTERNAL_ERROR),
+                 errmsg("pg_retry: unexpected error state")));
+
+    if (queryDesc->totaltime)
+        InstrStopNode(queryDesc->totaltime, (double) processed);
+
+    /* The command tag reports the rows of the successful attempt */
+    queryDesc->estate->es_processed = processed;
+    queryDesc->estate->es_total_processed += processed;
+}
+
+/*
+ * ExecutorRun hook: with pg_retry.auto on, eligible statements run through
+ * auto_retry_run() instead of the executor
+ */
+static void
+#if PG_VERSION_NUM >= 180000
+pg_retry_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count)
+#else
+pg_retry_ExecutorRun(QueryDesc *queryDesc, ScanDirection direction, uint64 count,
+                     bool execute_once)
+#endif
+{
+#if PG_VERSION_NUM >= 180000
+    bool execute_once = true;
+#endif
+
+    if (execute_once && count == 0 && ScanDirectionIsForward(direction) &&
+        auto_retry_eligible(queryDesc))
+        auto_retry_run(queryDesc);
+#if PG_VERSION_NUM >= 180000
+    else if (prev_ExecutorRun)
+        prev_ExecutorRun(queryDesc, direction, count);
+    else
+        standard_ExecutorRun(queryDesc, direction, count);
+#else
+    else if (prev_ExecutorRun)
+        prev_ExecutorRun(queryDesc, direction, count, execute_once);
+    else
+        standard_ExecutorRun(queryDesc, direction, count, execute_once);
+#endif
+}
+
+/*
+ * SQL-callable entry point that wraps the target statement in retry logic.
+ */
+Datum
+pg_retry_retry(PG_FUNCTION_ARGS)
+{
+    text *sql_text;
+    char *sql;
+    RetryPolicy policy;
+    int processed_rows;
+
+    /* Extract arguments */
+    if (PG_ARGISNULL(0))
+        ereport(ERROR,
+                (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+                 errmsg("pg_retry: sql parameter cannot be null")));
+    
+    /* Extract the SQL argument. Even though we only accept one TEXT value,
+   * we still parse it with the PostgreSQL parser to ensure it is a single
+   * statement and contains no transaction control, keeping retries safe in 
+   validate_sql function
+   */
+    sql_text = PG_GETARG_TEXT_PP(0);
+    sql = text_to_cstring(sql_text);
+
+    parse_retry_policy(fcinfo, 1, &policy);
+
+    processed_rows = execute_with_retry(sql, 0, NULL, NULL, NULL, &policy);
+
+    pfree(sql);
+    free_retry_policy(&policy);
+    PG_RETURN_INT32(processed_rows);
+}
+
+/*
+ * Same as pg_retry_retry(), but binds the elements of an array to $1..$n.
+ * Every parameter has the array's element type; callers needing mixed types
+ * can pass text[] and cast in the statement ($1::int). Binding values instead
+ * of inlining literals keeps one cached plan per statement shape.
+ */
+Datum
+pg_retry_retry_params(PG_FUNCTION_ARGS)
+{
+    char *sql;
+    ArrayType *params;
+    Oid elemtype;
+    int16 elemlen;
+    bool elembyval;
+    char elemalign;
+    Datum *values;
+    bool *isnull;
+    int nargs;
+    Oid *argtypes = NULL;
+    char *nulls = NULL;
+    int i;
+    RetryPolicy policy;
+    int processed_rows;
+
+    if (PG_ARGISNULL(0))
+        ereport(ERROR,
+                (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+                 errmsg("pg_retry: sql parameter cannot be null")));
+
+    if (PG_ARGISNULL(1))
+        ereport(ERROR,
+                (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+                 errmsg("pg_retry: params parameter cannot be null")));
+
+    sql = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    params = PG_GETARG_ARRAYTYPE_P(1);
+
+    if (ARR_NDIM(params) > 1)
+        ereport(ERROR,
+                (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+                 errmsg("pg_retry: params must be a one-dimensional array")));
+
+    parse_retry_policy(fcinfo, 2, &policy);
+
+    elemtype = ARR_ELEMTYPE(params);
+    get_typlenbyvalalign(elemtype, &elemlen, &elembyval, &elemalign);
+    deconstruct_array(params, elemtype, elemlen, elembyval, elemalign,
+                      &values, &isnull, &nargs);
+
+    if (nargs > 0)
+    {
+        argtypes = palloc(nargs * sizeof(Oid));
+        nulls = palloc(nargs * sizeof(char));
+        for (i = 0; i < nargs; i++)
+        {
+            argtypes[i] = elemtype;
+            nulls[i] = isnull[i] ? 'n' : ' ';
+        }
+    }
+
+    processed_rows = execute_with_retry(sql, nargs, argtypes, values, nulls, &policy);
+
+    pfree(sql);
+    free_retry_policy(&policy);
+    PG_RETURN_INT32(processed_rows);
+}
+
+/*
+ * Turn a one-dimensional text[] of statements into C strings, validating
+ * every statement before any of them runs. group names the array in errors.
+ */
+static char **
+validate_statement_array(ArrayType *statements, const char *group, int *nstatements)
+{
+    Datum *elements;
+    bool *elem_nulls;
+    char **sqls;
+    int i;
+
+    deconstruct_array(statements, TEXTOID, -1, false, 'i', &elements, &elem_nulls, nstatements);
+
+    sqls = palloc(Max(*nstatements, 1) * sizeof(char *));
+    for (i = 0; i < *nstatements; i++)
+    {
+        if (elem_nulls[i])
+            ereport(ERROR,
+                    (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+                     errmsg("pg_retry: statement %d of the %s is null", i + 1, group)));
+
+        sqls[i] = TextDatumGetCString(elements[i]);
+        validate_sql_cached(sqls[i]);
+    }
+
+    pfree(elements);
+    pfree(elem_nulls);
+    return sqls;
+}
+
+/*
+ * retry.retry_batch(): run an array of statements in order, each in its own
+ * subtransaction with retry, over a single SPI connection. Every statement
+ * is validated before the first one runs, so a malformed entry fails the
+ * call without side effects. Plans are prepared at each statement's first
+ * attempt rather than up front, because later statements may depend on
+ * objects created by earlier ones; with the plan cache on, repeated batches
+ * skip parse analysis and planning altogether. With idempotent = true the
+ * whole batch shares one subtransaction per attempt and is retried as a
+ * unit, see retry_batch_shared_subxact().
+ * Returns one row per statement: its position, rows processed and attempts.
+ */
+Datum
+pg_retry_retry_batch(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    ArrayType *statements;
+    int nstatements;
+    char **sqls;
+    RetryPolicy policy;
+    bool idempotent;
+    instr_time timing;
+    int i;
+
+    if (PG_ARGISNULL(0))
+        ereport(ERROR,
+                (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+                 errmsg("pg_retry: statements parameter cannot be null")));
+
+    statements = PG_GETARG_ARRAYTYPE_P(0);
+    if (ARR_NDIM(statements) > 1)
+        ereport(ERROR,
+                (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+                 errmsg("pg_retry: statements must be a one-dimensional array")));
+
+    parse_retry_policy(fcinfo, 1, &policy);
+    idempotent = PG_ARGISNULL(8) ? false : PG_GETARG_BOOL(8);
+
+    sqls = validate_statement_array(statements, "batch", &nstatements);
+
+    InitMaterializedSRF(fcinfo, 0);
+
+    timing_start(&timing);
+    if (SPI_connect_ext(SPI_OPT_NONATOMIC) != SPI_OK_CONNECT)
+        ereport(ERROR,
+                (errcode(ERRCODE_CONNECTION_FAILURE),
+                 errmsg("pg_retry: SPI_connect failed")));
+    timing_end(RETRY_PHASE_SPI_CONNECT, &timing);
+
+    if (idempotent)
+    {
+        int *processed = palloc(Max(nstatements, 1) * sizeof(int));
+        int attempts;
+
+        attempts = retry_batch_shared_subxact(sqls, nstatements, &policy, processed);
+
+        for (i = 0; i < nstatements; i++)
+        {
+            Datum values[3];
+            bool nulls[3] = {0};
+
+            values[0] = Int32GetDatum(i + 1);
+            values[1] = Int32GetDatum(processed[i]);
+            values[2] = Int32GetDatum(attempts);
+            tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+        }
+        pfree(processed);
+    }
+    else
+    {
+        for (i = 0; i < nstatements; i++)
+        {
+            Datum values[3];
+            bool nulls[3] = {0};
+            int attempts;
+            int processed_rows;
+
+            processed_rows = retry_statement(sqls[i], 0, NULL, NULL, NULL, &policy, true,
+                                             &attempts, NULL);
+
+            values[0] = Int32GetDatum(i + 1);
+            values[1] = Int32GetDatum(processed_rows);
+            values[2] = Int32GetDatum(attempts);
+            tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+        }
+    }
+
+    SPI_finish();
+
+    for (i = 0; i < nstatements; i++)
+        pfree(sqls[i]);
+    pfree(sqls);
+    free_retry_policy(&policy);
+
+    return (Datum) 0;
+}
+
+/*
+ * retry.retry_xact(): run a group of statements as one unit. Every attempt
+ * runs all of them in a single subtransaction, so a conflict in any of them,
+ * say the write after a read, rolls back and reruns the whole group. Returns
+ * the rows processed by all statements of the successful attempt.
+ */
+Datum
+pg_retry_retry_xact(PG_FUNCTION_ARGS)
+{
+    ArrayType *statements;
+    int nstatements;
+    char **sqls;
+    int *processed;
+    int total_rows = 0;
+    RetryPolicy policy;
+    instr_time timing;
+    int i;
+
+    if (PG_ARGISNULL(0))
+        ereport(ERROR,
+                (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+                 errmsg("pg_retry: statements parameter cannot be null")));
+
+    statements = PG_GETARG_ARRAYTYPE_P(0);
+    if (ARR_NDIM(statements) > 1)
+        ereport(ERROR,
+                (errcode(ERRCODE_ARRAY_SUBSCRIPT_ERROR),
+                 errmsg("pg_retry: statements must be a one-dimensional array")));
+
+    parse_retry_policy(fcinfo, 1, &policy);
+    sqls = validate_statement_array(statements, "group", &nstatements);
+
+    timing_start(&timing);
+    if (SPI_connect_ext(SPI_OPT_NONATOMIC) != SPI_OK_CONNECT)
+        ereport(ERROR,
+                (errcode(ERRCODE_CONNECTION_FAILURE),
+                 errmsg("pg_retry: SPI_connect failed")));
+    timing_end(RETRY_PHASE_SPI_CONNECT, &timing);
+
+    processed = palloc(Max(nstatements, 1) * sizeof(int));
+    (void) retry_batch_shared_subxact(sqls, nstatements, &policy, processed);
+
+    SPI_finish();
+
+    for (i = 0; i < nstatements; i++)
+    {
+        if (pg_add_s32_overflow(total_rows, processed[i], &total_rows))
+            ereport(ERROR,
+                    (errcode(ERRCODE_NUMERIC_VALUE_OUT_OF_RANGE),
+                     errmsg("pg_retry: rows processed by the group exceed the integer range")));
+        pfree(sqls[i]);
+    }
+    pfree(sqls);
+    pfree(processed);
+    free_retry_policy(&policy);
+
+    PG_RETURN_INT32(total_rows);
+}
+
+/*
+ * retry.retry_query(): like pg_retry_retry(), but returns the rows of the
+ * successful attempt. Results are materialized: the function cannot hand
+ * rows back one at a time (ValuePerCall), because they are only final once
+ * the attempt's subtransaction has committed, and a subtransaction cannot
+ * stay open across calls. The rows are streamed into the result tuplestore,
+ * which spills to disk beyond work_mem, rather than buffered in an SPI
+ * tuptable; a failed attempt's rows are discarded before the retry.
+ */
+Datum
+pg_retry_retry_query(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    char *sql;
+    RetryPolicy policy;
+    RetryReceiver *receiver;
+    instr_time timing;
+
+    if (PG_ARGISNULL(0))
+        ereport(ERROR,
+                (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+                 errmsg("pg_retry: sql parameter cannot be null")));
+
+    sql = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    parse_retry_policy(fcinfo, 1, &policy);
+
+    InitMaterializedSRF(fcinfo, MAT_SRF_USE_EXPECTED_DESC);
+    receiver = retry_receiver_create(rsinfo->setResult, rsinfo->setDesc);
+
+    timing_start(&timing);
+    if (SPI_connect_ext(SPI_OPT_NONATOMIC) != SPI_OK_CONNECT)
+        ereport(ERROR,
+                (errcode(ERRCODE_CONNECTION_FAILURE),
+                 errmsg("pg_retry: SPI_connect failed")));
+    timing_end(RETRY_PHASE_SPI_CONNECT, &timing);
+
+    (void) retry_statement(sql, 0, NULL, NULL, NULL, &policy, false, NULL, receiver);
+
+    SPI_finish();
+
+    pfree(receiver);
+    pfree(sql);
+    free_retry_policy(&policy);
+
+    return (Datum) 0;
+}
+
+/*
+ * retry.stats(): cluster-wide retry counters as a single row
+ */
+Datum
+pg_retry_stats(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    Datum values[9];
+    bool nulls[9] = {0};
+    RetryStatCounters counters;
+
+    stats_check_loaded();
+    stats_flush();
+
+    InitMaterializedSRF(fcinfo, 0);
+
+#ifdef PG_RETRY_PGSTAT
+    /* Include this backend's own calls, which pgstat may not have flushed */
+    retry_pgstat_flush(false);
+    /* Honours stats_fetch_consistency like the built-in statistics views */
+    pgstat_snapshot_fixed(PG_RETRY_PGSTAT_KIND);
+    counters = *(RetryStatCounters *) pgstat_get_custom_snapshot_data(PG_RETRY_PGSTAT_KIND);
+#else
+    counters.calls = (PgStat_Counter) pg_atomic_read_u64(&retry_shared->calls);
+    counters.attempts = (PgStat_Counter) pg_atomic_read_u64(&retry_shared->attempts);
+    counters.successes = (PgStat_Counter) pg_atomic_read_u64(&retry_shared->successes);
+    counters.retries = (PgStat_Counter) pg_atomic_read_u64(&retry_shared->retries);
+    counters.exhausted = (PgStat_Counter) pg_atomic_read_u64(&retry_shared->exhausted);
+    counters.non_retryable = (PgStat_Counter) pg_atomic_read_u64(&retry_shared->non_retryable);
+    counters.budget_denied = (PgStat_Counter) pg_atomic_read_u64(&retry_shared->budget_denied);
+    counters.sleep_us = (PgStat_Counter) pg_atomic_read_u64(&retry_shared->sleep_us);
+    counters.stat_reset_timestamp = (TimestampTz) pg_atomic_read_u64(&retry_shared->stats_reset);
+#endif
+
+    values[0] = Int64GetDatum(counters.calls);
+    values[1] = Int64GetDatum(counters.attempts);
+    values[2] = Int64GetDatum(counters.successes);
+    values[3] = Int64GetDatum(counters.retries);
+    values[4] = Int64GetDatum(counters.exhausted);
+    values[5] = Int64GetDatum(counters.non_retryable);
+    values[6] = Int64GetDatum(counters.budget_denied);
+    values[7] = Float8GetDatum((double) counters.sleep_us / 1000.0);
+    values[8] = TimestampTzGetDatum(counters.stat_reset_timestamp);
+
+    tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+
+    return (Datum) 0;
+}
+
+/*
+ * retry.subxact_usage(): subtransactions pg_retry started in the current
+ * top-level transaction, and how full the backend's subxid cache is
+ */
+Datum
+pg_retry_subxact_usage(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    Datum values[4];
+    bool nulls[4] = {0};
+
+    InitMaterializedSRF(fcinfo, 0);
+
+    values[0] = Int64GetDatum(IsTransactionState() ? retry_xact_subxacts : 0);
+    values[1] = Int32GetDatum((int32) MyProc->subxidStatus.count);
+    values[2] = Int32GetDatum(PGPROC_MAX_CACHED_SUBXIDS);
+    values[3] = BoolGetDatum(MyProc->subxidStatus.overflowed);
+
+    tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+
+    return (Datum) 0;
+}
+
+/*
+ * retry.sqlstate_stats(): retryable failures broken down by SQLSTATE.
+ * Codes seen after all slots were taken are reported with a NULL sqlstate.
+ */
+Datum
+pg_retry_sqlstate_stats(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    int i;
+
+    stats_check_loaded();
+    stats_flush();
+
+    InitMaterializedSRF(fcinfo, 0);
+
+    for (i = 0; i <= PG_RETRY_SQLSTATE_SLOTS; i++)
+    {
+        RetrySqlStateCounter *slot = i < PG_RETRY_SQLSTATE_SLOTS ? &retry_shared->sqlstates[i] : &retry_shared->other;
+        uint32 sqlerrcode = pg_atomic_read_u32(&slot->sqlerrcode);
+        uint64 retries = pg_atomic_read_u64(&slot->retries);
+        uint64 exhausted = pg_atomic_read_u64(&slot->exhausted);
+        Datum values[3];
+        bool nulls[3] = {0};
+
+        if (retries == 0 && exhausted == 0)
+            continue;
+
+        if (i < PG_RETRY_SQLSTATE_SLOTS)
+            values[0] = CStringGetTextDatum(unpack_sql_state((int) sqlerrcode));
+        else
+            nulls[0] = true;
+        values[1] = Int64GetDatum((int64) retries);
+        values[2] = Int64GetDatum((int64) exhausted);
+
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+
+    return (Datum) 0;
+}
+
+/*
+ * retry.phase_timings(): the phase histograms, one row per non-empty bucket.
+ * The last bucket has no upper bound.
+ */
+Datum
+pg_retry_phase_timings(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    int phase;
+    int bucket;
+
+    stats_check_loaded();
+    stats_flush();
+
+    InitMaterializedSRF(fcinfo, 0);
+
+    for (phase = 0; phase < RETRY_NUM_PHASES; phase++)
+    {
+        for (bucket = 0; bucket < PG_RETRY_TIMING_BUCKETS; bucket++)
+        {
+            uint64 count = pg_atomic_read_u64(&retry_shared->timings.counts[phase][bucket]);
+            Datum values[4];
+            bool nulls[4] = {0};
+
+            if (count == 0)
+                continue;
+
+            values[0] = CStringGetTextDatum(retry_phase_names[phase]);
+            values[1] = Int64GetDatum((int64) timing_bucket_lower(bucket));
+            if (bucket < PG_RETRY_TIMING_BUCKETS - 1)
+                values[2] = Int64GetDatum((int64) timing_bucket_lower(bucket + 1));
+            else
+                nulls[2] = true;
+            values[3] = Int64GetDatum((int64) count);
+
+            tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+        }
+    }
+
+    return (Datum) 0;
+}
+
+/*
+ * retry.stats_reset(): zero all counters
+ */
+Datum
+pg_retry_stats_reset(PG_FUNCTION_ARGS)
+{
+    int i;
+
+    stats_check_loaded();
+
+    memset(&retry_pending, 0, sizeof(retry_pending));
+    memset(&retry_timing_pending, 0, sizeof(retry_timing_pending));
+
+#ifdef PG_RETRY_PGSTAT
+    pgstat_reset_of_kind(PG_RETRY_PGSTAT_KIND);
+#else
+    pg_atomic_write_u64(&retry_shared->calls, 0);
+    pg_atomic_write_u64(&retry_shared->attempts, 0);
+    pg_atomic_write_u64(&retry_shared->successes, 0);
+    pg_atomic_write_u64(&retry_shared->retries, 0);
+    pg_atomic_write_u64(&retry_shared->exhausted, 0);
+    pg_atomic_write_u64(&retry_shared->non_retryable, 0);
+    pg_atomic_write_u64(&retry_shared->budget_denied, 0);
+    pg_atomic_write_u64(&retry_shared->sleep_us, 0);
+    pg_atomic_write_u64(&retry_shared->stats_reset, (uint64) GetCurrentTimestamp());
+#endif
+    for (i = 0; i < PG_RETRY_SQLSTATE_SLOTS; i++)
+    {
+        pg_atomic_write_u64(&retry_shared->sqlstates[i].retries, 0);
+        pg_atomic_write_u64(&retry_shared->sqlstates[i].exhausted, 0);
+    }
+    pg_atomic_write_u64(&retry_shared->other.retries, 0);
+    pg_atomic_write_u64(&retry_shared->other.exhausted, 0);
+    for (i = 0; i < RETRY_NUM_PHASES; i++)
+    {
+        int bucket;
+
+        for (bucket = 0; bucket < PG_RETRY_TIMING_BUCKETS; bucket++)
+            pg_atomic_write_u64(&retry_shared->timings.counts[i][bucket], 0);
+    }
+
+    PG_RETURN_VOID();
+}
+
+#define PG_RETRY_STATEMENT_STATS_COLS 20
+
+/*
+ * retry.statement_stats(): one row per tracked statement. Query text and
+ * fingerprint of other users' statements are hidden unless the caller has
+ * the privileges of pg_read_all_stats, as in pg_stat_statements.
+ */
+Datum
+pg_retry_statement_stats(PG_FUNCTION_ARGS)
+{
+    ReturnSetInfo *rsinfo = (ReturnSetInfo *) fcinfo->resultinfo;
+    Oid userid = GetUserId();
+    bool is_allowed_role = has_privs_of_role(userid, ROLE_PG_READ_ALL_STATS);
+    HASH_SEQ_STATUS hash_seq;
+    RetryStatementEntry *entry;
+
+    stats_check_loaded();
+
+    InitMaterializedSRF(fcinfo, 0);
+
+    LWLockAcquire(retry_shared->lock, LW_SHARED);
+    LWLockAcquire(retry_shared->breaker_lock, LW_SHARED);
+
+    hash_seq_init(&hash_seq, statement_hash);
+    while ((entry = (RetryStatementEntry *) hash_seq_search(&hash_seq)) != NULL)
+    {
+        Datum values[PG_RETRY_STATEMENT_STATS_COLS];
+        bool nulls[PG_RETRY_STATEMENT_STATS_COLS] = {0};
+        RetryStatementCounters c;
+        RetryBreakerKey breaker_key;
+        RetryBreakerEntry *breaker;
+        StringInfoData failures;
+        Datum backoff[PG_RETRY_BACKOFF_BUCKETS];
+        int i = 0;
+        int j;
+
+        SpinLockAcquire(&entry->mutex);
+        c = entry->counters;
+        SpinLockRelease(&entry->mutex);
+
+        values[i++] = ObjectIdGetDatum(entry->key.userid);
+        values[i++] = ObjectIdGetDatum(entry->key.dbid);
+        if (is_allowed_role || entry->key.userid == userid)
+        {
+            values[i++] = Int64GetDatum((int64) entry->key.queryid);
+            values[i++] = CStringGetTextDatum(entry->query);
+        }
+        else
+        {
+            nulls[i++] = true;
+            values[i++] = CStringGetTextDatum("<insufficient privilege>");
+        }
+        values[i++] = Int64GetDatum(c.calls);
+        values[i++] = Int64GetDatum(c.attempts);
+        values[i++] = Int64GetDatum(c.successes);
+        values[i++] = Int64GetDatum(c.exhausted);
+        values[i++] = Int64GetDatum(c.non_retryable);
+
+        initStringInfo(&failures);
+        appendStringInfoChar(&failures, '{');
+        for (j = 0; j < c.nsqlstates; j++)
+            appendStringInfo(&failures, "%s\"%s\": " INT64_FORMAT, j > 0 ? ", " : "",
+                             unpack_sql_state(c.sqlstates[j]), c.sqlstate_failures[j]);
+        if (c.other_failures > 0)
+            appendStringInfo(&failures, "%s\"other\": " INT64_FORMAT, j > 0 ? ", " : "",
+                             c.other_failures);
+        appendStringInfoChar(&failures, '}');
+        values[i++] = DirectFunctionCall1(jsonb_in, CStringGetDatum(failures.data));
+        pfree(failures.data);
+
+        values[i++] = Float8GetDatum(c.total_backoff_ms);
+        for (j = 0; j < PG_RETRY_BACKOFF_BUCKETS; j++)
+            backoff[j] = Int64GetDatum(c.backoff_hist[j]);
+        values[i++] = PointerGetDatum(construct_array_builtin(backoff, PG_RETRY_BACKOFF_BUCKETS, INT8OID));
+
+        if (c.attempts > 0)
+        {
+            /* histogram percentiles are in microseconds */
+            values[i++] = Float8GetDatum(c.total_exec_ms / c.attempts);
+            values[i++] = Float8GetDatum(hist_percentile(c.exec_hist, c.attempts, 0.50) / 1000.0);
+            values[i++] = Float8GetDatum(hist_percentile(c.exec_hist, c.attempts, 0.95) / 1000.0);
+            values[i++] = Float8GetDatum(hist_percentile(c.exec_hist, c.attempts, 0.99) / 1000.0);
+            values[i++] = Float8GetDatum(c.max_exec_ms);
+        }
+        else
+        {
+            for (j = 0; j < 5; j++)
+                nulls[i++] = true;
+        }
+
+        memset(&breaker_key, 0, sizeof(breaker_key));
+        breaker_key.dbid = entry->key.dbid;
+        breaker_key.queryid = entry->key.queryid;
+        breaker = (RetryBreakerEntry *) hash_search(breaker_hash, &breaker_key, HASH_FIND, NULL);
+        if (breaker != NULL)
+        {
+            BreakerState state;
+            TimestampTz state_since;
+            int64 opens;
+
+            SpinLockAcquire(&breaker->mutex);
+            state = breaker->state;
+            state_since = breaker->state_since;
+            opens = breaker->opens;
+            SpinLockRelease(&breaker->mutex);
+
+            values[i++] = CStringGetTextDatum(breaker_state_name(state));
+            values[i++] = Int64GetDatum(opens);
+            values[i++] = TimestampTzGetDatum(state_since);
+        }
+        else
+        {
+            for (j = 0; j < 3; j++)
+                nulls[i++] = true;
+        }
+
+        Assert(i == PG_RETRY_STATEMENT_STATS_COLS);
+        tuplestore_putvalues(rsinfo->setResult, rsinfo->setDesc, values, nulls);
+    }
+
+    LWLockRelease(retry_shared->breaker_lock);
+    LWLockRelease(retry_shared->lock);
+
+    return (Datum) 0;
+}
+
+/*
+ * retry.statement_stats_reset(): discard all per-statement entries
+ */
+Datum
+pg_retry_statement_stats_reset(PG_FUNCTION_ARGS)
+{
+    HASH_SEQ_STATUS hash_seq;
+    RetryStatementEntry *entry;
+
+    stats_check_loaded();
+
+    LWLockAcquire(retry_shared->lock, LW_EXCLUSIVE);
+    hash_seq_init(&hash_seq, statement_hash);
+    while ((entry = (RetryStatementEntry *) hash_seq_search(&hash_seq)) != NULL)
+        hash_search(statement_hash, &entry->key, HASH_REMOVE, NULL);
+    LWLockRelease(retry_shared->lock);
+
+    PG_RETURN_VOID();
+}
+
+/*
+ * retry.create_policy(): store or replace a named policy in retry.policy.
+ * NULL settings are stored as NULL and resolve to the GUC defaults at call
+ * time; the rest is validated here so a bad policy is caught on creation.
+ */
+Datum
+pg_retry_create_policy(PG_FUNCTION_ARGS)
+{
+    RetryPolicy policy;
+    char *name;
+    Oid argtypes[8] = {TEXTOID, INT4OID, INT4OID, INT4OID, TEXTARRAYOID, TEXTOID, INT4OID,
+                       JSONBOID};
+    Datum values[8];
+    char nulls[8];
+    int ret;
+    int i;
+
+    if (PG_ARGISNULL(0))
+        ereport(ERROR,
+                (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+                 errmsg("pg_retry: policy name cannot be null")));
+
+    name = text_to_cstring(PG_GETARG_TEXT_PP(0));
+    if (name[0] == '\0' || strlen(name) >= NAMEDATALEN)
+        ereport(ERROR,
+                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
+                 errmsg("pg_retry: policy name must be between 1 and %d bytes long",
+                        NAMEDATALEN - 1)));
+
+    policy.max_tries = PG_ARGISNULL(1) ? pg_retry_default_max_tries : PG_GETARG_INT32(1);
+    policy.base_delay_ms = PG_ARGISNULL(2) ? pg_retry_default_base_delay_ms : PG_GETARG_INT32(2);
+    policy.max_delay_ms = PG_ARGISNULL(3) ? pg_retry_default_max_delay_ms : PG_GETARG_INT32(3);
+    policy.deadline_ms = PG_ARGISNULL(6) ? pg_retry_default_deadline_ms : PG_GETARG_INT32(6);
+    validate_retry_policy(&policy);
+    if (!PG_ARGISNULL(4))
+        pfree(compile_sqlstate_array(PG_GETARG_ARRAYTYPE_P(4)));
+    if (!PG_ARGISNULL(5))
+        (void) parse_backoff_strategy(text_to_cstring(PG_GETARG_TEXT_PP(5)));
+    if (!PG_ARGISNULL(7))
+        pfree(compile_sqlstate_policy(PG_GETARG_JSONB_P(7)));
+
+    for (i = 0; i < 8; i++)
+    {
+        values[i] = PG_ARGISNULL(i) ? (Datum) 0 : PG_GETARG_DATUM(i);
+        nulls[i] = PG_ARGISNULL(i) ? 'n' : ' ';
+    }
+
+    if (SPI_connect() != SPI_OK_CONNECT)
+        ereport(ERROR,
+                (errcode(ERRCODE_INTERNAL_ERROR),
+                 errmsg("pg_retry: SPI_connect failed")));
+
+    ret = SPI_execute_with_args("INSERT INTO retry.policy AS p (name, max_tries, base_delay_ms, "
+                                "max_delay_ms, retry_sqlstates, strategy, deadline_ms, "
+                                "sqlstate_policy) "
+                                "VALUES ($1, $2, $3, $4, $5, $6, $7, $8) "
+                                "ON CONFLICT (name) DO UPDATE SET "
+                                "max_tries = EXCLUDED.max_tries, "
+                                "base_delay_ms = EXCLUDED.base_delay_ms, "
+                                "max_delay_ms = EXCLUDED.max_delay_ms, "
+                                "retry_sqlstates = EXCLUDED.retry_sqlstates, "
+                                "strategy = EXCLUDED.strategy, "
+                                "deadline_ms = EXCLUDED.deadline_ms, "
+                                "sqlstate_policy = EXCLUDED.sqlstate_policy",
+                                8, argtypes, values, nulls, false, 0);
+    if (ret != SPI_OK_INSERT)
+        ereport(ERROR,
+                (errcode(ERRCODE_INTERNAL_ERROR),
+                 errmsg("pg_retry: SPI_execute failed with code %d", ret)));
+
+    SPI_finish();
+    pfree(name);
+
+    PG_RETURN_VOID();
+}
+
+/*
+ * Statement-level trigger on retry.policy: have every backend drop its
+ * policy cache once the change commits
+ */
+Datum
+pg_retry_policy_invalidate(PG_FUNCTION_ARGS)
+{
+    TriggerData *trigdata = (TriggerData *) fcinfo->context;
+
+    if (!CALLED_AS_TRIGGER(fcinfo))
+        ereport(ERROR,
+                (errcode(ERRCODE_E_R_I_E_TRIGGER_PROTOCOL_VIOLATED),
+                 errmsg("pg_retry: policy_invalidate must be called as a trigger")));
+
+    CacheInvalidateRelcache(trigdata->tg_relation);
+
+    return PointerGetDatum(NULL);
+}
+
+/*
+ * Switch to the owner of retry.async_job, the only role that may write to
+ * it, for a statement on the queue. The caller switches back with
+ * SetUserIdAndSecContext(); an error in between is undone by the abort.
+ */
+static void
+async_queue_switch_to_owner(Oid *save_userid, int *save_sec_context)
+{
+    Oid nspid = get_namespace_oid("retry", false);
+    Oid relid = get_relname_relid("async_job", nspid);
+    HeapTuple tuple;
+    Oid owner;
+
+    if (!OidIsValid(relid))
+        ereport(ERROR,
+                (errcode(ERRCODE_UNDEFINED_TABLE),
+                 errmsg("pg_retry: relation \"retry.async_job\" does not exist")));
+
+    tuple = SearchSysCache1(RELOID, ObjectIdGetDatum(relid));
+    if (!HeapTupleIsValid(tuple))
+        elog(ERROR, "cache lookup failed for relation %u", relid);
+    owner = ((Form_pg_class) GETSTRUCT(tuple))->relowner;
+    ReleaseSysCache(tuple);
+
+    GetUserIdAndSecContext(save_userid, save_sec_context);
+    SetUserIdAndSecContext(owner, *save_sec_context | SECURITY_LOCAL_USERID_CHANGE |
+                                      SECURITY_RESTRICTED_OPERATION);
+}
+
+/*
+ * Queue a statement for a background worker, which runs it with the same
+ * retry loop as retry.retry() once the calling transaction commits. The
+ * policy is resolved now, from the caller's arguments and settings, and the
+ * worker runs the statement as the calling role, which must be able to log
+ * in for the worker to connect as it.
+ */
+Datum
+pg_retry_retry_async(PG_FUNCTION_ARGS)
+{
+    char *sql;
+    RetryPolicy policy;
+    List *parsed_tree;
+    Oid argtypes[9] = {OIDOID, TEXTOID, INT4OID, INT4OID, INT4OID, TEXTARRAYOID, TEXTOID, INT4OID,
+                       TEXTOID};
+    Datum values[9];
+    char nulls[9] = {' ', ' ', ' ', ' ', ' ', ' ', ' ', ' ', ' '};
+    bool isnull;
+    int64 job_id;
+    int ret;
+    MemoryContext oldcontext;
+    Oid userid = GetUserId();
+    Oid save_userid;
+    int save_sec_context;
+    HeapTuple roletup;
+    bool canlogin;
+
+    if (PG_ARGISNULL(0))
+        ereport(ERROR,
+                (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
+                 errmsg("pg_retry: sql parameter cannot be null")));
+
+    if (retry_shared == NULL)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_retry: retry_async requires pg_retry to be loaded via shared_preload_libraries")));
+
+    if (pg_retry_async_max_workers == 0)
+        ereport(ERROR,
+                (errcode(ERRCODE_OBJECT_NOT_IN_PREREQUISITE_STATE),
+                 errmsg("pg_retry: retry_async is disabled"),
+                 errhint("Set pg_retry.async_max_workers to a value above 0.")));
+
+    roletup = SearchSysCache1(AUTHOID, ObjectIdGetDatum(userid));
+    if (!HeapTupleIsValid(roletup))
+        elog(ERROR, "cache lookup failed for role %u", userid);
+    canlogin = ((Form_pg_authid) GETSTRUCT(roletup))->rolcanlogin;
+    ReleaseSysCache(roletup);
+    if (!canlogin)
+        ereport(ERROR,
+                (errcode(ERRCODE_INSUFFICIENT_PRIVILEGE),
+                 errmsg("pg_retry: role \"%s\" cannot log in, so no worker can run its jobs",
+                        GetUserNameFromId(userid, false)),
+                 errhint("Queue the statement as a role with the LOGIN attribute.")));
+
+    sql = text_to_cstring(PG_GETARG_TEXT_PP(0));
+
+    /* Reject what the worker would reject, while the caller can still see it */
+    validate_sql(sql, &parsed_tree);
+    parse_retry_policy(fcinfo, 1, &policy);
+
+    values[0] = ObjectIdGetDatum(userid);
+    values[1] = CStringGetTextDatum(sql);
+    values[2] = Int32GetDatum(policy.max_tries);
+    values[3] = Int32GetDatum(policy.base_delay_ms);
+    values[4] = Int32GetDatum(policy.max_delay_ms);
+    values[5] = PointerGetDatum(sqlstate_set_to_array(policy.retry_sqlstates));
+    values[6] = CStringGetTextDatum(backoff_strategy_name(policy.strategy));
+    values[7] = Int32GetDatum(policy.deadline_ms);
+    if (policy.sqlstate_policy != NULL)
+        values[8] = CStringGetTextDatum(sqlstate_policy_to_json(policy.sqlstate_policy));
+    else
+        nulls[8] = 'n';
+
+    if (SPI_connect() != SPI_OK_CONNECT)
+        ereport(ERROR,
+                (errcode(ERRCODE_INTERNAL_ERROR),
+                 errmsg("pg_retry: SPI_connect failed")));
+
+    /* The caller cannot write to the queue itself, so userid is the caller */
+    async_queue_switch_to_owner(&save_userid, &save_sec_context);
+    ret = SPI_execute_with_args("INSERT INTO retry.async_job (userid, sql, max_tries, "
+                                "base_delay_ms, max_delay_ms, retry_sqlstates, strategy, "
+                                "deadline_ms, sqlstate_policy) "
+                                "VALUES ($1, $2, $3, $4, $5, $6, $7, $8, $9::jsonb) RETURNING id",
+                                9, argtypes, values, nulls, false, 1);
+    SetUserIdAndSecContext(save_userid, save_sec_context);
+    if (ret != SPI_OK_INSERT_RETURNING || SPI_processed != 1)
+        ereport(ERROR,
+                (errcode(ERRCODE_INTERNAL_ERROR),
+                 errmsg("pg_retry: SPI_execute failed with code %d", ret)));
+
+    job_id = DatumGetInt64(SPI_getbinval(SPI_tuptable->vals[0], SPI_tuptable->tupdesc, 1, &isnull));
+    SPI_finish();
+
+    /* Workers only see the job once it commits, so wake them then */
+    oldcontext = MemoryContextSwitchTo(TopTransactionContext);
+    async_wake_roles = list_append_unique_oid(async_wake_roles, userid);
+    MemoryContextSwitchTo(oldcontext);
+
+    pfree(sql);
+    free_retry_policy(&policy);
+    PG_RETURN_INT64(job_id);
+}
+
+/*
+ * Make sure a worker serves the queue of a role in this database: set the
+ * latch of the running one, or register one in a free slot. Called after
+ * commit, so it must not error out; trouble is reported as a WARNING and
+ * the jobs stay queued for the next wakeup.
+ */
+static void
+async_wake(Oid userid)
+{
+    TimestampTz now = GetCurrentTimestamp();
+    RetryAsyncSlot *free_slot = NULL;
+    int nworkers = 0;
+    int i;
+    BackgroundWorker worker;
+    BackgroundWorkerHandle *handle;
+    Oid key[2];
+
+    LWLockAcquire(retry_shared->async_lock, LW_EXCLUSIVE);
+    for (i = 0; i < PG_RETRY_ASYNC_SLOTS; i++)
+    {
+        RetryAsyncSlot *slot = &retry_shared->async_workers[i];
+
+        if (slot->in_use && slot->pid == 0 &&
+            TimestampDifferenceExceeds(slot->registered, now, PG_RETRY_ASYNC_START_TIMEOUT_MS))
+            slot->in_use = false;
+
+        if (!slot->in_use)
+        {
+            if (free_slot == NULL)
+                free_slot = slot;
+            continue;
+        }
+
+        nworkers++;
+        if (slot->dbid == MyDatabaseId && slot->userid == userid)
+        {
+            /* A worker that has not started yet will look at the queue anyway */
+            if (slot->pid != 0)
+            {
+                PGPROC *proc = BackendPidGetProc(slot->pid);
+
+                if (proc != NULL)
+                    SetLatch(&proc->procLatch);
+            }
+            LWLockRelease(retry_shared->async_lock);
+            return;
+        }
+    }
+
+    if (free_slot == NULL || nworkers >= pg_retry_async_max_workers)
+    {
+        LWLockRelease(retry_shared->async_lock);
+        ereport(WARNING,
+                (errmsg("pg_retry: no background worker available for queued jobs"),
+                 errdetail("All %d workers allowed by pg_retry.async_max_workers are busy; the jobs stay queued until the next retry.retry_async() call finds a free one.",
+                           pg_retry_async_max_workers)));
+        return;
+    }
+
+    free_slot->in_use = true;
+    free_slot->dbid = MyDatabaseId;
+    free_slot->userid = userid;
+    free_slot->pid = 0;
+    free_slot->registered = now;
+
+    memset(&worker, 0, sizeof(worker));
+    worker.bgw_flags = BGWORKER_SHMEM_ACCESS | BGWORKER_BACKEND_DATABASE_CONNECTION;
+    worker.bgw_start_time = BgWorkerStart_RecoveryFinished;
+    worker.bgw_restart_time = BGW_NEVER_RESTART;
+    snprintf(worker.bgw_library_name, BGW_MAXLEN, "pg_retry");
+    snprintf(worker.bgw_function_name, BGW_MAXLEN, "pg_retry_async_main");
+    snprintf(worker.bgw_name, BGW_MAXLEN, "pg_retry async worker for role %u", userid);
+    snprintf(worker.bgw_type, BGW_MAXLEN, "pg_retry async worker");
+    worker.bgw_main_arg = Int32GetDatum((int) (free_slot - retry_shared->async_workers));
+    key[0] = MyDatabaseId;
+    key[1] = userid;
+    memcpy(worker.bgw_extra, key, sizeof(key));
+    worker.bgw_notify_pid = 0;
+
+    if (!RegisterDynamicBackgroundWorker(&worker, &handle))
+    {
+        free_slot->in_use = false;
+        LWLockRelease(retry_shared->async_lock);
+        ereport(WARNING,
+                (errmsg("pg_retry: could not register a background worker for queued jobs"),
+                 errhint("You might need to increase \"max_worker_processes\".")));
+        return;
+    }
+    LWLockRelease(retry_shared->async_lock);
+}
+
+/*
+ * Wake the workers of the roles that queued jobs once they are visible
+ */
+static void
+async_xact_callback(XactEvent event, void *arg)
+{
+    ListCell *lc;
+
+    switch (event)
+    {
+        case XACT_EVENT_COMMIT:
+            foreach(lc, async_wake_roles)
+                async_wake(lfirst_oid(lc));
+            async_wake_roles = NIL;
+            break;
+        case XACT_EVENT_ABORT:
+        case XACT_EVENT_PARALLEL_ABORT:
+            async_wake_roles = NIL;
+            break;
+        default:
+            break;
+    }
+}
+
+/*
+ * Give the worker's slot back, unless async_worker_retire() already did or
+ * the slot was taken over after this worker failed to start in time
+ */
+static void
+async_worker_exit(int code, Datum arg)
+{
+    RetryAsyncSlot *slot = &retry_shared->async_workers[DatumGetInt32(arg)];
+
+    LWLockAcquire(retry_shared->async_lock, LW_EXCLUSIVE);
+    if (slot->in_use && slot->pid == MyProcPid)
+    {
+        slot->in_use = false;
+        slot->pid = 0;
+    }
+    LWLockRelease(retry_shared->async_lock);
+}
+
+/*
+ * Release the slot of an idle worker, unless a wakeup came in meanwhile.
+ * Wakers set the latch while holding async_lock, so a job committed after
+ * the worker last looked either finds the slot gone and registers a new
+ * worker, or has set the latch before it is checked here.
+ */
+static bool
+async_worker_retire(int slotno)
+{
+    RetryAsyncSlot *slot = &retry_shared->async_workers[slotno];
+    bool retire;
 
-            if (strcmp(sqlstate, elem_str) == 0)
-            {
-                pfree(elem_str);
-                pfree(elements);
-                pfree(nulls);
-                return true;
-            }
-            pfree(elem_str);
-        }
+    LWLockAcquire(retry_shared->async_lock, LW_EXCLUSIVE);
+    retire = !MyLatch->is_set;
+    if (retire)
+    {
+        slot->in_use = false;
+        slot->pid = 0;
     }
+    LWLockRelease(retry_shared->async_lock);
 
-    pfree(elements);
-    pfree(nulls);
-    return false;
+    return retire;
 }
 
 /*
- * Check if parsed statement is a transaction control statement
+ * Claim and run up to pg_retry.async_batch_size queued jobs of the role,
+ * each in its own transaction, so a job's locks are released as soon as it
+ * ends. Returns the number of jobs run.
  */
-static bool
-contains_transaction_control(List *parsetree_list)
+static int
+async_run_batch(Oid userid, MemoryContext batch_context)
 {
-    RawStmt *raw_stmt;
+    int njobs = 0;
 
-    if (parsetree_list == NULL || list_length(parsetree_list) != 1)
-        return false;
-
-    raw_stmt = (RawStmt *) linitial(parsetree_list);
+    while (njobs < pg_retry_async_batch_size)
+    {
+        CHECK_FOR_INTERRUPTS();
+        if (!async_run_next_job(userid, batch_context))
+            break;
+        MemoryContextReset(batch_context);
+        njobs++;
+    }
 
-    /* Check if the statement is a transaction control command */
-    if (IsA(raw_stmt->stmt, TransactionStmt))
-        return true;
+    pgstat_report_stat(false);
+    pgstat_report_activity(STATE_IDLE, NULL);
 
-    return false;
+    return njobs;
 }
 
 /*
- * Check if SQL contains exactly one statement using PostgreSQL parser
+ * Claim the oldest queued job of the role and run it in a transaction of
+ * its own. The queue is read and written as its owner and the statement
+ * runs as the role. The row lock keeps other workers off the job, and its
+ * outcome commits together with its effects, so a worker that dies
+ * mid-job leaves it queued. Any error once the job is claimed, whether
+ * from its settings, its statement, the status update or the commit,
+ * rolls the job back and marks it failed in a new transaction. Returns
+ * false when there was no job to claim.
  */
 static bool
-is_single_statement(const char *sql, List **parsed_tree)
+async_run_next_job(Oid userid, MemoryContext batch_context)
 {
-    List *raw_parsetree_list;
+    Oid argtypes[1] = {OIDOID};
+    Datum values[1];
+    volatile bool claimed = false;
+    volatile int64 job_id = 0;
+    volatile TimestampTz started_at = 0;
+    ErrorData *volatile errdata = NULL;
+    Oid save_userid;
+    int save_sec_context;
+    int ret;
 
-    /* Parse the SQL using PostgreSQL's query parser */
-    raw_parsetree_list = pg_parse_query(sql);
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+    pgstat_report_activity(STATE_RUNNING, "pg_retry async job");
+
+    PG_TRY();
+    {
+        if (SPI_connect() != SPI_OK_CONNECT)
+            ereport(ERROR,
+                    (errcode(ERRCODE_INTERNAL_ERROR),
+                     errmsg("pg_retry: SPI_connect failed")));
+
+        values[0] = ObjectIdGetDatum(userid);
+        async_queue_switch_to_owner(&save_userid, &save_sec_context);
+        ret = SPI_execute_with_args("SELECT id, sql, max_tries, base_delay_ms, max_delay_ms, "
+                                    "retry_sqlstates, strategy, deadline_ms, sqlstate_policy "
+                                    "FROM retry.async_job "
+                                    "WHERE status = 'queued' AND userid = $1 "
+                                    "ORDER BY id LIMIT 1 FOR UPDATE SKIP LOCKED",
+                                    1, argtypes, values, NULL, false, 0);
+        SetUserIdAndSecContext(save_userid, save_sec_context);
+        if (ret != SPI_OK_SELECT)
+            ereport(ERROR,
+                    (errcode(ERRCODE_INTERNAL_ERROR),
+                     errmsg("pg_retry: SPI_execute failed with code %d", ret)));
+
+        if (SPI_processed == 1)
+        {
+            HeapTuple tuple = SPI_tuptable->vals[0];
+            bool isnull;
+
+            job_id = DatumGetInt64(SPI_getbinval(tuple, SPI_tuptable->tupdesc, 1, &isnull));
+            started_at = GetCurrentTimestamp();
+            claimed = true;
+            async_run_job(job_id, started_at, tuple, SPI_tuptable->tupdesc);
+        }
+
+        SPI_finish();
+        PopActiveSnapshot();
+        CommitTransactionCommand();
+    }
+    PG_CATCH();
+    {
+        /* Without a claimed job there is nothing to record; the worker exits */
+        if (!claimed)
+            PG_RE_THROW();
+
+        MemoryContextSwitchTo(batch_context);
+        errdata = CopyErrorData();
+        FlushErrorState();
+    }
+    PG_END_TRY();
 
-    /* Store the parsed tree for later use */
-    if (parsed_tree != NULL)
-        *parsed_tree = raw_parsetree_list;
+    if (errdata != NULL)
+    {
+        AbortCurrentTransaction();
+        async_record_failure(job_id, started_at, errdata);
+    }
 
-    /* Check if we have exactly one statement */
-    return (list_length(raw_parsetree_list) == 1);
+    return claimed;
 }
 
 /*
- * Validate SQL input before execution
- *
- * Performs pre-execution validation to ensure SQL safety and correctness:
- * 1. Parse the SQL and verify it contains exactly one statement
- * 2. Check if the statement is a transaction control command (not allowed)
- *
- * The validation uses PostgreSQL's parser to properly handle SQL syntax,
- * including semicolons within string literals, comments, and JSON values.
- *
- * Parameters:
- * - sql: the SQL string to validate
- * - parsed_tree: pointer to store the parsed statement tree for reuse
- *
- * Returns:
- * - void (success) or raises an error if validation fails
- *
- * Errors:
- * - SYNTAX_ERROR: if SQL contains multiple statements or parsing fails
- * - FEATURE_NOT_SUPPORTED: if SQL contains transaction control statements
-
- *
- * NOTE: We use SPI to execute SQL queries within subtransactions so that
- * errors can be captured and retried without propagating further.
+ * Run a claimed job with retry_statement() and mark it succeeded; errors
+ * are left to async_run_next_job()
  */
 static void
-validate_sql(const char *sql, List **parsed_tree)
+async_run_job(int64 job_id, TimestampTz started_at, HeapTuple tuple, TupleDesc tupdesc)
 {
-    if (!is_single_statement(sql, parsed_tree))
-        ereport(ERROR,
-                (errcode(ERRCODE_SYNTAX_ERROR),
-                 errmsg("pg_retry: SQL must contain exactly one statement")));
+    RetryPolicy policy;
+    char *sql;
+    Datum value;
+    bool isnull;
+    int processed_rows;
+    int attempts = 0;
+    Oid argtypes[4] = {INT8OID, TIMESTAMPTZOID, INT4OID, INT4OID};
+    Datum values[4];
+    Oid save_userid;
+    int save_sec_context;
+    int ret;
+
+    sql = TextDatumGetCString(SPI_getbinval(tuple, tupdesc, 2, &isnull));
+    policy.max_tries = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 3, &isnull));
+    policy.base_delay_ms = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 4, &isnull));
+    policy.max_delay_ms = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 5, &isnull));
+    policy.retry_sqlstates =
+        compile_sqlstate_array(DatumGetArrayTypeP(SPI_getbinval(tuple, tupdesc, 6, &isnull)));
+    policy.strategy =
+        parse_backoff_strategy(TextDatumGetCString(SPI_getbinval(tuple, tupdesc, 7, &isnull)));
+    policy.deadline_ms = DatumGetInt32(SPI_getbinval(tuple, tupdesc, 8, &isnull));
+    value = SPI_getbinval(tuple, tupdesc, 9, &isnull);
+    policy.sqlstate_policy = isnull ? NULL : compile_sqlstate_policy(DatumGetJsonbP(value));
+    /* The time budget starts when the job does, not when it was queued */
+    policy.deadline = policy.deadline_ms > 0 ?
+        TimestampTzPlusMilliseconds(started_at, policy.deadline_ms) : 0;
+
+    processed_rows = retry_statement(sql, 0, NULL, NULL, NULL, &policy, false, &attempts, NULL);
 
-    if (contains_transaction_control(*parsed_tree))
+    values[0] = Int64GetDatum(job_id);
+    values[1] = TimestampTzGetDatum(started_at);
+    values[2] = Int32GetDatum(attempts);
+    values[3] = Int32GetDatum(processed_rows);
+    async_queue_switch_to_owner(&save_userid, &save_sec_context);
+    ret = SPI_execute_with_args("UPDATE retry.async_job SET status = 'succeeded', "
+                                "started_at = $2, finished_at = clock_timestamp(), "
+                                "attempts = $3, rows_processed = $4 WHERE id = $1",
+                                4, argtypes, values, NULL, false, 0);
+    SetUserIdAndSecContext(save_userid, save_sec_context);
+    if (ret != SPI_OK_UPDATE || SPI_processed != 1)
         ereport(ERROR,
-                (errcode(ERRCODE_FEATURE_NOT_SUPPORTED),
-                 errmsg("pg_retry: transaction control statements are not allowed")));
+                (errcode(ERRCODE_INTERNAL_ERROR),
+                 errmsg("pg_retry: could not mark async job " INT64_FORMAT " succeeded", job_id)));
+
+    free_retry_policy(&policy);
+    pfree(sql);
 }
 
 /*
- * Calculate delay with exponential backoff and jitter
+ * Mark a job failed with the error that ended it, in a new transaction
+ * because the one that ran it has been rolled back. Failed attempts were
+ * reported by retry_statement(); this is the outcome.
  */
-static long
-calculate_delay(int attempt, int base_delay_ms, int max_delay_ms)
+static void
+async_record_failure(int64 job_id, TimestampTz started_at, ErrorData *errdata)
 {
-    double delay = base_delay_ms * pow(2.0, attempt - 1);
-    double jitter;
-    double uniform;
-    delay = Min(delay, (double)max_delay_ms);
+    Oid argtypes[4] = {INT8OID, TIMESTAMPTZOID, TEXTOID, TEXTOID};
+    Datum values[4];
+    Oid save_userid;
+    int save_sec_context;
+    int ret;
 
-    /* Add jitter: ±20% using backend PRNG */
-    uniform = PG_RETRY_RANDOM_DOUBLE();
-    jitter = (uniform * delay * 0.4) - delay * 0.2;
-    delay += jitter;
+    ereport(LOG,
+            (errmsg("pg_retry: async job " INT64_FORMAT " failed with SQLSTATE %s: %s",
+                    job_id, unpack_sql_state(errdata->sqlerrcode),
+                    errdata->message ? errdata->message : "(no message)")));
 
-    /* Ensure minimum delay of 1ms */
-    return Max(1L, (long)delay);
+    SetCurrentStatementStartTimestamp();
+    StartTransactionCommand();
+    PushActiveSnapshot(GetTransactionSnapshot());
+
+    if (SPI_connect() != SPI_OK_CONNECT)
+        ereport(ERROR,
+                (errcode(ERRCODE_INTERNAL_ERROR),
+                 errmsg("pg_retry: SPI_connect failed")));
+
+    values[0] = Int64GetDatum(job_id);
+    values[1] = TimestampTzGetDatum(started_at);
+    values[2] = CStringGetTextDatum(unpack_sql_state(errdata->sqlerrcode));
+    values[3] = CStringGetTextDatum(errdata->message ? errdata->message : "");
+    async_queue_switch_to_owner(&save_userid, &save_sec_context);
+    /* Another worker may have picked the job up once the rollback unlocked it */
+    ret = SPI_execute_with_args("UPDATE retry.async_job SET status = 'failed', "
+                                "started_at = $2, finished_at = clock_timestamp(), "
+                                "last_sqlstate = $3, last_error = $4 "
+                                "WHERE id = $1 AND status = 'queued'",
+                                4, argtypes, values, NULL, false, 0);
+    SetUserIdAndSecContext(save_userid, save_sec_context);
+    if (ret != SPI_OK_UPDATE)
+        ereport(ERROR,
+                (errcode(ERRCODE_INTERNAL_ERROR),
+                 errmsg("pg_retry: SPI_execute failed with code %d", ret)));
+
+    SPI_finish();
+    PopActiveSnapshot();
+    CommitTransactionCommand();
 }
 
 /*
- * SQL-callable entry point that wraps the target statement in retry logic.
- * Each attempt runs inside its own subtransaction so we can roll back safely,
- * then we retry on configured SQLSTATEs using exponential backoff + jitter.
+ * Entry point of the background workers started by async_wake(): connect
+ * as the role whose jobs the slot serves and run them in batches until the
+ * queue has been empty for PG_RETRY_ASYNC_IDLE_MS
  */
-Datum
-pg_retry_retry(PG_FUNCTION_ARGS)
+void
+pg_retry_async_main(Datum main_arg)
 {
-    text *sql_text;
-    int max_tries;
-    int base_delay_ms;
-    int max_delay_ms;
-    ArrayType *retry_sqlstates;
-    char *sql;
-    int attempt;
-    int spi_result;
-    volatile int processed_rows = 0;
-    volatile bool success = false;
-    List *parsed_tree = NIL;
-    MemoryContext retry_context = CurrentMemoryContext;
-    ResourceOwner retry_owner = CurrentResourceOwner;
-    volatile bool default_sqlstates = false;
+    int slotno = DatumGetInt32(main_arg);
+    RetryAsyncSlot *slot = &retry_shared->async_workers[slotno];
+    MemoryContext batch_context;
+    Oid key[2];
 
-    /* Extract arguments */
-    if (PG_ARGISNULL(0))
-        ereport(ERROR,
-                (errcode(ERRCODE_NULL_VALUE_NOT_ALLOWED),
-                 errmsg("pg_retry: sql parameter cannot be null")));
-    
-    /* Extract the SQL argument. Even though we only accept one TEXT value,
-   * we still parse it with the PostgreSQL parser to ensure it is a single
-   * statement and contains no transaction control, keeping retries safe in 
-   validate_sql function
-   */
-    sql_text = PG_GETARG_TEXT_PP(0);
-    sql = text_to_cstring(sql_text);
+    pqsignal(SIGHUP, SignalHandlerForConfigReload);
+    pqsignal(SIGTERM, die);
+    BackgroundWorkerUnblockSignals();
 
-    max_tries = PG_ARGISNULL(1) ? pg_retry_default_max_tries : PG_GETARG_INT32(1);
-    base_delay_ms = PG_ARGISNULL(2) ? pg_retry_default_base_delay_ms : PG_GETARG_INT32(2);
-    max_delay_ms = PG_ARGISNULL(3) ? pg_retry_default_max_delay_ms : PG_GETARG_INT32(3);
+    memcpy(key, MyBgworkerEntry->bgw_extra, sizeof(key));
 
-    if (PG_ARGISNULL(4))
-    {
-        retry_sqlstates = build_sqlstate_array(pg_retry_default_sqlstates_str);
-        default_sqlstates = true;
-    }
-    else
+    /* The slot may have been given to another worker if this one started late */
+    LWLockAcquire(retry_shared->async_lock, LW_EXCLUSIVE);
+    if (!slot->in_use || slot->pid != 0 || slot->dbid != key[0] || slot->userid != key[1])
     {
-        retry_sqlstates = PG_GETARG_ARRAYTYPE_P(4);
+        LWLockRelease(retry_shared->async_lock);
+        proc_exit(0);
     }
+    slot->pid = MyProcPid;
+    LWLockRelease(retry_shared->async_lock);
+    before_shmem_exit(async_worker_exit, Int32GetDatum(slotno));
 
-    /* Validate inputs */
-    if (max_tries < 1)
-        ereport(ERROR,
-                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                 errmsg("pg_retry: max_tries must be >= 1")));
-
-    if (base_delay_ms < 0 || max_delay_ms < 0)
-        ereport(ERROR,
-                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                 errmsg("pg_retry: delay parameters must be >= 0")));
-
-    if (base_delay_ms > max_delay_ms)
-        ereport(ERROR,
-                (errcode(ERRCODE_INVALID_PARAMETER_VALUE),
-                 errmsg("pg_retry: base_delay_ms cannot be greater than max_delay_ms")));
+    /* retry_async() only queues jobs of roles that may log in */
+    BackgroundWorkerInitializeConnectionByOid(key[0], key[1], 0);
 
-    validate_sql(sql, &parsed_tree);
+    if (pg_retry_async_wait_event == 0)
+        pg_retry_async_wait_event = WaitEventExtensionNew("PgRetryAsyncIdle");
 
-    /* Connect to SPI */
-    if (SPI_connect_ext(SPI_OPT_NONATOMIC) != SPI_OK_CONNECT)
-        ereport(ERROR,
-                (errcode(ERRCODE_CONNECTION_FAILURE),
-                 errmsg("pg_retry: SPI_connect failed")));
+    batch_context = AllocSetContextCreate(TopMemoryContext,
+                                          "pg_retry async batch",
+                                          ALLOCSET_DEFAULT_SIZES);
 
-    /* Retry loop */
-    for (attempt = 1; attempt <= max_tries; attempt++)
+    for (;;)
     {
-        PG_TRY();
-        {
-            /* Run each attempt inside its own subtransaction */
-            BeginInternalSubTransaction(NULL);
-            MemoryContextSwitchTo(retry_context);
-
-            /* Execute the statement params it receive are sql,mode,nparams, we are passing false  for read write as this can modify data
-             (TODO: Should we retry readonly statements on retry? )
-             * and 0 for nparams as we are not passing any parameters
-             */
-            spi_result = SPI_execute(sql, false, 0);
-
-            if (spi_result < 0)
-            {
-                /* SPI error */
-                ereport(ERROR,
-                        (errcode(ERRCODE_INTERNAL_ERROR),
-                         errmsg("pg_retry: SPI_execute failed with code %d", spi_result)));
-            }
+        int rc;
 
-            processed_rows = SPI_processed; // global variable set by SPI_execute
-            success = true; // set to true if the statement executed successfully
+        CHECK_FOR_INTERRUPTS();
 
-            ReleaseCurrentSubTransaction();
-            SPI_restore_connection(); // ensure SPI is reconnected for the parent
-            MemoryContextSwitchTo(retry_context);
-            CurrentResourceOwner = retry_owner; // restore the resource owner
-        }
-        PG_CATCH();
+        if (ConfigReloadPending)
         {
-            ErrorData *errdata;
-            bool should_retry = false;
-
-            MemoryContextSwitchTo(retry_context);
-            errdata = CopyErrorData();
-            FlushErrorState();
-            RollbackAndReleaseCurrentSubTransaction(); // rollback the subtransaction and release the resources 
-            SPI_restore_connection(); // SPI needs reconnect after subtransaction cleanup
-            MemoryContextSwitchTo(retry_context);
-            CurrentResourceOwner = retry_owner;
-
-            /* Check if this is a retryable error */
-            if (errdata->sqlerrcode != 0)
-            {
-                const char *sqlstate = unpack_sql_state(errdata->sqlerrcode);
-
-                if (is_retryable_sqlstate(sqlstate, retry_sqlstates))
-                {
-                    should_retry = true;
-
-                    /* Log retry attempt this will also call the longjmp function internally */
-                    ereport(WARNING,
-                            (errcode(errdata->sqlerrcode),
-                             errmsg("pg_retry: attempt %d/%d failed with SQLSTATE %s: %s",
-                                    attempt, max_tries, sqlstate,
-                                    errdata->message ? errdata->message : "unknown error")));
-                }
-            }
-
-            if (!should_retry || attempt == max_tries)
-            {
-                /* Either not retryable or exhausted attempts - rethrow immediately */
-                ReThrowError(errdata);
-            }
-            else
-            {
-                /* Retry after delay */
-                FreeErrorData(errdata);
-
-                if (attempt < max_tries)
-                {
-                    long delay_ms = calculate_delay(attempt, base_delay_ms, max_delay_ms);
-                    pg_usleep(delay_ms * 1000L);
-                    CHECK_FOR_INTERRUPTS();
-                }
-            }
+            ConfigReloadPending = false;
+            ProcessConfigFile(PGC_SIGHUP);
         }
-        PG_END_TRY();
-
-        if (success)
-            break;
-    }
 
-    /* Disconnect from SPI */
-    SPI_finish();
+        /* Clear the latch first, so a wakeup during the batch is not lost */
+        ResetLatch(MyLatch);
+        rc = async_run_batch(key[1], batch_context);
+        if (rc > 0)
+            continue;
 
-    /* Handle final result */
-    if (success)
-    {
-        pfree(sql);
-        if (default_sqlstates)
-            pfree(retry_sqlstates);
-        else
-            PG_FREE_IF_COPY(retry_sqlstates, 4);
-        PG_RETURN_INT32(processed_rows);
-    }
-    else
-    {
-        if (default_sqlstates)
-            pfree(retry_sqlstates);
-        else
-            PG_FREE_IF_COPY(retry_sqlstates, 4);
-        /* Should not reach here - errors should be rethrown in PG_CATCH */
-        ereport(ERROR,
-                (errcode(ERRCODE_INTERNAL_ERROR),
-                 errmsg("pg_retry: unexpected error state")));
+        rc = WaitLatch(MyLatch, WL_LATCH_SET | WL_TIMEOUT | WL_EXIT_ON_PM_DEATH,
+                       PG_RETRY_ASYNC_IDLE_MS, pg_retry_async_wait_event);
+        if ((rc & WL_TIMEOUT) && async_worker_retire(slotno))
+            break;
     }
 
-    /* Should never reach here */
-    PG_RETURN_NULL();
+    proc_exit(0);
 }
 
 /*
@@ -493,6 +6382,19 @@ _PG_init(void)
                            NULL,
                            NULL);
 
+    DefineCustomIntVariable("pg_retry.default_deadline_ms",
+                           "Default total time budget in milliseconds for a call, attempts and backoff included",
+                           "0 means no deadline.",
+                           &pg_retry_default_deadline_ms,
+                           0,
+                           0,
+                           INT_MAX,
+                           PGC_SUSET,
+                           0,
+                           NULL,
+                           NULL,
+                           NULL);
+
     DefineCustomStringVariable("pg_retry.default_sqlstates",
                               "Default comma-separated list of SQLSTATEs to retry on",
                               NULL,
@@ -500,7 +6402,317 @@ _PG_init(void)
                               "40001,40P01,55P03,57014",
                               PGC_SUSET,
                               0,
-                              NULL,
-                              NULL,
+                              check_default_sqlstates,
+                              assign_default_sqlstates,
                               NULL);
+
+    DefineCustomEnumVariable("pg_retry.default_backoff_strategy",
+                            "Default backoff strategy between attempts",
+                            NULL,
+                            &pg_retry_default_backoff_strategy,
+                            BACKOFF_EXPONENTIAL,
+                            backoff_strategy_options,
+                            PGC_SUSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomEnumVariable("pg_retry.log_level",
+                            "Message level of retry reports",
+                            "off suppresses them, debug sends them to the server log at DEBUG1, warning also to the client.",
+                            &pg_retry_log_level,
+                            RETRY_LOG_WARNING,
+                            log_level_options,
+                            PGC_SUSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("pg_retry.log_summary_interval_ms",
+                            "Aggregate retry reports into one line per SQLSTATE per interval",
+                            "0 reports every failed attempt.",
+                            &pg_retry_log_summary_interval_ms,
+                            0,
+                            0,
+                            INT_MAX,
+                            PGC_SUSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomBoolVariable("pg_retry.plan_cache",
+                            "Cache prepared plans for retried statements across attempts and calls",
+                            NULL,
+                            &pg_retry_plan_cache_enabled,
+                            true,
+                            PGC_SUSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("pg_retry.plan_cache_size",
+                           "Maximum number of prepared plans kept per backend",
+                           NULL,
+                           &pg_retry_plan_cache_size,
+                           128,
+                           1,
+                           INT_MAX,
+                           PGC_SUSET,
+                           0,
+                           NULL,
+                           NULL,
+                           NULL);
+
+    DefineCustomBoolVariable("pg_retry.track_stats",
+                            "Collect cluster-wide retry statistics (requires shared_preload_libraries)",
+                            NULL,
+                            &pg_retry_track_stats,
+                            true,
+                            PGC_SUSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+#ifdef PG_RETRY_PGSTAT
+    DefineCustomIntVariable("pg_retry.stats_kind_id",
+                            "ID of the custom cumulative statistics kind holding the retry.stats() counters",
+                            "Pick an ID no other loaded extension uses; changing it discards the saved counters.",
+                            &pg_retry_stats_kind_id,
+                            PGSTAT_KIND_EXPERIMENTAL,
+                            PGSTAT_KIND_CUSTOM_MIN,
+                            PGSTAT_KIND_CUSTOM_MAX,
+                            PGC_POSTMASTER,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+#endif
+
+    DefineCustomBoolVariable("pg_retry.track_timing",
+                            "Collect histograms of the time spent in each phase of a retried call",
+                            "Shown by retry.phase_timings(); requires shared_preload_libraries.",
+                            &pg_retry_track_timing,
+                            false,
+                            PGC_SUSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("pg_retry.max_statements",
+                           "Maximum number of statements tracked in retry.statement_stats",
+                           NULL,
+                           &pg_retry_max_statements,
+                           1000,
+                           100,
+                           INT_MAX / 2,
+                           PGC_POSTMASTER,
+                           0,
+                           NULL,
+                           NULL,
+                           NULL);
+
+    DefineCustomBoolVariable("pg_retry.adaptive_backoff",
+                            "Stretch backoff delays by contention shared across backends (requires shared_preload_libraries)",
+                            NULL,
+                            &pg_retry_adaptive_backoff,
+                            false,
+                            PGC_SUSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomBoolVariable("pg_retry.wait_for_locks",
+                            "After a lock conflict, wait on the lock for the backoff delay instead of sleeping",
+                            NULL,
+                            &pg_retry_wait_for_locks,
+                            false,
+                            PGC_SUSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("pg_retry.breaker_threshold",
+                            "Retryable failures within the window that open a statement's circuit breaker",
+                            "0 disables circuit breakers.",
+                            &pg_retry_breaker_threshold,
+                            0,
+                            0,
+                            INT_MAX,
+                            PGC_SIGHUP,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("pg_retry.breaker_window_ms",
+                            "Window in which failures count towards opening a circuit breaker",
+                            NULL,
+                            &pg_retry_breaker_window_ms,
+                            10000,
+                            1,
+                            INT_MAX,
+                            PGC_SIGHUP,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("pg_retry.breaker_cooldown_ms",
+                            "Time an open circuit breaker waits before a probe may retry",
+                            NULL,
+                            &pg_retry_breaker_cooldown_ms,
+                            5000,
+                            0,
+                            INT_MAX,
+                            PGC_SIGHUP,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomRealVariable("pg_retry.retry_budget_ratio",
+                            "Retries allowed cluster-wide per first attempt (requires shared_preload_libraries)",
+                            "-1 disables the retry budget.",
+                            &pg_retry_retry_budget_ratio,
+                            -1.0,
+                            -1.0,
+                            1000.0,
+                            PGC_SIGHUP,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("pg_retry.retry_budget_burst",
+                            "Retries the retry budget can save up",
+                            NULL,
+                            &pg_retry_retry_budget_burst,
+                            100,
+                            1,
+                            1000000,
+                            PGC_SIGHUP,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomBoolVariable("pg_retry.auto",
+                            "Retry top-level data-modifying statements automatically",
+                            "Uses the pg_retry.default_* settings.",
+                            &pg_retry_auto,
+                            false,
+                            PGC_USERSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("pg_retry.subxact_warning_threshold",
+                            "Cached subtransaction IDs in a transaction at which pg_retry warns",
+                            "Warned once per transaction, also once the cache has overflowed; 0 disables the warning.",
+                            &pg_retry_subxact_warning_threshold,
+                            48,
+                            0,
+                            PGPROC_MAX_CACHED_SUBXIDS,
+                            PGC_USERSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("pg_retry.fairness_after_attempts",
+                            "Attempts after which a call goes ahead of fresh calls on the same statement (requires shared_preload_libraries)",
+                            "Later attempts hold a ticket while they run; first attempts wait up to pg_retry.fairness_wait_ms for them. 0 disables fairness.",
+                            &pg_retry_fairness_after_attempts,
+                            0,
+                            0,
+                            INT_MAX,
+                            PGC_SUSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("pg_retry.fairness_wait_ms",
+                            "Longest a first attempt waits for older retriers of the same statement",
+                            NULL,
+                            &pg_retry_fairness_wait_ms,
+                            10,
+                            0,
+                            1000,
+                            PGC_SUSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomBoolVariable("pg_retry.snapshot_fail_fast",
+                            "Give up at once on serialization failures under REPEATABLE READ or SERIALIZABLE",
+                            "Attempts inside such a transaction share its snapshot, so they would fail the same way.",
+                            &pg_retry_snapshot_fail_fast,
+                            true,
+                            PGC_USERSET,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("pg_retry.async_max_workers",
+                            "Maximum number of background workers running retry.retry_async() jobs",
+                            "Each worker serves the queue of one role in one database; 0 disables retry_async.",
+                            &pg_retry_async_max_workers,
+                            4,
+                            0,
+                            PG_RETRY_ASYNC_SLOTS,
+                            PGC_SIGHUP,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    DefineCustomIntVariable("pg_retry.async_batch_size",
+                            "Maximum number of queued jobs a background worker runs between configuration reloads",
+                            NULL,
+                            &pg_retry_async_batch_size,
+                            16,
+                            1,
+                            10000,
+                            PGC_SIGHUP,
+                            0,
+                            NULL,
+                            NULL,
+                            NULL);
+
+    prev_ExecutorRun = ExecutorRun_hook;
+    ExecutorRun_hook = pg_retry_ExecutorRun;
+
+    RegisterXactCallback(plan_cache_xact_callback, NULL);
+    RegisterSubXactCallback(plan_cache_subxact_callback, NULL);
+    CacheRegisterRelcacheCallback(policy_cache_relcache_callback, (Datum) 0);
+    RegisterXactCallback(stats_xact_callback, NULL);
+    RegisterXactCallback(async_xact_callback, NULL);
+
+    /* Shared counters are only available when preloaded by the postmaster */
+    if (process_shared_preload_libraries_in_progress)
+    {
+        prev_shmem_request_hook = shmem_request_hook;
+        shmem_request_hook = pg_retry_shmem_request;
+        prev_shmem_startup_hook = shmem_startup_hook;
+        shmem_startup_hook = pg_retry_shmem_startup;
+
+        /* Statement fingerprints come from core's query jumbling */
+        EnableQueryId();
+
+#ifdef PG_RETRY_PGSTAT
+        pgstat_register_kind(PG_RETRY_PGSTAT_KIND, &retry_pgstat_kind);
+#endif
+    }
 }
@@ -0,0 +1,283 @@
+"""Benchmark the pg_retry hot path with pgbench.
+
+Starts a disposable cluster (the same one the system tests use), runs each
+workload at every requested client count and writes one JSON document with
+TPS, latency percentiles, the per-call overhead of the retry wrapper and the
+attempts each successful call needed.
+
+Run from the repository root, after ``make install``::
+
+    python3 -m system_tests.bench.run_bench --clients 1,4,16 --duration 10
+"""
+
+from __future__ import annotations
+
+import argparse
+import json
+import platform
+import re
+import subprocess
+import sys
+import tempfile
+import time
+from dataclasses import dataclass, field
+from pathlib import Path
+
+import psycopg
+
+from ..cluster import ClusterEnvironmentError, PgTestCluster
+
+BENCH_SQL = Path(__file__).parent / "sql"
+PGBENCH_SQL = Path(__file__).parent.parent / "sql" / "pgbench"
+
+
+@dataclass
+class Workload:
+    name: str
+    scripts: list[Path]
+    # (plan name, SQLSTATE, failures) handed to retry.configure_failure_plan
+    failure_plan: tuple[str, str, int] | None = None
+    # The same work without the wrapper, to measure its per-call overhead
+    bare_script: Path | None = None
+    # pg_retry settings for this workload only
+    settings: dict[str, str] = field(default_factory=dict)
+
+
+WORKLOADS = [
+    Workload(
+        "no_failures",
+        [BENCH_SQL / "retry_select.sql"],
+        bare_script=BENCH_SQL / "bare_select.sql",
+    ),
+    Workload(
+        "deadlock",
+        [PGBENCH_SQL / "deadlock_ab.sql", PGBENCH_SQL / "deadlock_ba.sql"],
+        failure_plan=("pgbench_deadlock", "40P01", 32),
+    ),
+    Workload(
+        "lock_timeout",
+        [PGBENCH_SQL / "lock_timeout.sql"],
+        failure_plan=("pgbench_lock", "55P03", 12),
+    ),
+    Workload(
+        "injected",
+        [BENCH_SQL / "injected.sql"],
+        failure_plan=("bench_injected", "40001", 500),
+    ),
+    # Serialization failures inside REPEATABLE READ transactions, once failing
+    # fast and once repeating every attempt on the same snapshot
+    Workload(
+        "stale_snapshot",
+        [BENCH_SQL / "stale_snapshot.sql"],
+        settings={"pg_retry.snapshot_fail_fast": "on"},
+    ),
+    Workload(
+        "stale_snapshot_no_fail_fast",
+        [BENCH_SQL / "stale_snapshot.sql"],
+        settings={"pg_retry.snapshot_fail_fast": "off"},
+    ),
+]
+
+TPS_RE = re.compile(r"^tps = ([0-9.]+)", re.MULTILINE)
+FAILED_RE = re.compile(r"^number of failed transactions: ([0-9]+)", re.MULTILINE)
+
+
+def _percentile(sorted_values: list[float], pct: float) -> float | None:
+    if not sorted_values:
+        return None
+    index = min(len(sorted_values) - 1, int(round(pct / 100.0 * (len(sorted_values) - 1))))
+    return sorted_values[index]
+
+
+def _read_latencies_ms(log_dir: Path) -> list[float]:
+    """Per-transaction latencies from pgbench --log files, in milliseconds."""
+    latencies = []
+    for path in log_dir.glob("bench*"):
+        for line in path.read_text(encoding="utf-8").splitlines():
+            fields = line.split()
+            # client_id transaction_no time script_no time_epoch time_us
+            if len(fields) >= 3 and fields[2].isdigit():
+                latencies.append(int(fields[2]) / 1000.0)
+    latencies.sort()
+    return latencies
+
+
+def _run_pgbench(cluster: PgTestCluster, scripts: list[Path], clients: int, duration: int) -> dict:
+    """Run the scripts side by side, splitting the clients between them."""
+    with tempfile.TemporaryDirectory(prefix="pg_retry_bench_") as tmp:
+        log_dir = Path(tmp)
+        procs = []
+        per_script = max(1, clients // len(scripts))
+        for i, script in enumerate(scripts):
+            procs.append(
+                cluster.pgbench_process(
+                    script,
+                    clients=per_script,
+                    threads=min(per_script, 4),
+                    duration=duration,
+                    extra_args=["--log", f"--log-prefix={log_dir / f'bench{i}'}"],
+                )
+            )
+
+        tps = 0.0
+        failed = 0
+        for proc in procs:
+            stdout, stderr = proc.communicate()
+            if proc.returncode != 0:
+                raise RuntimeError(f"pgbench failed ({proc.returncode}): {stderr}\n{stdout}")
+            match = TPS_RE.search(stdout)
+            if match:
+                tps += float(match.group(1))
+            match = FAILED_RE.search(stdout)
+            if match:
+                failed += int(match.group(1))
+
+        latencies = _read_latencies_ms(log_dir)
+
+    return {
+        "clients": per_script * len(scripts),
+        "transactions": len(latencies),
+        "failed_transactions": failed,
+        "tps": round(tps, 2),
+        "latency_ms": {
+            "mean": round(sum(latencies) / len(latencies), 4) if latencies else None,
+            "p50": _percentile(latencies, 50),
+            "p99": _percentile(latencies, 99),
+        },
+    }
+
+
+def _retry_stats(dsn: str) -> dict:
+    with psycopg.connect(dsn, autocommit=True) as conn:
+        row = conn.execute(
+            "SELECT calls, attempts, successes, retries, exhausted, budget_denied, sleep_time_ms "
+            "FROM retry.stats()"
+        ).fetchone()
+    calls, attempts, successes, retries, exhausted, budget_denied, sleep_ms = row
+    return {
+        "calls": calls,
+        "attempts": attempts,
+        "successes": successes,
+        "retries": retries,
+        "exhausted": exhausted,
+        "budget_denied": budget_denied,
+        "sleep_time_ms": sleep_ms,
+        "attempts_per_call": round(attempts / calls, 4) if calls else None,
+        "attempts_per_success": round(attempts / successes, 4) if successes else None,
+    }
+
+
+def _apply_settings(cluster: PgTestCluster, settings: dict[str, str], reset: bool = False) -> None:
+    if not settings:
+        return
+    for name, value in settings.items():
+        if reset:
+            cluster.run_sql(f"ALTER SYSTEM RESET {name}")
+        else:
+            cluster.run_sql(f"ALTER SYSTEM SET {name} = '{value}'")
+    cluster.run_sql("SELECT pg_reload_conf()")
+
+
+def _prepare(cluster: PgTestCluster, workload: Workload) -> None:
+    cluster.run_sql("SELECT retry.reset_accounts()")
+    cluster.run_sql("SELECT retry.reset_failure_plans()")
+    if workload.failure_plan:
+        name, sqlstate, failures = workload.failure_plan
+        cluster.run_sql(
+            f"SELECT retry.configure_failure_plan('{name}', '{sqlstate}', {failures})"
+        )
+    cluster.run_sql("SELECT retry.stats_reset()")
+
+
+def run(args: argparse.Namespace) -> dict:
+    base = Path(tempfile.mkdtemp(prefix="pg_retry_bench_cluster_"))
+    cluster = PgTestCluster(base)
+    try:
+        cluster.start()
+        if not cluster.pgbench_available():
+            raise ClusterEnvironmentError("pgbench binary not found in PATH or pg_config --bindir")
+
+        # The test cluster logs every statement, which would swamp the numbers
+        cluster.run_sql("ALTER SYSTEM SET log_statement = 'none'")
+        cluster.run_sql(f"ALTER SYSTEM SET pg_retry.log_level = '{args.log_level}'")
+        cluster.run_sql("SELECT pg_reload_conf()")
+
+        selected = set(args.workloads.split(",")) if args.workloads else None
+        results = []
+        for workload in WORKLOADS:
+            if selected is not None and workload.name not in selected:
+                continue
+            _apply_settings(cluster, workload.settings)
+            for clients in args.clients:
+                print(f"{workload.name}: {clients} clients", file=sys.stderr)
+
+                entry = {"workload": workload.name}
+                if workload.bare_script is not None:
+                    _prepare(cluster, workload)
+                    entry["bare"] = _run_pgbench(cluster, [workload.bare_script], clients, args.duration)
+
+                _prepare(cluster, workload)
+                entry.update(_run_pgbench(cluster, workload.scripts, clients, args.duration))
+                entry["retry"] = _retry_stats(cluster.dsn())
+
+                if "bare" in entry and entry["latency_ms"]["mean"] is not None \
+                        and entry["bare"]["latency_ms"]["mean"] is not None:
+                    entry["wrapper_overhead_us"] = round(
+                        (entry["latency_ms"]["mean"] - entry["bare"]["latency_ms"]["mean"]) * 1000.0, 2
+                    )
+                results.append(entry)
+            _apply_settings(cluster, workload.settings, reset=True)
+
+        return {
+            "timestamp": time.strftime("%Y-%m-%dT%H:%M:%SZ", time.gmtime()),
+            "host": platform.node(),
+            "server_version": subprocess.check_output(
+                [str(cluster.bindir / "postgres"), "--version"], text=True
+            ).strip(),
+            "duration_s": args.duration,
+            "results": results,
+        }
+    finally:
+        cluster.destroy()
+
+
+def main(argv: list[str] | None = None) -> int:
+    parser = argparse.ArgumentParser(description=__doc__.splitlines()[0])
+    parser.add_argument(
+        "--clients",
+        type=lambda s: [int(c) for c in s.split(",")],
+        default=[1, 4, 16],
+        help="comma-separated client counts (default: 1,4,16)",
+    )
+    parser.add_argument("--duration", type=int, default=10, help="seconds per run (default: 10)")
+    parser.add_argument(
+        "--workloads",
+        default=None,
+        help="comma-separated subset of: " + ", ".join(w.name for w in WORKLOADS),
+    )
+    parser.add_argument(
+        "--log-level",
+        default="off",
+        choices=["off", "debug", "warning"],
+        help="pg_retry.log_level during the runs (default: off)",
+    )
+    parser.add_argument(
+        "--output",
+        default="bench_results.json",
+        help="where to write the JSON results (default: bench_results.json)",
+    )
+    args = parser.parse_args(argv)
+
+    try:
+        report = run(args)
+    except ClusterEnvironmentError as exc:
+        print(f"cannot run the benchmark: {exc}", file=sys.stderr)
+        return 1
+
+    Path(args.output).write_text(json.dumps(report, indent=2) + "\n", encoding="utf-8")
+    print(f"wrote {args.output}", file=sys.stderr)
+    return 0
+
+
+if __name__ == "__main__":
+    sys.exit(main())
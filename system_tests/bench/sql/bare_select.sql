@@ -0,0 +1,2 @@
+\set aid random(1, 3)
+SELECT balance FROM retry.accounts WHERE id = :aid;
@@ -0,0 +1 @@
+SELECT retry.retry('SELECT retry.execute_failure_plan(''bench_injected'')', 8, 1, 20);
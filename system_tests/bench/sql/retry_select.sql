@@ -0,0 +1,2 @@
+\set aid random(1, 3)
+SELECT retry.retry_params('SELECT balance FROM retry.accounts WHERE id = $1', ARRAY[:aid]);
@@ -0,0 +1,5 @@
+\set id random(1, 3)
+BEGIN ISOLATION LEVEL REPEATABLE READ;
+SELECT balance FROM retry.accounts WHERE id = :id;
+SELECT retry.retry('UPDATE retry.accounts SET balance = balance WHERE id = ' || :id, 8, 1, 20);
+END;
@@ -166,7 +166,7 @@ class PgTestCluster:
             log_min_messages = warning
             log_line_prefix = '%t [%p]: [%l-1] user=%u,db=%d,app=%a,client=%h '
             log_statement = 'all'
-            session_preload_libraries = 'pg_retry'
+            shared_preload_libraries = 'pg_retry'
             fsync = off
             synchronous_commit = off
             full_page_writes = off
@@ -0,0 +1,134 @@
+"""
+Test Validate below things:
+- retry.retry_async() jobs run in a background worker once the caller commits
+- the worker retries with the policy of the call and records the attempts
+- a job that exhausts its retries is marked failed with its SQLSTATE
+- jobs queued in a transaction that rolls back never run
+- a job whose settings cannot be decoded is marked failed and the next job still runs
+- roles cannot write to the queue directly, nor queue jobs they could not log in to run
+"""
+
+from __future__ import annotations
+
+import time
+
+import psycopg
+import pytest
+
+from .utils import fetch_scalar
+
+
+def _wait_for_job(dsn: str, job_id: int, timeout: float = 30.0) -> dict:
+    deadline = time.monotonic() + timeout
+    with psycopg.connect(dsn, autocommit=True) as conn:
+        while True:
+            with conn.cursor() as cur:
+                cur.execute("SELECT * FROM retry.async_status(%s)", (job_id,))
+                columns = [col.name for col in cur.description]
+                status = dict(zip(columns, cur.fetchone()))
+            if status["status"] != "queued":
+                return status
+            assert time.monotonic() < deadline, f"job {job_id} still queued"
+            time.sleep(0.1)
+
+
+def test_async_job_is_retried_by_a_worker(conn, dsn):
+    with conn.cursor() as cur:
+        cur.execute("SELECT retry.configure_failure_plan('async_ok', '40001', 2)")
+        cur.execute(
+            "SELECT retry.retry_async(%s, 5, 1, 5)",
+            ("SELECT retry.execute_failure_plan('async_ok')",),
+        )
+        job_id = cur.fetchone()[0]
+
+    status = _wait_for_job(dsn, job_id)
+    assert status["status"] == "succeeded"
+    assert status["attempts"] == 3
+    assert status["rows_processed"] == 1
+    assert status["started_at"] >= status["enqueued_at"]
+
+
+def test_async_job_failure_is_recorded(conn, dsn):
+    with conn.cursor() as cur:
+        cur.execute(
+            "SELECT retry.retry_async('SELECT 1 / 0', 2, 1, 1, ARRAY['22012'])"
+        )
+        job_id = cur.fetchone()[0]
+
+    status = _wait_for_job(dsn, job_id)
+    assert status["status"] == "failed"
+    assert status["last_sqlstate"] == "22012"
+    assert "division by zero" in status["last_error"]
+
+
+def test_async_jobs_of_a_rolled_back_transaction_never_run(conn, dsn):
+    with conn.cursor() as cur:
+        cur.execute("CREATE TABLE IF NOT EXISTS async_audit (note text)")
+        cur.execute("TRUNCATE async_audit")
+
+    with psycopg.connect(dsn) as other:
+        with other.cursor() as cur:
+            cur.execute(
+                "SELECT retry.retry_async(%s)",
+                ("INSERT INTO async_audit VALUES ('rolled back')",),
+            )
+            rolled_back = cur.fetchone()[0]
+        other.rollback()
+
+    with conn.cursor() as cur:
+        cur.execute(
+            "SELECT retry.retry_async(%s)",
+            ("INSERT INTO async_audit VALUES ('committed')",),
+        )
+        committed = cur.fetchone()[0]
+
+    assert _wait_for_job(dsn, committed)["status"] == "succeeded"
+    assert fetch_scalar(dsn, f"SELECT count(*) FROM retry.async_status({rolled_back})") == 0
+    assert fetch_scalar(dsn, "SELECT string_agg(note, ',') FROM async_audit") == "committed"
+
+
+def test_undecodable_job_is_marked_failed(conn, dsn):
+    with psycopg.connect(dsn) as other:
+        with other.cursor() as cur:
+            cur.execute("SELECT retry.retry_async('SELECT 1')")
+            broken = cur.fetchone()[0]
+            # Only the table owner can do this; the worker must still cope
+            cur.execute(
+                "UPDATE retry.async_job SET sqlstate_policy = '{\"bad\": {}}' WHERE id = %s",
+                (broken,),
+            )
+            cur.execute("SELECT retry.retry_async('SELECT 2')")
+            healthy = cur.fetchone()[0]
+        other.commit()
+
+    status = _wait_for_job(dsn, broken)
+    assert status["status"] == "failed"
+    assert status["last_sqlstate"] == "22023"
+    assert _wait_for_job(dsn, healthy)["status"] == "succeeded"
+
+
+def test_roles_cannot_write_the_queue_directly(conn):
+    with conn.cursor() as cur:
+        cur.execute("DROP ROLE IF EXISTS async_intruder")
+        cur.execute("DROP ROLE IF EXISTS async_nologin")
+        cur.execute("CREATE ROLE async_intruder LOGIN")
+        cur.execute("CREATE ROLE async_nologin NOLOGIN")
+        try:
+            cur.execute("SET ROLE async_intruder")
+            with pytest.raises(psycopg.errors.InsufficientPrivilege):
+                cur.execute(
+                    "INSERT INTO retry.async_job (userid, sql, max_tries, base_delay_ms, "
+                    "max_delay_ms, retry_sqlstates, strategy, deadline_ms) "
+                    "VALUES (10, 'SELECT 1', 1, 0, 0, '{}', 'exponential', 0)"
+                )
+            with pytest.raises(psycopg.errors.InsufficientPrivilege):
+                cur.execute("UPDATE retry.async_job SET status = 'queued'")
+
+            cur.execute("SET ROLE async_nologin")
+            with pytest.raises(psycopg.errors.InsufficientPrivilege) as excinfo:
+                cur.execute("SELECT retry.retry_async('SELECT 1')")
+            assert "cannot log in" in str(excinfo.value)
+        finally:
+            cur.execute("RESET ROLE")
+            cur.execute("DROP ROLE async_intruder")
+            cur.execute("DROP ROLE async_nologin")
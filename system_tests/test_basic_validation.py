@@ -23,7 +23,8 @@ def test_extension_files_exist():
 
     required_files = [
         f'{base_path}/extension_sql/pg_retry.sql',
-        f'{base_path}/extension_sql/pg_retry--1.0.0.sql',
+        f'{base_path}/extension_sql/pg_retry--1.1.0.sql',
+        f'{base_path}/extension_sql/pg_retry--1.0.0--1.1.0.sql',
         f'{base_path}/src/pg_retry.c',
         f'{base_path}/pg_retry.control',
         f'{base_path}/META.json',
@@ -55,7 +56,7 @@ def test_control_file():
     version_match = re.search(r'default_version\s*=\s*[\'"]?([^\'"\s]+)', content)
     assert version_match, "Could not find version in control file"
     version = version_match.group(1)
-    assert version == '1.0.0', f"Control file version should be 1.0.0, got {version}"
+    assert version == '1.1.0', f"Control file version should be 1.1.0, got {version}"
 
     print("✅ Control file validation passed")
 
@@ -71,7 +72,7 @@ def test_meta_json():
         assert key in meta, f"META.json missing required key: {key}"
 
     assert meta['name'] == 'pg_retry', f"Expected name 'pg_retry', got {meta['name']}"
-    assert meta['version'] == '1.0.0', f"Expected version '1.0.0', got {meta['version']}"
+    assert meta['version'] == '1.1.0', f"Expected version '1.1.0', got {meta['version']}"
 
     # Check provides section
     assert 'provides' in meta, "META.json missing provides section"
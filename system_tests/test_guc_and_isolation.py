@@ -6,6 +6,10 @@ Test Validate below things:
 - No connection leaks - Proper cleanup after retries
 - Exponential backoff works - Delays prevent lock storm
 - Extension handles timeouts correctly - lock_timeout settings respected
+- pg_retry.wait_for_locks queues on the lock instead of sleeping blindly
+- pg_retry.wait_for_locks keeps the backoff sleep after a NOWAIT failure
+- Serialization failures on a REPEATABLE READ snapshot fail fast instead of repeating
+- A deadline bounds a call's attempts and backoff sleeps together
 """
 
 from __future__ import annotations
@@ -16,6 +20,8 @@ import time
 import psycopg
 import pytest
 
+from .utils import fetch_scalar
+
 
 def test_guc_defaults_drive_retry_limits(conn):
     with conn.cursor() as cur:
@@ -110,3 +116,121 @@ def test_lock_timeouts_are_retried_in_all_isolation_levels(pg_cluster, dsn, isol
             idle_in_tx = cur.fetchone()[0]
 
     assert idle_in_tx == 0
+
+
+def test_wait_for_locks_wakes_when_blocker_commits(dsn):
+    released = threading.Event()
+
+    def hold_lock():
+        with psycopg.connect(dsn) as locker:
+            with locker.cursor() as cur:
+                cur.execute("LOCK TABLE retry.accounts IN ACCESS EXCLUSIVE MODE")
+                time.sleep(0.4)
+                locker.commit()
+                released.set()
+
+    blocker = threading.Thread(target=hold_lock)
+    blocker.start()
+    time.sleep(0.05)
+
+    try:
+        with psycopg.connect(dsn, autocommit=True) as conn:
+            with conn.cursor() as cur:
+                cur.execute("SET lock_timeout = '50ms'")
+                cur.execute("SET pg_retry.wait_for_locks = on")
+                started = time.monotonic()
+                # a blind 2 s sleep would be needed otherwise; the lock wait
+                # ends as soon as the blocker commits
+                cur.execute(
+                    "SELECT retry.retry(%s, 2, 2000, 2000, NULL, 'constant')",
+                    ("UPDATE retry.accounts SET balance = balance WHERE id = 1",),
+                )
+                assert cur.fetchone()[0] == 1
+                elapsed = time.monotonic() - started
+    finally:
+        blocker.join()
+
+    assert released.is_set()
+    assert elapsed < 1.5
+
+
+def test_wait_for_locks_keeps_backoff_after_nowait(dsn):
+    locked = threading.Event()
+    done = threading.Event()
+
+    def hold_lock():
+        with psycopg.connect(dsn) as locker:
+            with locker.cursor() as cur:
+                cur.execute("SELECT id FROM retry.accounts WHERE id = 1 FOR UPDATE")
+                locked.set()
+                done.wait(5)
+                locker.commit()
+
+    blocker = threading.Thread(target=hold_lock)
+    blocker.start()
+    locked.wait(5)
+
+    try:
+        with psycopg.connect(dsn, autocommit=True) as conn:
+            with conn.cursor() as cur:
+                cur.execute("SELECT retry.stats_reset()")
+                cur.execute("SET pg_retry.wait_for_locks = on")
+                started = time.monotonic()
+                # NOWAIT ignores lock_timeout, so the lock wait cannot stand
+                # in for the sleeps between the four attempts
+                with pytest.raises(psycopg.errors.LockNotAvailable):
+                    cur.execute(
+                        "SELECT retry.retry(%s, 4, 100, 100, ARRAY['55P03'], 'constant')",
+                        ("SELECT id FROM retry.accounts WHERE id = 1 FOR UPDATE NOWAIT",),
+                    )
+                elapsed = time.monotonic() - started
+    finally:
+        done.set()
+        blocker.join()
+
+    assert fetch_scalar(dsn, "SELECT attempts FROM retry.stats()") == 4
+    assert elapsed >= 0.25
+
+
+def test_deadline_bounds_attempts_and_backoff(conn):
+    with conn.cursor() as cur:
+        cur.execute("SELECT retry.stats_reset()")
+        cur.execute("SELECT retry.configure_failure_plan('deadline_serial', '40001', 1000)")
+        started = time.monotonic()
+        with pytest.raises(psycopg.errors.SerializationFailure):
+            cur.execute(
+                "SELECT retry.retry(%s, 1000, 50, 50, NULL, 'constant', 300)",
+                ("SELECT retry.execute_failure_plan('deadline_serial')",),
+            )
+        elapsed = time.monotonic() - started
+        cur.execute("SELECT attempts FROM retry.stats()")
+        attempts = cur.fetchone()[0]
+
+    # 300 ms leave room for a handful of 50 ms sleeps, not for 1000 attempts
+    assert 2 <= attempts <= 10
+    assert elapsed < 2.0
+
+
+@pytest.mark.parametrize("fail_fast, attempts", [("on", 1), ("off", 4)])
+def test_stale_snapshot_serialization_failures_fail_fast(dsn, fail_fast, attempts):
+    with psycopg.connect(dsn, autocommit=True) as conn:
+        with conn.cursor() as cur:
+            cur.execute("SELECT retry.stats_reset()")
+            cur.execute(f"SET pg_retry.snapshot_fail_fast = {fail_fast}")
+            cur.execute("BEGIN ISOLATION LEVEL REPEATABLE READ")
+            cur.execute("SELECT balance FROM retry.accounts WHERE id = 1")
+
+            # A concurrent update the snapshot will never see
+            with psycopg.connect(dsn, autocommit=True) as other:
+                other.execute("UPDATE retry.accounts SET balance = balance WHERE id = 1")
+
+            with pytest.raises(psycopg.errors.SerializationFailure) as excinfo:
+                cur.execute(
+                    "SELECT retry.retry(%s, 4, 1, 5)",
+                    ("UPDATE retry.accounts SET balance = balance WHERE id = 1",),
+                )
+            cur.execute("ROLLBACK")
+
+    hint = excinfo.value.diag.message_hint or ""
+    assert ("retry the whole transaction" in hint) == (fail_fast == "on")
+    assert fetch_scalar(dsn, "SELECT attempts FROM retry.stats()") == attempts
@@ -1,7 +1,12 @@
 from __future__ import annotations
 
 import random
+import time
 from concurrent.futures import ThreadPoolExecutor
+
+import psycopg
+import pytest
+
 from .utils import fetch_scalar, run_retry_sql
 
 
@@ -46,3 +51,127 @@ def test_concurrent_deadlocks_are_retried(pg_cluster):
         """,
     )
     assert deadlocks_after > deadlocks_before
+
+
+def test_cancel_interrupts_backoff_sleep(pg_cluster):
+    """A backend sleeping in backoff is visible and cancels immediately."""
+    dsn = pg_cluster.dsn()
+    pg_cluster.run_sql("SELECT retry.configure_failure_plan('long_backoff', '40001', 5)")
+
+    def sleeper():
+        with psycopg.connect(dsn, autocommit=True) as conn:
+            with conn.cursor() as cur:
+                cur.execute(
+                    "SELECT retry.retry(%s, 3, 60000, 60000)",
+                    ("SELECT retry.execute_failure_plan('long_backoff')",),
+                )
+
+    with ThreadPoolExecutor(max_workers=1) as pool:
+        future = pool.submit(sleeper)
+
+        pid = None
+        deadline = time.monotonic() + 10
+        while pid is None and time.monotonic() < deadline:
+            pid = fetch_scalar(
+                dsn,
+                """
+                SELECT pid FROM pg_stat_activity
+                WHERE wait_event_type = 'Extension' AND wait_event = 'PgRetryBackoff'
+                """,
+            )
+            time.sleep(0.05)
+        assert pid is not None
+
+        started = time.monotonic()
+        assert fetch_scalar(dsn, f"SELECT pg_cancel_backend({pid})")
+        with pytest.raises(psycopg.errors.QueryCanceled):
+            future.result(timeout=10)
+        assert time.monotonic() - started < 5
+
+
+def _wait_for_wait_event(dsn: str, wait_event: str, timeout: float = 10.0):
+    deadline = time.monotonic() + timeout
+    while time.monotonic() < deadline:
+        pid = fetch_scalar(
+            dsn,
+            f"SELECT pid FROM pg_stat_activity WHERE wait_event = '{wait_event}'",
+        )
+        if pid is not None:
+            return pid
+        time.sleep(0.02)
+    return None
+
+
+@pytest.mark.parametrize("plan_cache", ["on", "off"])
+def test_fresh_calls_yield_to_older_retriers(pg_cluster, plan_cache):
+    """With fairness on, a first attempt waits for a late attempt of the same statement.
+
+    Neither session has the statement prepared beforehand, so the retrier's
+    ticket is taken after its plan is cached while the fresh call waits before
+    preparing it.
+    """
+    dsn = pg_cluster.dsn()
+    statement = "SELECT retry.execute_failure_plan('fairness'), pg_sleep(1)"
+    fairness = (
+        "SET pg_retry.fairness_after_attempts = 1; SET pg_retry.fairness_wait_ms = 1000; "
+        f"SET pg_retry.plan_cache = {plan_cache}"
+    )
+
+    with psycopg.connect(dsn, autocommit=True) as fresh:
+        fresh.execute(fairness)
+        pg_cluster.run_sql("SELECT retry.configure_failure_plan('fairness', '40001', 1)")
+
+        def retrier():
+            with psycopg.connect(dsn, autocommit=True) as conn:
+                conn.execute(fairness)
+                conn.execute("SELECT retry.retry(%s, 3, 1, 1)", (statement,))
+                return time.monotonic()
+
+        def fresh_call():
+            fresh.execute("SELECT retry.retry(%s, 3, 1, 1)", (statement,))
+            return time.monotonic()
+
+        with ThreadPoolExecutor(max_workers=2) as pool:
+            retrier_done = pool.submit(retrier)
+            # The second attempt holds the ticket while it sleeps
+            assert _wait_for_wait_event(dsn, "PgSleep") is not None
+
+            fresh_done = pool.submit(fresh_call)
+            assert _wait_for_wait_event(dsn, "PgRetryFairness") is not None
+
+            assert retrier_done.result(timeout=30) <= fresh_done.result(timeout=30)
+
+
+def _xact_transfer(first_id: int, second_id: int) -> list[str]:
+    """Read-then-write transfer, locking the two rows in the given order."""
+    return [
+        f"SELECT balance FROM retry.accounts WHERE id = {first_id} FOR UPDATE",
+        "SELECT pg_sleep(0.02)",
+        f"SELECT balance FROM retry.accounts WHERE id = {second_id} FOR UPDATE",
+        f"UPDATE retry.accounts SET balance = balance - 1 WHERE id = {first_id}",
+        f"UPDATE retry.accounts SET balance = balance + 1 WHERE id = {second_id}",
+        "INSERT INTO retry.transfer_history (op, first_id, second_id, amount) "
+        f"VALUES ('xact', {first_id}, {second_id}, 1)",
+    ]
+
+
+def test_retry_xact_reruns_deadlocked_groups_as_a_unit(pg_cluster):
+    """Transfers that lock rows in opposite orders all commit exactly once."""
+    dsn = pg_cluster.dsn()
+    groups = [_xact_transfer(1, 2), _xact_transfer(2, 1)] * 6
+
+    def run_group(statements):
+        with psycopg.connect(dsn, autocommit=True) as conn:
+            return conn.execute(
+                "SELECT retry.retry_xact(%s, 16, 5, 250)", (statements,)
+            ).fetchone()[0]
+
+    with ThreadPoolExecutor(max_workers=len(groups)) as pool:
+        futures = [pool.submit(run_group, group) for group in groups]
+        rows = [future.result(timeout=60) for future in futures]
+
+    # Two rows locked, two updated, one inserted, plus the pg_sleep row
+    assert rows == [6] * len(groups)
+    assert fetch_scalar(dsn, "SELECT count(*) FROM retry.transfer_history WHERE op = 'xact'") == len(groups)
+    assert fetch_scalar(dsn, "SELECT sum(balance) FROM retry.accounts") == 3000
+    assert fetch_scalar(dsn, "SELECT balance FROM retry.accounts WHERE id = 1") == 1000
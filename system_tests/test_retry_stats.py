@@ -0,0 +1,218 @@
+"""
+Test Validate below things:
+- retry.stats() counts calls, attempts, retries and exhausted calls
+- retry.sqlstate_stats() breaks retryable failures down by SQLSTATE
+- retry.stats_reset() zeroes the counters
+- an empty retry budget makes a call fail fast and is counted
+- a circuit breaker opens after repeated failures and a probe closes it
+- pg_retry.track_timing fills the retry.phase_timings() histograms
+"""
+
+from __future__ import annotations
+
+import psycopg
+import pytest
+
+from .utils import fetch_scalar, server_settings
+
+
+def _stats(dsn: str) -> dict:
+    with psycopg.connect(dsn, autocommit=True) as conn:
+        with conn.cursor() as cur:
+            cur.execute("SELECT * FROM retry.stats()")
+            columns = [col.name for col in cur.description]
+            return dict(zip(columns, cur.fetchone()))
+
+
+def test_stats_count_retries_and_successes(conn, dsn):
+    with conn.cursor() as cur:
+        cur.execute("SELECT retry.stats_reset()")
+        cur.execute("SELECT retry.configure_failure_plan('stats_ok', '40001', 2)")
+        cur.execute(
+            "SELECT retry.retry(%s, 3, 1, 5)",
+            ("SELECT retry.execute_failure_plan('stats_ok')",),
+        )
+
+    stats = _stats(dsn)
+    assert stats["calls"] == 1
+    assert stats["attempts"] == 3
+    assert stats["successes"] == 1
+    assert stats["retries"] == 2
+    assert stats["exhausted"] == 0
+    assert stats["sleep_time_ms"] > 0
+
+    retries = fetch_scalar(
+        dsn, "SELECT retries FROM retry.sqlstate_stats() WHERE sqlstate = '40001'"
+    )
+    assert retries == 2
+
+
+def test_stats_count_exhausted_and_non_retryable(conn, dsn):
+    with conn.cursor() as cur:
+        cur.execute("SELECT retry.stats_reset()")
+        cur.execute("SELECT retry.configure_failure_plan('stats_fail', '40P01', 5)")
+        with pytest.raises(psycopg.errors.DeadlockDetected):
+            cur.execute(
+                "SELECT retry.retry(%s, 2, 1, 5)",
+                ("SELECT retry.execute_failure_plan('stats_fail')",),
+            )
+        with pytest.raises(psycopg.errors.DivisionByZero):
+            cur.execute("SELECT retry.retry('SELECT 1/0')")
+
+    stats = _stats(dsn)
+    assert stats["calls"] == 2
+    assert stats["successes"] == 0
+    assert stats["exhausted"] == 1
+    assert stats["non_retryable"] == 1
+
+    exhausted = fetch_scalar(
+        dsn, "SELECT exhausted FROM retry.sqlstate_stats() WHERE sqlstate = '40P01'"
+    )
+    assert exhausted == 1
+
+
+def test_stats_reset_clears_counters(conn, dsn):
+    with conn.cursor() as cur:
+        cur.execute("SELECT retry.retry('SELECT 1')")
+        cur.execute("SELECT retry.stats_reset()")
+
+    stats = _stats(dsn)
+    assert stats["calls"] == 0
+    assert stats["attempts"] == 0
+    assert fetch_scalar(dsn, "SELECT count(*) FROM retry.sqlstate_stats()") == 0
+
+
+def test_statement_stats_group_by_fingerprint(conn, dsn):
+    with conn.cursor() as cur:
+        cur.execute("SELECT retry.statement_stats_reset()")
+        cur.execute("SELECT retry.configure_failure_plan('stmt_stats', '40001', 1)")
+        cur.execute(
+            "SELECT retry.retry(%s, 3, 1, 5)",
+            ("SELECT retry.execute_failure_plan('stmt_stats')",),
+        )
+        # same statement shape with different constants shares one entry
+        cur.execute("SELECT retry.retry('SELECT 1 + 1')")
+        cur.execute("SELECT retry.retry('SELECT 2 + 2')")
+
+    with psycopg.connect(dsn, autocommit=True) as other:
+        with other.cursor() as cur:
+            cur.execute(
+                """
+                SELECT calls, attempts, successes, failures_by_sqlstate,
+                       backoff_histogram, p50_exec_time_ms
+                FROM retry.statement_stats
+                WHERE query LIKE '%%execute_failure_plan%%'
+                """
+            )
+            calls, attempts, successes, failures, backoff, p50 = cur.fetchone()
+            assert (calls, attempts, successes) == (1, 2, 1)
+            assert failures == {"40001": 1}
+            assert len(backoff) == 12
+            assert sum(backoff) == 1
+            assert p50 is not None
+
+            cur.execute(
+                "SELECT calls FROM retry.statement_stats WHERE query LIKE 'SELECT %% + %%'"
+            )
+            assert cur.fetchall() == [(2,)]
+
+
+def test_retry_budget_denies_retries_when_empty(conn, dsn):
+    # no deposits and room for a single saved-up retry
+    with server_settings(conn, retry_budget_ratio=0, retry_budget_burst=1):
+        with conn.cursor() as cur:
+            cur.execute("SELECT retry.stats_reset()")
+            cur.execute("SELECT retry.configure_failure_plan('budget', '40001', 5)")
+            with pytest.raises(psycopg.errors.SerializationFailure):
+                cur.execute(
+                    "SELECT retry.retry(%s, 5, 1, 5)",
+                    ("SELECT retry.execute_failure_plan('budget')",),
+                )
+
+    stats = _stats(dsn)
+    assert stats["calls"] == 1
+    assert stats["attempts"] <= 2
+    assert stats["budget_denied"] == 1
+    assert stats["exhausted"] == 1
+
+
+def _breaker(dsn: str) -> tuple:
+    with psycopg.connect(dsn, autocommit=True) as conn:
+        with conn.cursor() as cur:
+            cur.execute(
+                """
+                SELECT breaker_state, breaker_opens FROM retry.statement_stats
+                WHERE query LIKE '%%execute_failure_plan%%'
+                """
+            )
+            return cur.fetchone()
+
+
+def test_circuit_breaker_opens_and_probe_closes(conn, dsn):
+    with server_settings(conn, breaker_threshold=2):
+        with server_settings(conn, breaker_cooldown_ms=600000):
+            with conn.cursor() as cur:
+                cur.execute("SELECT retry.statement_stats_reset()")
+                cur.execute("SELECT retry.configure_failure_plan('breaker', '40001', 10)")
+                # the second failure opens the breaker and ends the call
+                with pytest.raises(psycopg.errors.SerializationFailure):
+                    cur.execute(
+                        "SELECT retry.retry(%s, 5, 1, 5)",
+                        ("SELECT retry.execute_failure_plan('breaker')",),
+                    )
+                # while open, a call gets its single attempt only
+                with pytest.raises(psycopg.errors.SerializationFailure):
+                    cur.execute(
+                        "SELECT retry.retry(%s, 5, 1, 5)",
+                        ("SELECT retry.execute_failure_plan('breaker')",),
+                    )
+            assert _breaker(dsn) == ("open", 1)
+            assert fetch_scalar(
+                dsn,
+                "SELECT attempts FROM retry.statement_stats "
+                "WHERE query LIKE '%%execute_failure_plan%%'",
+            ) == 3
+
+        # once cooled down the next failing call probes and closes it
+        with server_settings(conn, breaker_cooldown_ms=0):
+            with conn.cursor() as cur:
+                cur.execute("SELECT retry.configure_failure_plan('breaker', '40001', 1)")
+                cur.execute(
+                    "SELECT retry.retry(%s, 5, 1, 5)",
+                    ("SELECT retry.execute_failure_plan('breaker')",),
+                )
+            assert _breaker(dsn) == ("closed", 1)
+
+
+def test_phase_timings_cover_each_phase(conn, dsn):
+    with conn.cursor() as cur:
+        cur.execute("SELECT retry.stats_reset()")
+        cur.execute("SET pg_retry.track_timing = on")
+        cur.execute("SELECT retry.configure_failure_plan('timing', '40001', 1)")
+        cur.execute(
+            "SELECT retry.retry(%s, 3, 10, 10, NULL, 'constant')",
+            ("SELECT retry.execute_failure_plan('timing')",),
+        )
+        cur.execute("RESET pg_retry.track_timing")
+
+        cur.execute("SELECT phase, sum(count) FROM retry.phase_timings() GROUP BY phase")
+        counts = dict(cur.fetchall())
+
+    # Two attempts: the failed one rolled back, then a backoff before the second
+    assert counts["spi_connect"] == 1
+    assert counts["prepare"] >= 1
+    assert counts["subxact_begin"] == 2
+    assert counts["execute"] == 1
+    assert counts["subxact_release"] == 1
+    assert counts["error_rollback"] == 1
+    assert counts["backoff"] == 1
+
+    backoff_lower = fetch_scalar(
+        dsn, "SELECT min(bucket_lower_us) FROM retry.phase_timings() WHERE phase = 'backoff'"
+    )
+    # The 10 ms sleep lands in the [8192, 10240) us bucket or above
+    assert backoff_lower >= 8192
+
+    with conn.cursor() as cur:
+        cur.execute("SELECT retry.stats_reset()")
+    assert fetch_scalar(dsn, "SELECT count(*) FROM retry.phase_timings()") == 0
@@ -2,6 +2,8 @@ from __future__ import annotations
 
 import random
 import time
+from contextlib import contextmanager
+from typing import Iterator
 
 import psycopg
 
@@ -29,3 +31,43 @@ def fetch_scalar(dsn: str, sql: str):
             cur.execute(sql)
             row = cur.fetchone()
             return row[0] if row else None
+
+
+def _wait_for_reload(cur, done_sql: str, params: tuple, timeout: float = 10.0) -> None:
+    # pg_reload_conf() only signals the postmaster; poll until this backend
+    # has processed the reload
+    deadline = time.monotonic() + timeout
+    while True:
+        cur.execute(done_sql, params)
+        if cur.fetchone()[0]:
+            return
+        assert time.monotonic() < deadline, "configuration reload not seen"
+        time.sleep(0.05)
+
+
+@contextmanager
+def server_settings(conn: psycopg.Connection, **settings) -> Iterator[None]:
+    """Apply pg_retry settings that can only change on reload, for the block."""
+    names = [f"pg_retry.{name}" for name in settings]
+    with conn.cursor() as cur:
+        for name, value in zip(names, settings.values()):
+            cur.execute(f"ALTER SYSTEM SET {name} = '{value}'")
+        cur.execute("SELECT pg_reload_conf()")
+        _wait_for_reload(
+            cur,
+            "SELECT bool_and(setting = v) FROM unnest(%s::text[], %s::text[]) AS s(n, v) "
+            "JOIN pg_settings ON name = n",
+            (names, [str(value) for value in settings.values()]),
+        )
+    try:
+        yield
+    finally:
+        with conn.cursor() as cur:
+            for name in names:
+                cur.execute(f"ALTER SYSTEM RESET {name}")
+            cur.execute("SELECT pg_reload_conf()")
+            _wait_for_reload(
+                cur,
+                "SELECT bool_and(source = 'default') FROM pg_settings WHERE name = ANY(%s)",
+                (names,),
+            )
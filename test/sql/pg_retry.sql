@@ -35,5 +35,176 @@ SELECT retry.retry('-- This comment has ; in it
 SELECT 42');
 -- Test 16: Still reject actual multiple statements
 SELECT retry.retry('SELECT 1; SELECT 2');
+-- before any statement is analyzed
+SELECT retry.retry('SELECT * FROM no_such_table; SELECT 2');
+-- Test 17: Repeated statements reuse the cached plan
+SELECT retry.retry('SELECT * FROM test_retry_table');
+-- Test 18: Cached plans are revalidated after DDL
+ALTER TABLE test_retry_table ADD COLUMN note TEXT;
+SELECT retry.retry('SELECT * FROM test_retry_table');
+-- Test 19: Plan cache can be disabled
+SET pg_retry.plan_cache = off;
+SELECT retry.retry('SELECT * FROM test_retry_table');
+RESET pg_retry.plan_cache;
+-- Test 20: Bind parameters with retry_params
+SELECT retry.retry_params('INSERT INTO test_retry_table (value) VALUES ($1)', ARRAY[40]);
+SELECT retry.retry_params('SELECT * FROM test_retry_table WHERE value > $1', ARRAY[15]);
+-- Test 21: Mixed parameter types via text[] and casts
+SELECT retry.retry_params('SELECT * FROM test_retry_table WHERE value = $1::int AND note IS DISTINCT FROM $2', ARRAY['40', 'x']);
+-- Test 22: NULL parameters are bound as SQL NULL
+SELECT retry.retry_params('SELECT 1 WHERE $1::int IS NULL', ARRAY[NULL::int]);
+-- Test 23: Reject a NULL params array
+SELECT retry.retry_params('SELECT 1', NULL::int[]);
+-- Test 24: Referencing a missing parameter fails
+SELECT retry.retry_params('SELECT $2::int', ARRAY[1]);
+-- Test 25: SQLSTATE lists are validated
+SELECT retry.retry('SELECT 1', 3, 10, 100, ARRAY['40p01', NULL]);
+SELECT retry.retry('SELECT 1', 3, 10, 100, ARRAY['4000']);
+SET pg_retry.default_sqlstates = '40001,nope';
+-- Test 26: Adaptive backoff falls back to the plain schedule without shared memory
+CREATE SEQUENCE adaptive_seq START 2;
+SET pg_retry.adaptive_backoff = on;
+SELECT retry.retry('SELECT 1 / (nextval(''adaptive_seq'') % 2)::int', 2, 1, 1, ARRAY['22012'], 'constant');
+RESET pg_retry.adaptive_backoff;
+DROP SEQUENCE adaptive_seq;
+-- Test 27: Every backoff strategy schedules a retry
+CREATE SEQUENCE backoff_seq START 2;
+SELECT retry.retry('SELECT 1 / (nextval(''backoff_seq'') % 2)::int', 2, 1, 1, ARRAY['22012'], 'exponential');
+SELECT retry.retry('SELECT 1 / (nextval(''backoff_seq'') % 2)::int', 2, 1, 1, ARRAY['22012'], 'Full_Jitter');
+SELECT retry.retry('SELECT 1 / (nextval(''backoff_seq'') % 2)::int', 2, 1, 1, ARRAY['22012'], 'equal_jitter');
+SELECT retry.retry('SELECT 1 / (nextval(''backoff_seq'') % 2)::int', 2, 1, 1, ARRAY['22012'], 'decorrelated_jitter');
+SELECT retry.retry('SELECT 1 / (nextval(''backoff_seq'') % 2)::int', 2, 1, 1, ARRAY['22012'], 'linear');
+SELECT retry.retry('SELECT 1 / (nextval(''backoff_seq'') % 2)::int', 2, 1, 1, ARRAY['22012'], 'constant');
+SELECT retry.retry('SELECT 1', 3, 10, 100, NULL, 'fibonacci');
+SET pg_retry.default_backoff_strategy = 'constant';
+SELECT retry.retry_params('SELECT $1::int / (nextval(''backoff_seq'') % 2)::int', ARRAY[1], 2, 1, 1, ARRAY['22012']);
+RESET pg_retry.default_backoff_strategy;
+DROP SEQUENCE backoff_seq;
+-- Test 28: Batches run each statement with retry and report per-statement counts
+SELECT * FROM retry.retry_batch(ARRAY[
+  'INSERT INTO test_retry_table (value) VALUES (50)',
+  'UPDATE test_retry_table SET value = value + 1 WHERE value = 50',
+  'SELECT * FROM test_retry_table'
+]);
+SELECT * FROM retry.retry_batch(ARRAY['INSERT INTO test_retry_table (value) VALUES (60)', 'COMMIT']);
+SELECT count(*) FROM test_retry_table WHERE value = 60;
+SELECT * FROM retry.retry_batch(ARRAY['SELECT 1', NULL]);
+SELECT * FROM retry.retry_batch('{}'::text[]);
+-- Test 29: Read-only fast path and single-attempt calls
+SELECT retry.retry('SELECT * FROM test_retry_table WHERE value > 15');
+SELECT retry.retry('SELECT * FROM test_retry_table FOR UPDATE');
+SELECT retry.retry('WITH moved AS (UPDATE test_retry_table SET value = value WHERE value = 10 RETURNING *) SELECT * FROM moved');
+SELECT retry.retry('UPDATE test_retry_table SET value = value WHERE value = 20', 1);
+SELECT retry.retry('SELECT 1/0', 1);
+-- Test 30: retry_query returns the rows of the successful attempt
+SELECT * FROM retry.retry_query('SELECT id, value FROM test_retry_table WHERE value < 35 ORDER BY value') AS t(id int, value int);
+SELECT * FROM retry.retry_query('UPDATE test_retry_table SET value = 31 WHERE value = 30 RETURNING value') AS t(value int);
+CREATE SEQUENCE query_seq;
+SELECT * FROM retry.retry_query('SELECT g, 1 / (nextval(''query_seq'') - 2) FROM generate_series(1, 3) g', 2, 1, 1, ARRAY['22012']) AS t(g int, q bigint);
+DROP SEQUENCE query_seq;
+SELECT * FROM retry.retry_query('SELECT id, value FROM test_retry_table') AS t(id int, value text);
+SELECT * FROM retry.retry_query('UPDATE test_retry_table SET value = value') AS t(value int);
+-- Test 31: A deadline bounds the whole call, attempts and backoff included
+SELECT retry.retry('SELECT pg_sleep(5)', 3, 10, 10, ARRAY['57014'], NULL, 1);
+SELECT retry.retry('SELECT 1', 3, 10, 10, NULL, NULL, 1000);
+SELECT retry.retry('SELECT 1', 3, 10, 10, NULL, NULL, -1);
+-- Test 32: Retry reports follow pg_retry.log_level
+SELECT retry.retry('SELECT 1/0', 2, 1, 1, ARRAY['22012']);
+SET pg_retry.log_level = 'off';
+SELECT retry.retry('SELECT 1/0', 2, 1, 1, ARRAY['22012']);
+SET pg_retry.log_level = 'loud';
+RESET pg_retry.log_level;
+-- Test 33: Named policies, with explicit arguments taking precedence
+SELECT retry.create_policy('div_zero', 2, 1, 1, ARRAY['22012']);
+SELECT retry.retry('SELECT 1/0', policy => 'div_zero');
+SELECT retry.retry('SELECT 1/0', 1, policy => 'div_zero');
+SELECT retry.create_policy('div_zero', 3, 1, 1, ARRAY['22012']);
+SELECT retry.retry('SELECT 1/0', policy => 'div_zero');
+SELECT retry.retry_params('SELECT $1::int', ARRAY[7], policy => 'div_zero');
+SELECT retry.retry('SELECT 1', policy => 'missing');
+SELECT retry.create_policy('bad', strategy => 'fibonacci');
+SELECT retry.create_policy('bad', base_delay_ms => 10, max_delay_ms => 5);
+SELECT retry.drop_policy('div_zero');
+SELECT retry.drop_policy('div_zero');
+-- Test 34: pg_retry.auto retries top-level data-modifying statements
+CREATE SEQUENCE auto_seq;
+CREATE TABLE auto_table (id int, val int);
+INSERT INTO auto_table VALUES (1, 0);
+SET pg_retry.default_sqlstates = '22012';
+SET pg_retry.default_base_delay_ms = 1;
+SET pg_retry.default_max_delay_ms = 1;
+SET pg_retry.auto = on;
+UPDATE auto_table SET val = 1 / (nextval('auto_seq') - 1)::int;
+SELECT val FROM auto_table;
+UPDATE auto_table SET val = 1 / (nextval('auto_seq') - 3)::int RETURNING val;
+RESET pg_retry.auto;
+RESET pg_retry.default_max_delay_ms;
+RESET pg_retry.default_base_delay_ms;
+RESET pg_retry.default_sqlstates;
+DROP TABLE auto_table;
+DROP SEQUENCE auto_seq;
+-- Test 35: retry_async needs the shared memory of a preloaded library
+SELECT retry.retry_async('INSERT INTO test_retry_table (value) VALUES (35)');
+SELECT * FROM retry.async_status(1);
+-- Test 36: Idempotent batches share one subtransaction per attempt
+CREATE SEQUENCE batch_seq;
+SELECT * FROM retry.retry_batch(ARRAY[
+  'INSERT INTO test_retry_table (value) VALUES (36)',
+  'SELECT 1 / (nextval(''batch_seq'') - 1)::int'],
+  3, 1, 1, ARRAY['22012'], idempotent => true);
+SELECT count(*) FROM test_retry_table WHERE value = 36;
+DROP SEQUENCE batch_seq;
+-- Test 37: Subtransactions are counted per transaction, with a warning near the subxid cache size
+SET pg_retry.subxact_warning_threshold = 2;
+BEGIN;
+SELECT retry.retry('INSERT INTO test_retry_table (value) VALUES (37)');
+SELECT subxacts, cached_subxids, cache_size, overflowed FROM retry.subxact_usage();
+SELECT retry.retry('INSERT INTO test_retry_table (value) VALUES (37)');
+SELECT retry.retry('INSERT INTO test_retry_table (value) VALUES (37)');
+SELECT * FROM retry.retry_batch(ARRAY['SELECT 1', 'SELECT 2'], idempotent => true);
+SELECT subxacts, cached_subxids FROM retry.subxact_usage();
+COMMIT;
+SELECT subxacts, cached_subxids FROM retry.subxact_usage();
+RESET pg_retry.subxact_warning_threshold;
+-- Test 38: Per-SQLSTATE settings of a named policy
+SELECT retry.create_policy('per_code', 1, 1, 1, sqlstate_policy => '{"22012": {"max_tries": 3, "max_delay_ms": 1}}');
+SELECT retry.retry('SELECT 1/0', policy => 'per_code');
+SELECT retry.create_policy('bad', sqlstate_policy => '{"2201": {}}');
+SELECT retry.create_policy('bad', sqlstate_policy => '{"22012": {"tries": 2}}');
+SELECT retry.create_policy('bad', sqlstate_policy => '{"22012": {"max_tries": 0}}');
+SELECT retry.create_policy('bad', sqlstate_policy => '["22012"]');
+SELECT retry.drop_policy('per_code');
+-- Test 39: Serialization failures under REPEATABLE READ are not retried unless snapshot_fail_fast is off
+CREATE FUNCTION raise_serialization_failure() RETURNS int LANGUAGE plpgsql AS $$ BEGIN RAISE EXCEPTION 'could not serialize access' USING ERRCODE = '40001'; END $$;
+BEGIN ISOLATION LEVEL REPEATABLE READ;
+SELECT retry.retry('SELECT raise_serialization_failure()', 2, 1, 1);
+ROLLBACK;
+SET pg_retry.snapshot_fail_fast = off;
+BEGIN ISOLATION LEVEL REPEATABLE READ;
+SELECT retry.retry('SELECT raise_serialization_failure()', 2, 1, 1);
+ROLLBACK;
+RESET pg_retry.snapshot_fail_fast;
+DROP FUNCTION raise_serialization_failure();
+-- Test 40: retry_xact reruns the whole group after a failure in any statement
+CREATE SEQUENCE xact_seq;
+SELECT retry.retry_xact(ARRAY[
+  'INSERT INTO test_retry_table (value) VALUES (40), (40)',
+  'SELECT 1 / (nextval(''xact_seq'') - 1)::int'],
+  3, 1, 1, ARRAY['22012']);
+SELECT count(*) FROM test_retry_table WHERE value = 40;
+SELECT retry.retry_xact(ARRAY[
+  'INSERT INTO test_retry_table (value) VALUES (41)',
+  'SELECT 1/0'], 3, 1, 1, ARRAY['40001']);
+SELECT count(*) FROM test_retry_table WHERE value = 41;
+SET pg_retry.plan_cache = off;
+SELECT retry.retry_xact(ARRAY[
+  'INSERT INTO test_retry_table (value) VALUES (42)',
+  'SELECT 1 / (nextval(''xact_seq'') - 3)::int'],
+  3, 1, 1, ARRAY['22012']);
+RESET pg_retry.plan_cache;
+SELECT count(*) FROM test_retry_table WHERE value = 42;
+SELECT retry.retry_xact(ARRAY['SELECT 1', NULL]);
+SELECT retry.retry_xact(ARRAY['SELECT 1', 'COMMIT']);
+DROP SEQUENCE xact_seq;
 -- Clean up
 DROP TABLE test_retry_table;